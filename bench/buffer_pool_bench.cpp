@@ -0,0 +1,106 @@
+/**
+ *  Pushes packets through tn::buffer allocation and release with the pool
+ *  enabled and disabled, and reports how often the heap was hit.
+ *
+ *  Each packet is allocated with room for the headers in front, referenced
+ *  once more by a subbuf of its payload while it sits in a window, and
+ *  released when the window moves past it.  The handoff runs allocate on one
+ *  thread and release on another, as packets read by the read thread are
+ *  released by the node thread.
+ *
+ *  Usage: buffer_pool_bench [packets] [window]
+ */
+#include <tornet/buffer.hpp>
+#include "../src/buffer_pool.hpp"
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <chrono>
+#include <vector>
+#include <deque>
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace {
+  const uint32_t payload_sizes[] = { 40, 1200, 1400, 200, 8000 };
+  const uint32_t num_sizes       = sizeof(payload_sizes)/sizeof(payload_sizes[0]);
+
+  tn::buffer make_packet( uint32_t i ) {
+    tn::buffer b( payload_sizes[i % num_sizes], 64, 16 );
+    b[0] = char(i);
+    return b;
+  }
+
+  void same_thread( uint32_t packets, uint32_t window ) {
+    // filled as packets arrive, a default buffer would allocate too
+    std::vector<tn::buffer> win;
+    win.reserve( window );
+    for( uint32_t i = 0; i < packets; ++i ) {
+      tn::buffer b = make_packet(i);
+      if( win.size() < window ) win.push_back( b.subbuf( 8 ) );
+      else                      win[i % window] = b.subbuf( 8 );
+    }
+  }
+
+  void handoff( uint32_t packets, uint32_t window ) {
+    boost::mutex                 m;
+    boost::condition_variable    cv;
+    std::deque<tn::buffer>       q;
+    bool                         done = false;
+
+    boost::thread consumer( [&]() {
+      std::deque<tn::buffer> batch;
+      for(;;) {
+        {
+          boost::unique_lock<boost::mutex> lock(m);
+          while( q.empty() && !done ) cv.wait(lock);
+          if( q.empty() ) return;
+          batch.swap(q);
+        }
+        cv.notify_all();
+        batch.clear();
+      }
+    });
+    for( uint32_t i = 0; i < packets; ++i ) {
+      tn::buffer b = make_packet(i);
+      boost::unique_lock<boost::mutex> lock(m);
+      while( q.size() >= window ) cv.wait(lock);
+      q.push_back( b.subbuf( 8 ) );
+      if( q.size() == 1 ) cv.notify_all();
+    }
+    {
+      boost::unique_lock<boost::mutex> lock(m);
+      done = true;
+    }
+    cv.notify_all();
+    consumer.join();
+  }
+
+  void report( const char* name, bool pooled, void (*run)(uint32_t,uint32_t), uint32_t packets, uint32_t window ) {
+    tn::detail::buffer_pool::set_enabled( pooled );
+    uint64_t a0 = tn::buffer::heap_allocs();
+    auto     t0 = std::chrono::steady_clock::now();
+    run( packets, window );
+    double   secs   = std::chrono::duration<double>( std::chrono::steady_clock::now() - t0 ).count();
+    uint64_t allocs = tn::buffer::heap_allocs() - a0;
+    printf( "%-12s %-5s %14.6f %14.0f\n", name, pooled ? "on" : "off",
+            double(allocs) / packets, packets / secs );
+  }
+}
+
+int main( int argc, char** argv ) {
+  uint32_t packets = argc > 1 ? strtoul( argv[1], 0, 10 ) : 2000000;
+  uint32_t window  = argc > 2 ? strtoul( argv[2], 0, 10 ) : 1024;
+  if( !packets || !window ) {
+    fprintf( stderr, "packets and window must be positive\n" );
+    return 1;
+  }
+
+  printf( "%u packets, window %u\n", packets, window );
+  printf( "%-12s %-5s %14s %14s\n", "run", "pool", "allocs/packet", "packets/sec" );
+  report( "same thread", false, same_thread, packets, window );
+  report( "same thread", true,  same_thread, packets, window );
+  report( "handoff",     false, handoff,     packets, window );
+  report( "handoff",     true,  handoff,     packets, window );
+  return 0;
+}
@@ -0,0 +1,43 @@
+/**
+ *  Measures rank_miner's hash rate for every thread count up to the number
+ *  of cores, searching for a 256 byte (RSA sized) and a 32 byte key.
+ *
+ *  Usage: rank_miner_bench [seconds per run]
+ */
+#include "../src/rank_miner.hpp"
+#include <fc/thread.hpp>
+#include <fc/time.hpp>
+#include <boost/thread/thread.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+
+int main( int argc, char** argv ) {
+  int      secs  = argc > 1 ? atoi( argv[1] ) : 3;
+  uint32_t cores = (std::max)( boost::thread::hardware_concurrency(), 1u );
+
+  const uint32_t key_sizes[] = { 256, 32 };
+  for( uint32_t k = 0; k < sizeof(key_sizes)/sizeof(key_sizes[0]); ++k ) {
+    std::vector<char> key( key_sizes[k] );
+    for( uint32_t i = 0; i < key.size(); ++i ) key[i] = char(rand());
+
+    printf( "%u byte key\n", key_sizes[k] );
+    printf( "%8s %14s %14s\n", "threads", "hashes/sec", "per thread" );
+    double one = 0;
+    for( uint32_t n = 1; n <= cores; ++n ) {
+      // never beaten, so the found handler stays out of the measurement
+      uint64_t start[2] = { 0, 0 };
+      tn::rank_miner m( key, start, 160, [](const uint64_t*){} );
+
+      // just under n cores worth so rounding can not add a thread, every
+      // thread runs 99.9% of the time
+      m.start( (n - 0.001) / cores );
+      fc::usleep( fc::seconds(secs) );
+      double rate = m.hash_rate();
+      m.stop();
+
+      if( n == 1 ) one = rate;
+      printf( "%8u %14.0f %14.0f  %.2fx\n", n, rate, rate / n, one ? rate / one : 0 );
+    }
+  }
+  return 0;
+}
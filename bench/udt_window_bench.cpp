@@ -0,0 +1,120 @@
+/**
+ *  Measures the udt_channel window structures under loss.
+ *
+ *  A sender keeps every packet of a window in a seq_ring, the receiver
+ *  records the lost ones in a miss_list and acks the window with a selective
+ *  ack that the sender unpacks.  The sender then retransmits the holes and
+ *  drops everything acked from the ring.
+ *
+ *  Usage: udt_window_bench [packets] [window]
+ */
+#include <tornet/miss_list.hpp>
+#include "../src/seq_ring.hpp"
+#include <chrono>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace tn;
+typedef miss_list::seq_num seq_num;
+
+namespace {
+  struct pkt { uint32_t len; uint32_t sent; };
+
+  // xorshift, so every run loses the same packets
+  uint32_t rnd_state = 2463534242u;
+  uint32_t rnd() {
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state;
+  }
+
+  struct result {
+    uint64_t ops;
+    uint64_t lost;
+    uint64_t sack_bytes;
+    uint64_t sacks;
+    double   secs;
+  };
+
+  result run( uint32_t packets, uint32_t window, double loss ) {
+    result r = { 0, 0, 0, 0, 0 };
+    seq_ring<pkt> ring;
+    miss_list     rx_miss, tx_miss;
+    // room for a bitmap of the whole window, so no ack is truncated
+    std::vector<char> sack( miss_list::sack_header(true) + window/8 + 1 );
+    uint32_t      threshold = uint32_t( loss * 4294967295.0 );
+    uint32_t      next = 0xffff0000u; // wraps during the run
+
+    auto t0 = std::chrono::steady_clock::now();
+    for( uint32_t sent = 0; sent < packets; sent += window ) {
+      seq_num first(next);
+      for( uint32_t i = 0; i < window; ++i, ++next ) {
+        pkt p = { 1200, next };
+        ring.insert( next, p );
+        if( rnd() < threshold ) {
+          rx_miss.add( seq_num(next), seq_num(next) );
+          ++r.lost;
+        }
+        r.ops += 2;
+      }
+
+      seq_num  last = seq_num(next) - 1, described;
+      bool     more = false;
+      uint32_t len  = rx_miss.pack_sack( &sack.front(), sack.size() );
+      if( len ) {
+        if( !tx_miss.unpack_sack( &sack.front(), len, true, first, described, more ) || more ) {
+          fprintf( stderr, "selective ack did not round trip\n" );
+          exit(1);
+        }
+        r.sack_bytes += len;
+        ++r.sacks;
+        ++r.ops;
+      }
+
+      // everything not missing was received
+      for( seq_num s = first; s <= last; ++s ) {
+        if( !tx_miss.contains(s) ) ring.erase( s.value() );
+        r.ops += 2;
+      }
+      // retransmit the holes, all of which arrive this time
+      seq_num s;
+      while( tx_miss.pop_front(s) ) {
+        if( !ring.find( s.value() ) ) {
+          fprintf( stderr, "hole %u is not in the ring\n", s.value() );
+          exit(1);
+        }
+        rx_miss.remove(s);
+        ring.erase( s.value() );
+        r.ops += 4;
+      }
+      tx_miss.clear();
+      if( ring.size() || rx_miss.size() ) {
+        fprintf( stderr, "window not drained\n" );
+        exit(1);
+      }
+    }
+    r.secs = std::chrono::duration<double>( std::chrono::steady_clock::now() - t0 ).count();
+    return r;
+  }
+}
+
+int main( int argc, char** argv ) {
+  uint32_t packets = argc > 1 ? strtoul( argv[1], 0, 10 ) : 4000000;
+  uint32_t window  = argc > 2 ? strtoul( argv[2], 0, 10 ) : 8192;
+  if( !window || window > miss_list::max_span32 ) {
+    fprintf( stderr, "window must be between 1 and %u\n", uint32_t(miss_list::max_span32) );
+    return 1;
+  }
+
+  const double losses[] = { 0.01, 0.05 };
+  printf( "%u packets, window %u\n", packets, window );
+  printf( "%6s %10s %14s %10s %10s\n", "loss", "lost", "ops/sec", "sacks", "sack bytes" );
+  for( uint32_t i = 0; i < sizeof(losses)/sizeof(losses[0]); ++i ) {
+    result r = run( packets, window, losses[i] );
+    printf( "%5.0f%% %10llu %14.0f %10llu %10.1f\n", losses[i]*100, (unsigned long long)r.lost,
+            r.ops / r.secs, (unsigned long long)r.sacks, r.sacks ? double(r.sack_bytes) / r.sacks : 0.0 );
+  }
+  return 0;
+}
@@ -9,11 +9,28 @@ namespace tn {
   /**
    *  To prevent copying data around, the buffer object
    *  maintains a shared pointer to a larger packet structure. 
+   *
+   *  The packet storage comes from a pool with 64, 256, 2048 and 9216 byte
+   *  size classes and returns to the pool when the last buffer referencing
+   *  it is destroyed.  The default constructor always provides default_size
+   *  bytes, the others pick the smallest class that fits.  The largest class
+   *  holds a jumbo frame.
+   *
+   *  Storage in front of and behind the data is headroom and tailroom.  Lower
+   *  layers grow a buffer into it with move_start() and resize() to add their
+   *  headers and padding in place.
    */
   struct buffer {
+    enum {
+      default_size = 2048,
+      max_size     = 9216
+    };
+
     buffer();
     buffer( const fc::string& d );
     buffer( uint32_t len );
+    /// len bytes with at least headroom bytes in front and tailroom behind
+    buffer( uint32_t len, uint32_t headroom, uint32_t tailroom );
     buffer( const char* d, uint32_t dl );
     buffer( const buffer& b );
     ~buffer();
@@ -21,8 +38,12 @@ namespace tn {
     buffer subbuf( int32_t s, uint32_t l = -1 )const;
 
     void move_start( int32_t sdif );
+    /// shrinks, or grows into the tailroom
     void resize( uint32_t s );
 
+    uint32_t headroom()const;
+    uint32_t tailroom()const;
+
     const char& operator[](int i)const { return start[i]; }
     char&       operator[](int i)      { return start[i]; }
 
@@ -33,6 +54,9 @@ namespace tn {
     buffer& operator=( buffer&& b );
     buffer& operator=( const buffer& b );
 
+    /// number of times the pool had to allocate storage from the heap
+    static uint64_t heap_allocs();
+
     private:
       char*              start;
       uint32_t           len;
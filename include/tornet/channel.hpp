@@ -6,6 +6,7 @@
 //#include <fc/function.hpp>
 #include <functional>
 
+namespace fc { class thread; }
 
 namespace tn { 
   class node;
@@ -21,7 +22,8 @@ namespace tn {
    *  channel with a udt_channel which implements the UDT protocol. 
    *
    *  Channels are asynchronous and data is received with
-   *  via a callback which will be called by the node's thread. Your message
+   *  via a callback which will be called by the connection's thread, see 
+   *  get_thread(). Your message
    *  handler should not block because it will disrupt all other datastreams. If
    *  your service is unable to keep up with the incoming data then it should
    *  drop packets before blocking.
@@ -42,6 +44,15 @@ namespace tn {
         ok     = 0,
         closed = 1
       };
+
+      /**
+       *  Room send() needs in front of and behind a buffer's data to add the
+       *  channel and packet headers and the cipher padding in place.
+       */
+      enum {
+        send_headroom = 8,
+        send_tailroom = 7
+      };
       typedef fc::sha1                                         node_id;
       typedef std::function<void(const tn::buffer&,error_code)> recv_handler;
 
@@ -61,10 +72,33 @@ namespace tn {
 
       /// after calling this the receive handler will no longer be called
       void     close();
+
+      /**
+       *  Encrypts buf straight into the outgoing datagram when it has 
+       *  send_headroom and send_tailroom bytes to spare, which send() may 
+       *  overwrite.  Other buffers are copied first.  buf's data itself is
+       *  never modified so it may be kept and sent again.
+       */
       void     send( const tn::buffer& buf );
+
+      /**
+       *  Largest buffer send() delivers in a single datagram, it grows as the
+       *  connection discovers the path MTU.
+       */
+      uint32_t max_payload()const;
+
+      /**
+       *  Lets a protocol on top of the channel that measures the bandwidth to
+       *  the remote node record it in the node's peer db entry.
+       *
+       *  @param bytes_per_sec - the latest estimate, averaged with earlier ones
+       */
+      void     report_bandwidth( uint32_t bytes_per_sec );
       void     on_recv( const recv_handler& cb );
 
       node&    get_node()const;
+      /// the thread of the connection the channel runs over
+      fc::thread& get_thread()const;
 
     private:
       friend class node; // the only one with permission to create channels
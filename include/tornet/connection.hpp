@@ -3,17 +3,44 @@
 #include <fc/fwd.hpp>
 #include <fc/vector.hpp>
 #include <fc/optional.hpp>
+#include <fc/time.hpp>
 //#include <fc/any.hpp>
 #include <tornet/db/peer.hpp>
+#include <tornet/node.hpp>
 #include <tornet/channel.hpp>
 #include <tornet/host.hpp>
 #include <fc/signals.hpp>
 #include <tornet/service_client.hpp>
+#include <boost/shared_ptr.hpp>
 
 
+namespace fc { class blowfish; }
+
 namespace tn {
   class node;
   class buffer;
+  class packet_cipher;
+  struct pending_auth;
+
+  /**
+   *  A datagram on its way from the socket to a connection.  When the decrypt
+   *  stage of the receive pipeline has already decoded it, plain holds the
+   *  verified plaintext and rx_gen the generation of the key that decoded it.
+   *  The raw datagram is kept so that the connection can fall back to decoding
+   *  it inline if its key has changed since.
+   */
+  struct inbound_packet {
+    inbound_packet():rx_gen(0),seq(0),cid(0),priority(0){}
+    inbound_packet( const tn::buffer& b ):raw(b),rx_gen(0),seq(0),cid(0),priority(0){}
+
+    fc::ip::endpoint            ep;
+    tn::buffer                  raw;
+    fc::optional<tn::buffer>    plain;
+    uint32_t                    rx_gen;
+    uint64_t                    seq;      ///< of a sealed packet, 0 for blowfish
+    uint64_t                    cid;      ///< connection id removed from the front of raw, 0 if none
+    float                       priority;
+  };
 
   /**
    *  Manages internal state for a particular peer endpoint.
@@ -52,7 +79,17 @@ namespace tn {
           close_msg                = 5,
           update_rank              = 6,
           req_reverse_connect_msg  = 7,
-          req_connect_msg          = 8
+          req_connect_msg          = 8,
+          bundle_msg               = 9, // several small messages, see bundle_message()
+          mtu_probe_msg            = 10,// padded to a candidate path MTU, see start_mtu_search()
+          mtu_ack_msg              = 11,// confirms an mtu_probe_msg arrived
+          auth_v2_msg              = 12 // auth_msg signed with an Ed25519 identity
+        };
+
+        /// announced in the auth message, see db::peer::record::remote_features
+        enum feature_flags {
+          feature_bundle  = 0x01, // understands bundle_msg
+          feature_conn_id = 0x02  // announced a connection id, see migrate()
         };
 
         typedef fc::shared_ptr<connection> ptr;
@@ -61,15 +98,39 @@ namespace tn {
         connection( node& np, const fc::ip::endpoint& ep, const db::peer::ptr& pptr );
         connection( node& np, const fc::ip::endpoint& ep, const node_id& auth_id, state_enum init_state = connected );
         ~connection();
+
+        /**
+         *  Used by the node to keep idle connection objects on a free list:
+         *  recycle() releases all per-peer state, reinit() readies the object
+         *  for a new endpoint as if it had just been constructed.
+         */
+        void recycle();
+        void reinit( const fc::ip::endpoint& ep );
+
+        /// last time a packet arrived or we tried to advance the handshake
+        const fc::time_point& last_activity()const { return _last_activity; }
         
         node& get_node()const;
 
+        /**
+         *  The node shard that created the connection and runs it.  Apart from
+         *  send(), the connection may only be used on its shard's thread.
+         */
+        uint32_t    get_shard()const { return _shard; }
+        fc::thread& get_thread()const;
+
         fc::ip::endpoint get_endpoint()const;
         node_id          get_remote_id()const;
+        size_t           channel_count()const;
         uint8_t          get_remote_rank()const;
         state_enum       get_state()const;
         bool             is_behind_nat()const;
 
+        /// largest datagram known to reach the peer unfragmented
+        uint32_t         get_mtu()const;
+        /// largest message that fits one datagram of get_mtu() bytes with any cipher and connection id
+        uint32_t         max_message_size()const;
+
         // return false if state transitioned to failed, otherwise true
         bool auto_advance();
         void advance();
@@ -82,6 +143,17 @@ namespace tn {
         void handle_packet( const tn::buffer& b );
         bool decode_packet( const tn::buffer& b );
 
+        /**
+         *  Decrypts b in place and verifies its checksum.  This does not touch
+         *  any connection state so the decrypt stage may call it from its own
+         *  thread with its own copy of the key.
+         */
+        static bool decrypt_packet( fc::blowfish& bf, const tn::buffer& b );
+        bool dispatch_packet( const tn::buffer& b );
+        bool dispatch_message( uint8_t type, const tn::buffer& m );
+        /// checks seq against the replay window before dispatching plain
+        bool dispatch_sealed( const tn::buffer& plain, uint64_t seq );
+
         void handle_uninit( const tn::buffer& b ); 
         void handle_generated_dh( const tn::buffer& b ); 
         void handle_received_dh( const tn::buffer& b ); 
@@ -90,11 +162,15 @@ namespace tn {
 
         bool handle_data_msg( const tn::buffer& b );
         bool handle_auth_msg( const tn::buffer& b );
+        bool handle_auth_v2_msg( const tn::buffer& b );
         bool handle_auth_resp_msg( const tn::buffer& b );
         bool handle_close_msg( const tn::buffer& b );
         bool handle_lookup_msg( const tn::buffer& b );
         bool handle_route_msg( const tn::buffer& b );
         bool handle_update_rank_msg( const tn::buffer& b );
+        bool handle_bundle_msg( const tn::buffer& b );
+        bool handle_mtu_probe_msg( const tn::buffer& b );
+        bool handle_mtu_ack_msg( const tn::buffer& b );
 
         // requests the remote host attempt to connect to ep
         void request_reverse_connect(const fc::ip::endpoint& ep ); 
@@ -102,7 +178,8 @@ namespace tn {
         bool handle_request_reverse_connect_msg( const tn::buffer& b );
         bool handle_request_connect_msg( const tn::buffer& b );
 
-        void generate_dh();
+        /// @param peer_v2 - answering a key exchange that offered X25519
+        void generate_dh( bool peer_v2 = false );
         bool process_dh( const tn::buffer& b );
         void send_dh();
         void send_auth();
@@ -130,22 +207,81 @@ namespace tn {
         const db::peer::record&      get_db_record()const { return _record; }
         void set_priority( float p ) { _record.priority = p; }
         float priority()const { return _record.priority; }
+        /// averages bytes_per_sec into the record's est_bandwidth
+        void report_bandwidth( uint32_t bytes_per_sec );
+
+        size_t   pending_packets()const;
+        uint32_t next_packet_size()const;
+        /**
+         *  Queues p unless the connection's inbound ring is full.  A full ring
+         *  drops p, or with node::config::drop_data_first an older data packet 
+         *  if p is control traffic.
+         *
+         *  @return false if p was dropped
+         */
+        bool     post_packet( inbound_packet&& p );
+        void     process_next_message();
+
+        /**
+         *  State kept on behalf of the node's inbound scheduler.
+         */
+        struct sched_state {
+          sched_state():active(false),deficit(0){}
+          bool     active;   ///< on the node's list of connections with pending packets
+          int64_t  deficit;  ///< bytes that may still be processed this round
+        };
+        sched_state&                    get_sched_state()         { return _sched;   }
+        const node::connection_stats&   get_service_stats()const  { return _service; }
+
+        /**
+         *  Share of the node thread given to this connection relative to others 
+         *  with pending packets.  Grows with the kbucket priority and with the 
+         *  credit the peer has earned by providing us more than we provided it.
+         */
+        uint32_t sched_weight()const;
 
-        size_t pending_packets()const;
-        void post_packet( buffer&& b );
-        void process_next_message();
+        /// called by the scheduler on every visit, @return sched_weight()
+        uint32_t start_sched_round();
 
 
         void  add_client( const fc::shared_ptr<service_client>& c );
         fc::shared_ptr<service_client> get_client( const fc::string& name );
     private:
 
+        void  init( const fc::ip::endpoint& ep );
         void  goto_state( state_enum s );
-        db::peer::record _record;
-        uint16_t         _next_chan_num;
+        void  set_key( const char* key );
+        void  clear_key();
+        void  send_packet( const tn::buffer& m, proto_message_type t );
+        /// @param to - where to send it instead of the remote endpoint
+        void  send_direct( const char* c, uint32_t l, proto_message_type t, const fc::ip::endpoint* to = 0 );
+        bool  bundle_message( proto_message_type t, const char* hdr, uint32_t hdr_len,
+                              const char* m, uint32_t l );
+        void  flush_bundle();
+        void  drain_outbound();
+        bool  receive_auth( const tn::buffer& b, bool ed25519 );
+        void  finish_auth( uint32_t gen, const boost::shared_ptr<pending_auth>& a );
+        void  finish_send_auth( uint32_t gen, uint64_t utc_us, const fc::sha1& digest );
+        void  handle_cookie_challenge( const tn::buffer& b );
+        bool  migrate( const inbound_packet& p, inbound_packet& opened );
+        void  finish_migration();
+        void  set_local_cid( uint64_t cid );
+        void  start_mtu_search();
+        void  next_mtu_probe();
+        void  send_mtu_probe();
+        void  mtu_probe_timeout();
+        void  start_cipher();
+        void  publish_key();
+        uint8_t local_cipher_suites()const;
+        db::peer::record         _record;
+        uint16_t                 _next_chan_num;
+        sched_state              _sched;
+        uint32_t                 _shard;
+        node::connection_stats   _service;
+        fc::time_point           _last_activity;
 
         class impl;
-        fc::fwd<impl,696> my;
+        fc::fwd<impl,984> my;
   };
 }
 
@@ -32,6 +32,8 @@ namespace tn { namespace db {
         /// Valid of Public Key is not 0
         bool valid()const;
         fc::sha1 id()const;
+        /// bytes stored in the db, the unused tail of public_key is left out
+        uint32_t packed_size()const;
 
         fc::ip::endpoint last_ep; // must be first
         uint32_t         est_bandwidth; 
@@ -46,12 +48,18 @@ namespace tn { namespace db {
         uint8_t          firewalled;             
         uint8_t          rank;                   // the rank of this node
         uint8_t          published_rank;         // the rank last sent to this node of my node
-        char             public_key[256];        
         char             bf_key[56];             
         char             recv_btc[40];           // address to recv money from node id
         char             send_btc[40];           // address to send money to node id
         float            priority;               // sum of the below percentiles
         char             connected;              // 0 if not connected, else 1
+        uint8_t          cipher_suite;           // packet_cipher::suite negotiated with this peer, 0 for blowfish
+        uint8_t          remote_features;        // connection::feature_flags announced by this peer
+        uint16_t         max_datagram;           // largest datagram this peer receives, 0 if it did not say
+        uint64_t         local_cid;              // connection id this peer puts in front of our packets
+        uint64_t         remote_cid;             // connection id we put in front of its packets, 0 for none
+        uint16_t         key_len;                // bytes of public_key used, 256 for RSA or 32 for Ed25519
+        char             public_key[256];        // must be last, see packed_size()
       };
 
       peer( const fc::sha1& nid, const fc::path& dir );
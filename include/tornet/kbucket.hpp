@@ -48,6 +48,9 @@ namespace tn {
       void remove( connection* c );
       void update_priority( connection* c );
 
+      /// @return true if c is among the k highest priority connections of its bucket
+      bool holds_slot( const connection* c, uint32_t k );
+
       void  resort_buckets();
       std::vector<connection*>&  get_bucket_at_dist( const fc::sha1& dist );
 
@@ -1,13 +1,41 @@
 #ifndef _TORNET_UDT_MISS_LIST_HPP_
 #define _TORNET_UDT_MISS_LIST_HPP_
-#include <list>
+#include <vector>
+#include <algorithm>
 #include <stdint.h>
 #include <tornet/sequence_number.hpp>
 
 namespace tn {
+
+  /**
+   *  The set of missing sequence numbers of a udt_channel window.
+   *
+   *  Members are bits of a bitmap indexed by seq % capacity.  All members lie
+   *  within one capacity of each other, a member that would not doubles the
+   *  bitmap.  add, remove and contains cost O(1) per seq, pop_front and the
+   *  range iteration skip 64 non-members at a time.
+   */
   class miss_list {
     public:
-      typedef sequence::number<uint16_t> seq_num;
+      typedef sequence::number<uint32_t> seq_num;
+
+      enum sack_mode {
+        sack_runs   = 0,
+        sack_bitmap = 1,
+        /// flag, holes after the last described seq were left out
+        sack_more   = 0x80
+      };
+      /**
+       *  The widest udt_channel window with 32 and with 16 bit seqs, no
+       *  selective ack describes more.
+       */
+      enum { max_span32 = 1 << 20, max_span16 = 0x4000 };
+
+      /// bytes before the runs or bitmap
+      static uint32_t sack_header( bool seq32 ) { return 1 + 2*(seq32 ? sizeof(uint32_t) : sizeof(uint16_t)); }
+
+      miss_list();
+
       bool pop_front( seq_num& seq );
       uint32_t size()const;
 
@@ -17,40 +45,101 @@ namespace tn {
       void print()const;
       void clear();
 
+      /**
+       *  Finds the first range of members that starts at or after from.
+       *
+       *  @return false if there is none
+       */
+      bool find_range( seq_num from, seq_num& start, seq_num& end )const;
+
+      /**
+       *  Selective ack encoding that describes every member in at most
+       *  budget bytes when the holes allow it:
+       *
+       *    uint8_t   mode;     // sack_mode, with sack_more if truncated
+       *    seq_num   first;    // first member
+       *    seq_num   last;     // last seq described
+       *
+       *  first and last are sent as 32 bits, or the low 16 bits of them to
+       *  peers that only know 16 bit sequence numbers.
+       *    runs:     varints, alternating lengths of missing and received
+       *              runs starting at first with a missing one
+       *    bitmap:   bit i%8 of byte i/8 is set if first+i is missing
+       *
+       *  Runs take 2 bytes for every isolated hole and less for bursts, the
+       *  bitmap 1 bit for every seq between first and last, the shorter one
+       *  is sent.  If neither fits the one that describes more does,
+       *  truncated at a hole.
+       *
+       *  @return bytes written to out, 0 for an empty list
+       */
+      uint32_t pack_sack( char* out, uint32_t budget, bool seq32 = true )const;
+
+      /**
+       *  Replaces the list with the one a selective ack describes.
+       *
+       *  @param ref  - a seq near the described ones, 16 bit first and last
+       *               are widened against it
+       *  @param more - set if holes after last were left out
+       *  @return false if in is malformed or spans more than a window
+       */
+      bool unpack_sack( const char* in, uint32_t len, bool seq32, seq_num ref, seq_num& last, bool& more );
+
+      /**
+       *  Original format, limited to the first 128 ranges and the low 16 bits
+       *  of each seq.  Only sent to peers that read neither selective acks
+       *  nor 32 bit sequence numbers, the reader widens them against ref.
+       */
       template<typename Stream>
-      friend Stream& operator << ( Stream& s, const miss_list& n ) {
-        uint8_t len = (std::min)(seq_num(128),seq_num(n.m_ml.size())); 
+      void write_legacy( Stream& s )const {
+        seq_num  r[128][2];
+        uint8_t  len = 0;
+        seq_num  from = _first;
+        while( len < 128 && find_range( from, r[len][0], r[len][1] ) ) {
+          from = r[len][1] + 1;
+          if( r[len++][1] == _last ) break;
+        }
         s.write( (char*)&len, sizeof(len) );
-        mlist::const_iterator itr = n.m_ml.begin();
-        while( itr != n.m_ml.end() && len ) {
-          s.write( (const char*)&itr->first, sizeof(itr->first) );
-          s.write( (const char*)&itr->second, sizeof(itr->second) );
-          --len;
-          ++itr;
+        for( uint8_t i = 0; i < len; ++i ) {
+          uint16_t f = r[i][0].value(), l = r[i][1].value();
+          s.write( (const char*)&f, sizeof(f) );
+          s.write( (const char*)&l, sizeof(l) );
         }
-        return s;
       }
 
       template<typename Stream>
-      friend Stream& operator >> ( Stream& s, miss_list& n ) {
+      void read_legacy( Stream& s, seq_num ref ) {
         uint8_t len = 0;
         s.read( (char*)&len, sizeof(len) );
-        n.m_ml.resize(len);
-        mlist::const_iterator itr = n.m_ml.begin();
-        while( itr != n.m_ml.end() && len ) {
-          s.read( (char*)&itr->first, sizeof(itr->first) );
-          s.read( (char*)&itr->second, sizeof(itr->second) );
-          --len;
-          ++itr;
+        clear();
+        for( uint8_t i = 0; i < len; ++i ) {
+          uint16_t f, l;
+          s.read( (char*)&f, sizeof(f) );
+          s.read( (char*)&l, sizeof(l) );
+          seq_num first = sequence::widen( f, ref ), second = sequence::widen( l, ref );
+          if( first <= second ) add( first, second );
         }
-        return s;
       }
 
     private:
-      typedef std::list<std::pair<seq_num,seq_num> > mlist;
-      mlist m_ml;
+      uint32_t bits()const { return _bits.size() * 64; }
+      bool     test( seq_num s )const;
+      /// sets n bits starting at s, counting the new members
+      void     set_range( seq_num s, uint32_t n );
+      void     grow( uint32_t span );
+      /// first member at or after s, there must be one at or before _last
+      seq_num  next_member( seq_num s )const;
+      /// last member at or before s, there must be one at or after _first
+      seq_num  prev_member( seq_num s )const;
+      /// first non-member after s
+      seq_num  next_gap( seq_num s )const;
+
+      std::vector<uint64_t> _bits;
+      seq_num               _first;   // first member
+      seq_num               _last;    // last member
+      uint32_t              _count;
   };
 
-} // tornet 
+} // tornet
 
 #endif
@@ -1,11 +1,13 @@
 #pragma once
 #include <fc/shared_ptr.hpp>
 #include <functional>
+#include <vector>
 #include <fc/vector.hpp>
 #include <fc/sha1.hpp>
 #include <fc/ip.hpp>
 //#include <fc/any.hpp>
 #include <fc/optional.hpp>
+#include <fc/future.hpp>
 #include <fc/pke.hpp>
 #include <tornet/db/peer.hpp>
 #include <tornet/host.hpp>
@@ -24,6 +26,8 @@ namespace fc {
 namespace tn {
   class     channel;
   class     connection;
+  class     packet_cipher;
+  struct    buffer;
   namespace detail { class node_private; }
 
 
@@ -49,6 +53,240 @@ namespace tn {
       typedef fc::ip::endpoint                    endpoint;
       typedef std::function<void(const channel&)> new_channel_handler;
 
+      /**
+       *  Tuning parameters for the node's network I/O.
+       *
+       *  By default I/O is not batched, so there is still one syscall per
+       *  datagram and one read thread, and the path mtu is not probed.  The
+       *  following are on by default and differ from the original behavior:
+       *
+       *    - AEAD ciphers with peers that offer them, see cipher_suites
+       *    - bundling of small messages, see bundle_size
+       *    - the version 2 handshake, see handshake_version
+       *    - removal of idle connections and hibernation of idle peers, see 
+       *      idle_timeout_sec and hibernate_after_sec
+       *    - DH keypairs made ahead of time and auth messages signed and 
+       *      verified off the node thread, see dh_pool_size and crypto_threads
+       *    - cookie challenges for new endpoints beyond 
+       *      unverified_cons_per_sec
+       */
+      struct config {
+        config();
+
+        /// max datagrams moved per recvmmsg/sendmmsg call, 0 or 1 disables batching
+        uint32_t io_batch_size;
+
+        /**
+         *  Number of SO_REUSEPORT sockets, each read by its own thread.  Only
+         *  used with batched I/O.  With more than one, every socket also gets 
+         *  a thread that owns the connections whose endpoints hash to it, with
+         *  their channels, process queue and sendmmsg calls.  The id index, 
+         *  kbuckets and services stay on the node thread.
+         */
+        uint32_t io_shards;
+
+        /**
+         *  Number of threads that decrypt and verify datagrams between the sockets
+         *  and the connections' threads, 0 decrypts on the connections' threads.
+         *  Only used with batched I/O.
+         */
+        uint32_t decrypt_threads;
+
+        /// max batches waiting between two stages of the receive pipeline
+        uint32_t pipeline_depth;
+
+        /**
+         *  Bytes of inbound packets a connection of weight 1 may process each 
+         *  time the scheduler visits it, see connection::sched_weight().
+         */
+        uint32_t sched_quantum;
+
+        enum drop_policy {
+          tail_drop       = 0, ///< drop packets that arrive while the queue is full
+          drop_data_first = 1  ///< make room for control packets by dropping queued data
+        };
+
+        /// max packets queued per connection waiting for its thread
+        uint32_t inbound_queue_size;
+        /// a drop_policy
+        uint32_t inbound_drop_policy;
+
+        /**
+         *  Connections that are not connected and have received nothing for this
+         *  long are removed, 0 keeps them forever.
+         */
+        uint32_t idle_timeout_sec;
+        /// max removed connection objects kept for reuse
+        uint32_t connection_pool_size;
+        /**
+         *  New endpoints per second that get a connection on their first
+         *  packet.  Beyond that an endpoint must first echo a cookie, so a
+         *  flood from spoofed addresses allocates nothing and never reaches
+         *  the peer db.  0 asks every new endpoint for a cookie.
+         */
+        uint32_t unverified_cons_per_sec;
+
+        /**
+         *  Connected peers without open channels that have received nothing for 
+         *  this long are written to the peer db and freed unless they hold one 
+         *  of the kbucket_slots best slots in their kbucket.  0 disables.
+         */
+        uint32_t hibernate_after_sec;
+        uint32_t kbucket_slots;
+
+        /**
+         *  packet_cipher::suite flags announced during authentication.  Peers
+         *  that share a suite seal their packets with it, others fall back to
+         *  blowfish.  0 always uses blowfish.
+         */
+        uint32_t cipher_suites;
+
+        /**
+         *  Small messages to peers that understand bundles share a datagram of
+         *  at most bundle_size bytes with the ones sent right after them,
+         *  until the sending task yields.  bundle_delay_us holds them up to 
+         *  that long for more to arrive, which adds as much latency to a 
+         *  request.  A bundle_size of 0 sends every message on its own.
+         */
+        uint32_t bundle_delay_us;
+        uint32_t bundle_size;
+
+        /**
+         *  Every connection starts out sending datagrams of at most base_mtu 
+         *  bytes and, with batched I/O, probes the path for the largest size up
+         *  to max_mtu that arrives unfragmented.  The search is repeated every
+         *  pmtu_raise_sec in case the path improved.  max_mtu <= base_mtu 
+         *  disables probing.
+         */
+        uint32_t base_mtu;
+        uint32_t max_mtu;
+        uint32_t pmtu_raise_sec;
+
+        /**
+         *  Diffie-Hellman keypairs a background thread keeps ready for new
+         *  connections, 0 generates them on the node thread as needed.
+         */
+        uint32_t dh_pool_size;
+
+        /**
+         *  Threads that sign and verify auth messages, 0 does it on the node
+         *  thread.  The ranks and decoded Ed25519 keys of up to key_cache_size
+         *  verified peers are kept so that they re-authenticate without
+         *  recomputing them, a retransmitted auth message that verified
+         *  already is not checked again.  A new session's signature always is.
+         */
+        uint32_t crypto_threads;
+        uint32_t key_cache_size;
+
+        /**
+         *  2 offers X25519 key agreement in the key exchange and accepts
+         *  Ed25519 signed auth messages, 1 only speaks the original 
+         *  Diffie-Hellman/RSA handshake.
+         */
+        uint32_t handshake_version;
+        /**
+         *  Sign with an Ed25519 identity kept in datadir/identity.ed25519 
+         *  instead of the RSA one, which changes the node id.  Such a node
+         *  can only authenticate to handshake version 2 peers.
+         */
+        bool     ed25519_identity;
+
+        enum congestion_algorithm {
+          udt_daimd  = 0, ///< UDT's rate control, backs off on loss
+          bbr_pacing = 1  ///< paces at the measured bottleneck bandwidth, ignores loss
+        };
+        /// a congestion_algorithm, used by the sending side of every udt_channel
+        uint32_t udt_congestion;
+        /**
+         *  Memory the receive windows of all udt_channels in the process may
+         *  take up.  A window starts at the size its channel was opened with
+         *  and grows toward the measured bandwidth-delay product while this
+         *  allows.
+         */
+        uint32_t udt_rx_budget_mb;
+
+        /// size of the buffers datagrams are received into
+        uint32_t rx_buffer_size()const;
+      };
+
+      /**
+       *  Counters describing the node's network I/O since init().  The counters
+       *  are updated without locks so a snapshot may be slightly inconsistent.
+       */
+      struct stats {
+        enum { hist_buckets = 8, handshake_buckets = 12 };
+        stats();
+
+        uint64_t recv_calls;
+        uint64_t recv_packets;
+        uint64_t send_calls;
+        uint64_t send_packets;
+        /// bucket i counts calls that moved [2^i, 2^(i+1)) datagrams
+        uint64_t recv_batch_hist[hist_buckets];
+        uint64_t send_batch_hist[hist_buckets];
+
+        /// process wide count of tn::buffer storage taken from the heap
+        uint64_t buffer_heap_allocs;
+
+        /// datagrams dropped because the decrypt stage was full
+        uint64_t pipeline_drops;
+        /// datagrams decoded by the decrypt stage, and those it could not decode
+        uint64_t pipeline_decrypted;
+        uint64_t pipeline_decrypt_failures;
+
+        /// packets dropped because a connection's inbound queue was full
+        uint64_t inbound_drops;
+
+        uint64_t connections;          ///< endpoints with a connection object
+        uint64_t free_connections;     ///< connection objects waiting for reuse
+        uint64_t recycled_connections; ///< idle connections removed
+        uint64_t reused_connections;   ///< new connections that reused an object
+        uint64_t cookies_verified;     ///< new connections admitted by a cookie echo
+        uint64_t cookies_rejected;     ///< cookie echoes that were forged or expired
+        uint64_t hibernated_connections; ///< connected peers freed while idle
+        uint64_t rehydrated_connections; ///< connections resumed from a stored key
+        uint64_t migrated_connections; ///< connections moved to a peer's new endpoint
+        uint64_t replayed_packets;     ///< sealed packets refused by a replay window
+        uint64_t bundles_sent;         ///< datagrams carrying more than one message
+        uint64_t bundled_messages;     ///< messages sent in those datagrams
+        uint64_t mtu_probes;           ///< path MTU probes sent
+
+        uint64_t dh_pool_hits;         ///< key exchanges that found a keypair ready
+        uint64_t dh_pool_misses;       ///< key exchanges that had to generate one
+        uint64_t crypto_jobs;          ///< signatures made or checked by the crypto pool
+        uint64_t key_cache_hits;       ///< auth messages whose sender's key was cached
+        uint64_t x25519_exchanges;     ///< key exchanges that agreed on an X25519 key
+        /**
+         *  Time from generating our keypair to connected, bucket i counts 
+         *  handshakes that took [2^i, 2^(i+1)) ms, the first also faster ones
+         *  and the last slower ones.
+         */
+        uint64_t handshake_hist[handshake_buckets];
+
+        uint32_t rank;
+        uint64_t rank_hashes;          ///< nonces tried by start_rank_search()
+        double   rank_hash_rate;       ///< nonces per second since the last start_rank_search()
+      };
+
+      /**
+       *  How much of its thread one connection's inbound packets have
+       *  used.  Used to check that the inbound scheduler is fair.
+       */
+      struct connection_stats {
+        connection_stats();
+
+        endpoint  ep;
+        id_type   id;
+        uint32_t  weight;         ///< current share given by the scheduler
+        uint64_t  packets;
+        uint64_t  bytes;
+        uint64_t  service_us;     ///< total time spent handling packets
+        uint64_t  max_service_us; ///< longest time spent on one packet
+        uint64_t  rounds;         ///< times the scheduler visited the connection
+        uint64_t  dropped;        ///< packets dropped by a full inbound queue
+        uint32_t  mtu;            ///< largest datagram known to reach the peer
+      };
+
       node();
       ~node();
 
@@ -57,6 +295,7 @@ namespace tn {
       const id_type& get_id()const;
 
       fc::thread&    get_thread()const;
+      const config&  get_config()const;
       peer_db_ptr    get_peers()const;
       fc::path       datadir()const;
 
@@ -65,8 +304,12 @@ namespace tn {
       /**
        * @param ddir - data directory where identity information is stored.
        * @param port - send/recv messages via this port.
+       * @param cfg  - I/O tuning parameters
        */
-      void     init( const fc::path& ddir, uint16_t port );
+      void     init( const fc::path& ddir, uint16_t port, const config& cfg = config() );
+
+      stats    get_stats()const;
+      fc::vector<connection_stats> get_connection_stats()const;
 
       void     start_rank_search( double effort = 1 );
       uint32_t rank()const;
@@ -147,6 +390,35 @@ namespace tn {
        */
       void close_service( uint16_t service_channel_num );
 
+      /**
+       *  Non-blocking versions of the calls above.  Each copies its arguments,
+       *  posts the call to the node thread and returns immediately.
+       */
+      fc::future<id_type>                      connect_to_async( const endpoint& ep );
+      fc::future<id_type>                      connect_to_async( const endpoint& ep, const endpoint& nat_into_ep );
+      fc::future<channel>                      open_channel_async( const fc::sha1& node_id, uint16_t remote_chan_num );
+      fc::future<fc::vector<host> >            find_nodes_near_async( const id_type& target, uint32_t n, 
+                                                                      const fc::optional<id_type>& limit = fc::optional<id_type>() );
+      fc::future<fc::vector<host> >            remote_nodes_near_async( const id_type& rnode, const id_type& target, uint32_t n, 
+                                                                        const fc::optional<id_type>& limit = fc::optional<id_type>() );
+      fc::future<fc::vector<fc::sha1> >        get_kbucket_async( int bucket, int max );
+      fc::future<fc::vector<db::peer::record> > active_peers_async()const;
+      fc::future<void>                         start_service_async( uint16_t service_chan_num, const fc::string& service_name, 
+                                                                    const new_channel_handler& on_new_channel );
+
+      typedef std::function<void()> operation;
+
+      /**
+       *  Runs every op on the node thread after a single hop.  Each op runs in
+       *  its own task so ops that wait on the network overlap rather than
+       *  queue behind each other.  Because ops run on the node thread they may
+       *  call the blocking methods of this class without any further hops.
+       *
+       *  @return a future that completes when every op has returned, carrying
+       *          the first exception thrown by any of them.
+       */
+      fc::future<void> run_batch( const std::vector<operation>& ops );
+
       /**
        *  @return the endpoint that our UDP packets come from.
        */
@@ -178,6 +450,11 @@ namespace tn {
       void                     update_dist_index( const id_type& id, connection* c );
       channel                  create_channel( connection* c, uint16_t rcn, uint16_t lcn );
       void                     send( const char* d, uint32_t l, const fc::ip::endpoint& );
+      /// sends b without copying it when batched I/O is enabled
+      void                     send( const tn::buffer& b, const fc::ip::endpoint& );
+      uint32_t                 publish_rx_key( const fc::ip::endpoint& ep, const char* key, float priority,
+                                               const packet_cipher* sealed = 0, uint64_t cid = 0 );
+      void                     retract_rx_key( const fc::ip::endpoint& ep );
       fc::signature_t          sign( const fc::sha1& h );
       const fc::public_key_t&  pub_key()const;
       const fc::private_key_t& priv_key()const;
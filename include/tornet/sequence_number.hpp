@@ -166,6 +166,22 @@ namespace sequence {
     bool operator> ( U sequence ) const {return distance( sequence ) <  0; }
     }; // sequence::number
 
+    //
+    // sequence::widen        -- Recover a wide sequence number from its low bits
+    //
+    //     A protocol may send only the low bits W of a wider sequence number T.  The receiver
+    // restores the full number from a reference it tracks itself (eg. the last sequence number
+    // received), picking the one nearest to the reference whose low bits match.  This is right
+    // as long as the number is within 2^(N-1) of the reference, N being the bits of W.
+    //
+    template < typename T, typename W >
+    number<T> widen( W low, const number<T>& ref ) {
+      typedef typename boost::make_unsigned<T>::type U;
+      typedef typename boost::make_unsigned<W>::type UW;
+      typedef typename boost::make_signed<W>::type   SW;
+      return number<T>( U( ref.value() + U( SW( UW( UW(low) - UW(ref.value()) ) ) ) ) );
+    }
+
 /** 
  sequence::ordering
 
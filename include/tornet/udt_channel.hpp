@@ -14,7 +14,12 @@ namespace tn {
   class udt_channel {
     public:
       udt_channel();
-      udt_channel( const channel& c, uint16_t max_window_packets = 4096 );
+      /**
+       *  @param max_window_packets - receive window the channel starts with,
+       *    it grows to cover the bandwidth-delay product of the stream within
+       *    node::config::udt_rx_budget_mb.
+       */
+      udt_channel( const channel& c, uint32_t max_window_packets = 4096 );
       udt_channel( const udt_channel& u );
       udt_channel( udt_channel&& u );
       ~udt_channel();
@@ -1,49 +1,69 @@
 #include <tornet/buffer.hpp>
-#include <boost/array.hpp>
-#include <boost/shared_ptr.hpp>
-#include <boost/make_shared.hpp>
+#include "buffer_pool.hpp"
 #include <fc/fwd_impl.hpp>
 #include <fc/string.hpp>
 #include <fc/exception.hpp>
+#include <boost/assert.hpp>
+#include <boost/static_assert.hpp>
 #include <string.h>
 
-
-typedef boost::array<char,2048> buffer_data;
-
 namespace tn {
-    buffer::~buffer(){}
+    using detail::buffer_block;
+    using detail::buffer_pool;
+
+    BOOST_STATIC_ASSERT( uint32_t(buffer::max_size) == uint32_t(buffer_pool::max_size) );
 
+    /**
+     *  Holds one reference to a pooled block, the block goes back to the
+     *  pool when the last buffer referencing it is destroyed.
+     */
     class buffer::impl {
       public:
-        template<typename T>
-        impl( T&& t ):ptr( fc::forward<T>(t) ){}
-        boost::shared_ptr<buffer_data> ptr;
+        impl( buffer_block* b ):block(b){}
+        impl( const impl& i ):block(i.block) {
+          if( block ) block->retain();
+        }
+        ~impl() {
+          if( block ) block->release();
+        }
+        impl& operator=( const impl& i ) {
+          if( i.block ) i.block->retain();
+          if( block )   block->release();
+          block = i.block;
+          return *this;
+        }
+        buffer_block* block;
     };
 
+    buffer::~buffer(){}
+
     buffer::buffer()
-    :shared_data( boost::make_shared<buffer_data>() ){
-        start = shared_data->ptr->c_array(); 
-        len   = shared_data->ptr->size();
+    :shared_data( buffer_pool::alloc( default_size ) ){
+        start = shared_data->block->data();
+        len   = shared_data->block->capacity();
     }
-    buffer::buffer( const fc::string& d ) 
-    :shared_data( boost::make_shared<buffer_data>() ){
-        BOOST_ASSERT( d.size() <= sizeof(buffer_data) );
-        start = shared_data->ptr->c_array(); 
+    buffer::buffer( const fc::string& d )
+    :shared_data( buffer_pool::alloc( d.size() ) ){
+        start = shared_data->block->data();
         memcpy( start, d.c_str(), d.size() );
         len   = d.size();
     }
-    
-    buffer::buffer( uint32_t len )
-    :shared_data( boost::make_shared<buffer_data>() ){
-        BOOST_ASSERT( len <= sizeof(buffer_data) );
-        start = shared_data->ptr->c_array(); 
-        len   = len;
+
+    buffer::buffer( uint32_t l )
+    :shared_data( buffer_pool::alloc( l ) ){
+        start = shared_data->block->data();
+        len   = l;
+    }
+
+    buffer::buffer( uint32_t l, uint32_t head, uint32_t tail )
+    :shared_data( buffer_pool::alloc( head + l + tail ) ){
+        start = shared_data->block->data() + head;
+        len   = l;
     }
 
     buffer::buffer( const char* d, uint32_t dl )
-    :shared_data( boost::make_shared<buffer_data>() ){
-        BOOST_ASSERT( dl <= sizeof(buffer_data) );
-        start = shared_data->ptr->c_array(); 
+    :shared_data( buffer_pool::alloc( dl ) ){
+        start = shared_data->block->data();
         memcpy( start, d, dl );
         len   = dl;
     }
@@ -54,34 +74,48 @@ namespace tn {
     buffer buffer::subbuf( int32_t s, uint32_t l )const {
       buffer b(*this);
       b.start += s;
-      if( l == uint32_t(-1) ) 
+      if( l == uint32_t(-1) )
         b.len -= s;
       else
         b.len = l;
 
-      BOOST_ASSERT( b.start >= b.shared_data->ptr->c_array() );
-      BOOST_ASSERT( b.start + b.len <= b.shared_data->ptr->c_array() + b.shared_data->ptr->size() );
+      BOOST_ASSERT( b.start >= b.shared_data->block->data() );
+      BOOST_ASSERT( b.start + b.len <= b.shared_data->block->data() + b.shared_data->block->capacity() );
       return b;
     }
     void buffer::move_start( int32_t sdif ) {
       start += sdif;
       if( sdif > int32_t(len) ) len = 0;
       else len -= sdif;
-      assert( start >= shared_data->ptr->c_array() );
-      assert( start <= shared_data->ptr->c_array() + shared_data->ptr->size() );
+      BOOST_ASSERT( start >= shared_data->block->data() );
+      BOOST_ASSERT( start <= shared_data->block->data() + shared_data->block->capacity() );
     }
     void buffer::resize( uint32_t s ) {
-      if( s <= len ) 
+      if( s <= len + tailroom() )
         len = s;
-      else 
+      else
         FC_THROW_MSG( "Attempt to grow buffer!" );
     }
+    uint32_t buffer::headroom()const {
+      return start - shared_data->block->data();
+    }
+    uint32_t buffer::tailroom()const {
+      return shared_data->block->data() + shared_data->block->capacity() - (start + len);
+    }
     buffer& buffer::operator=( buffer&& b ) {
       fc_swap(shared_data,b.shared_data);
+      std::swap(start,b.start);
+      std::swap(len,b.len);
       return *this;
     }
     buffer& buffer::operator=( const buffer& b ) {
       shared_data = b.shared_data;
+      start       = b.start;
+      len         = b.len;
       return *this;
     }
+
+    uint64_t buffer::heap_allocs() {
+      return buffer_pool::heap_allocs();
+    }
 } // namespace tn
@@ -0,0 +1,175 @@
+#include "buffer_pool.hpp"
+#include <fc/exception.hpp>
+#include <boost/thread/tss.hpp>
+#include <stdlib.h>
+#include <new>
+
+namespace tn { namespace detail {
+
+  namespace {
+    const uint32_t class_sizes[buffer_pool::num_classes]  = { 64, 256, 2048, 9216 };
+    // blocks moved between a thread cache and the depot at once
+    const uint32_t batch_sizes[buffer_pool::num_classes]  = { 64, 64, 32, 8 };
+    // batches the depot holds before returning blocks to the heap
+    const uint32_t max_depot_batches                      = 256;
+
+    /**
+     *  Stack of batches shared by all threads.  Pushing a single batch with
+     *  compare-and-swap and popping by exchanging the whole stack for null is
+     *  immune to ABA, so neither operation needs a lock.
+     */
+    struct depot {
+      std::atomic<buffer_block*> head;
+      std::atomic<uint32_t>      batches;
+
+      void push_chain( buffer_block* first, buffer_block* last ) {
+        buffer_block* h = head.load( std::memory_order_relaxed );
+        do {
+          last->next_batch = h;
+        } while( !head.compare_exchange_weak( h, first, std::memory_order_release, std::memory_order_relaxed ) );
+      }
+
+      bool push( buffer_block* batch ) {
+        if( batches.fetch_add( 1, std::memory_order_relaxed ) >= max_depot_batches ) {
+          batches.fetch_sub( 1, std::memory_order_relaxed );
+          return false;
+        }
+        push_chain( batch, batch );
+        return true;
+      }
+
+      buffer_block* pop() {
+        buffer_block* all = head.exchange( 0, std::memory_order_acquire );
+        if( !all ) return 0;
+        batches.fetch_sub( 1, std::memory_order_relaxed );
+        buffer_block* rest = all->next_batch;
+        if( rest ) {
+          buffer_block* last = rest;
+          while( last->next_batch ) last = last->next_batch;
+          push_chain( rest, last );
+        }
+        return all;
+      }
+    };
+
+    depot                 depots[buffer_pool::num_classes];
+    std::atomic<uint64_t> heap_alloc_count;
+    std::atomic<bool>     pool_enabled(true);
+
+    void free_chain( buffer_block* b ) {
+      while( b ) {
+        buffer_block* n = b->next;
+        b->~buffer_block();
+        ::free(b);
+        b = n;
+      }
+    }
+
+    struct thread_cache {
+      thread_cache() {
+        for( uint32_t i = 0; i < buffer_pool::num_classes; ++i ) {
+          free_list[i] = 0;
+          count[i]     = 0;
+        }
+      }
+      // gives everything back so blocks are not lost when the thread exits
+      ~thread_cache() {
+        for( uint32_t i = 0; i < buffer_pool::num_classes; ++i ) {
+          while( count[i] ) 
+            release_batch(i);
+        }
+      }
+
+      /**
+       *  Moves up to one batch from the front of the free list to the depot,
+       *  or to the heap if the depot is full.
+       */
+      void release_batch( uint8_t c ) {
+        buffer_block* first = free_list[c];
+        buffer_block* last  = first;
+        uint32_t      n     = 1;
+        while( n < batch_sizes[c] && last->next ) { last = last->next; ++n; }
+        free_list[c] = last->next;
+        count[c]    -= n;
+        last->next   = 0;
+        if( !depots[c].push(first) )
+          free_chain(first);
+      }
+
+      buffer_block* free_list[buffer_pool::num_classes];
+      uint32_t      count[buffer_pool::num_classes];
+    };
+
+    boost::thread_specific_ptr<thread_cache> tcache;
+
+    thread_cache& local_cache() {
+      thread_cache* tc = tcache.get();
+      if( !tc ) {
+        tc = new thread_cache();
+        tcache.reset(tc);
+      }
+      return *tc;
+    }
+
+    /// size must not exceed the largest class
+    uint8_t class_for( uint32_t size ) {
+      uint8_t c = 0;
+      while( class_sizes[c] < size ) ++c;
+      return c;
+    }
+  }
+
+  uint32_t buffer_pool::class_capacity( uint8_t c ) { return class_sizes[c]; }
+  uint64_t buffer_pool::heap_allocs()               { return heap_alloc_count.load( std::memory_order_relaxed ); }
+  void     buffer_pool::set_enabled( bool e )        { pool_enabled.store( e, std::memory_order_relaxed ); }
+
+  buffer_block* buffer_pool::alloc( uint32_t size ) {
+    // past the largest class the search would run off the end of the table
+    if( size > max_size )
+      FC_THROW_MSG( "Attempt to allocate a buffer larger than the largest pool class" );
+    uint8_t       c  = class_for(size);
+    thread_cache& tc = local_cache();
+    bool          on = pool_enabled.load( std::memory_order_relaxed );
+
+    if( on && !tc.free_list[c] ) {
+      buffer_block* batch = depots[c].pop();
+      if( batch ) {
+        uint32_t n = 0;
+        for( buffer_block* b = batch; b; b = b->next ) ++n;
+        tc.free_list[c] = batch;
+        tc.count[c]     = n;
+      }
+    }
+
+    buffer_block* b = on ? tc.free_list[c] : 0;
+    if( b ) {
+      tc.free_list[c] = b->next;
+      --tc.count[c];
+    } else {
+      void* mem = ::malloc( sizeof(buffer_block) + class_sizes[c] );
+      if( !mem ) throw std::bad_alloc();
+      b = new (mem) buffer_block();
+      b->size_class = c;
+      heap_alloc_count.fetch_add( 1, std::memory_order_relaxed );
+    }
+    b->refs.store( 1, std::memory_order_relaxed );
+    b->next       = 0;
+    b->next_batch = 0;
+    return b;
+  }
+
+  void buffer_pool::free( buffer_block* b ) {
+    if( !pool_enabled.load( std::memory_order_relaxed ) ) {
+      b->next = 0;
+      free_chain(b);
+      return;
+    }
+    thread_cache& tc = local_cache();
+    uint8_t       c  = b->size_class;
+    b->next          = tc.free_list[c];
+    tc.free_list[c]  = b;
+    if( ++tc.count[c] > 2*batch_sizes[c] )
+      tc.release_batch(c);
+  }
+
+} } // namespace tn::detail
@@ -0,0 +1,72 @@
+#ifndef _TORNET_BUFFER_POOL_HPP_
+#define _TORNET_BUFFER_POOL_HPP_
+#include <stdint.h>
+#include <atomic>
+
+namespace tn { namespace detail {
+
+  /**
+   *  Header placed in front of the storage of every pooled buffer.  The
+   *  storage follows the header in the same allocation.
+   */
+  struct buffer_block {
+    std::atomic<uint32_t> refs;
+    uint8_t               size_class;
+    buffer_block*         next;        // next block in a free list
+    buffer_block*         next_batch;  // next batch in the global depot
+
+    char*       data()       { return reinterpret_cast<char*>(this+1); }
+    const char* data()const  { return reinterpret_cast<const char*>(this+1); }
+    uint32_t    capacity()const;
+
+    void retain() { refs.fetch_add( 1, std::memory_order_relaxed ); }
+    void release();
+  };
+
+  /**
+   *  Recycles packet storage in a few fixed size classes so that steady
+   *  state traffic never touches the heap.
+   *
+   *  Each thread keeps a small cache of free blocks per size class which it
+   *  uses without any synchronization.  When a cache runs dry or overflows,
+   *  half a cache worth of blocks moves to or from a lock free depot shared
+   *  by all threads.  Blocks only go back to the heap when the depot itself
+   *  is full.
+   */
+  class buffer_pool {
+    public:
+      enum {
+        num_classes = 4,
+        max_size    = 9216
+      };
+
+      /**
+       *  @return a block with refs == 1 and a capacity of at least size
+       *  @throw  if size exceeds max_size
+       */
+      static buffer_block* alloc( uint32_t size );
+      static void          free( buffer_block* b );
+
+      static uint32_t      class_capacity( uint8_t size_class );
+
+      /// number of blocks that had to be taken from the heap
+      static uint64_t      heap_allocs();
+
+      /**
+       *  While disabled every block comes from and returns to the heap,
+       *  to measure what the pool saves.  Enabled by default.
+       */
+      static void          set_enabled( bool e );
+  };
+
+  inline void buffer_block::release() {
+    if( refs.fetch_sub( 1, std::memory_order_acq_rel ) == 1 )
+      buffer_pool::free(this);
+  }
+  inline uint32_t buffer_block::capacity()const {
+    return buffer_pool::class_capacity(size_class);
+  }
+
+} } // namespace tn::detail
+
+#endif // _TORNET_BUFFER_POOL_HPP_
@@ -47,6 +47,10 @@ namespace tn {
     BOOST_ASSERT(my);
     return my->con->get_node();
   }
+  fc::thread& channel::get_thread()const {
+    BOOST_ASSERT(my);
+    return my->con->get_thread();
+  }
   void channel::close() {
     slog("close!!" );
     if( my ) {
@@ -107,6 +111,16 @@ namespace tn {
     
   }
 
+  uint32_t channel::max_payload()const {
+    BOOST_ASSERT(my);
+    // channel numbers
+    return my->con->max_message_size() - 4;
+  }
+
+  void channel::report_bandwidth( uint32_t bytes_per_sec ) {
+    if( my && my->con ) my->con->report_bandwidth( bytes_per_sec );
+  }
+
   void channel::send( const tn::buffer& b ) {
     if( !my ) 
       FC_THROW_MSG( "Channel freed!" );
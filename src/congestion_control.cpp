@@ -0,0 +1,239 @@
+#include "congestion_control.hpp"
+#include <tornet/node.hpp>
+#include <fc/time.hpp>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+namespace tn {
+
+  // UDT's rate control period, the interval increase is defined per period
+  enum { syn_us = 10000 };
+  static const double min_inc   = 0.01;
+  static const double high_gain = 2.885;
+  static const double pacing_gains[bbr::gain_cycle] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+
+  static int64_t now_us() {
+    return fc::time_point::now().time_since_epoch().count();
+  }
+
+  static uint32_t bytes_per_sec( double packets, uint32_t packet_size ) {
+    return uint32_t( (std::min)( packets * packet_size, 4294967295.0 ) );
+  }
+
+  congestion_control::ptr congestion_control::create( uint32_t algorithm ) {
+    if( algorithm == node::config::bbr_pacing )
+      return ptr( new bbr() );
+    return ptr( new udt_daimd() );
+  }
+
+  congestion_control::congestion_control()
+  :_interval_us(0),_window(16),_bandwidth(0){}
+
+  void congestion_control::on_timeout() {
+    _window = 2;
+    if( _interval_us > 0 )
+      _interval_us = (std::min)( _interval_us * 2, 1000000.0 );
+  }
+
+
+  udt_daimd::udt_daimd()
+  :_slow_start(true),_loss(false),_last_dec_seq(0),_last_dec_interval(1),
+   _nak_count(0),_dec_count(0),_dec_random(1),_avg_nak_num(0),_last_rc_us(0){}
+
+  void udt_daimd::end_slow_start() {
+    _slow_start = false;
+    _last_rc_us = now_us();
+    if( _last.recv_rate )
+      _interval_us = 1000000.0 / _last.recv_rate;
+    else
+      _interval_us = ((_last.rtt_us ? _last.rtt_us : 100000) + syn_us) / _window;
+  }
+
+  void udt_daimd::on_ack( const ack_info& a ) {
+    // the receiver has no rtt until its first ack was answered
+    uint32_t last_rtt = _last.rtt_us;
+    _last = a;
+    if( !_last.rtt_us ) _last.rtt_us = last_rtt;
+
+    if( a.capacity )
+      _bandwidth = bytes_per_sec( a.capacity, a.packet_size );
+    else if( a.recv_rate )
+      _bandwidth = bytes_per_sec( a.recv_rate, a.packet_size );
+
+    uint32_t rtt = _last.rtt_us ? _last.rtt_us : 100000;
+    if( _slow_start ) {
+      _window += a.acked;
+      if( a.window_limit && _window > a.window_limit )
+        end_slow_start();
+      return;
+    }
+    if( a.recv_rate )
+      _window = a.recv_rate / 1000000.0 * (rtt + syn_us) + 16;
+
+    if( _loss ) {
+      _loss       = false;
+      _last_rc_us = now_us();
+      return;
+    }
+
+    // grow faster the more of the link capacity is unused, but after a
+    // decrease approach the rate that caused it by at most 1/9 of the link
+    double b = double(a.capacity) - 1000000.0 / _interval_us;
+    if( _interval_us > _last_dec_interval && a.capacity / 9.0 < b )
+      b = a.capacity / 9.0;
+    double inc = min_inc;
+    if( b > 0 && a.packet_size )
+      inc = (std::max)( pow( 10.0, ceil( log10( b * a.packet_size * 8.0 ) ) ) * 0.0000015 / a.packet_size, min_inc );
+
+    // acks may be further apart than one rate control period
+    int64_t now    = now_us();
+    double  rc     = (std::min)( (std::max)( double(now - _last_rc_us), double(syn_us) ), 1000000.0 );
+    _last_rc_us    = now;
+    _interval_us   = (_interval_us * syn_us) / (_interval_us * inc * (rc / syn_us) + syn_us);
+  }
+
+  void udt_daimd::on_timeout() {
+    if( _slow_start )
+      end_slow_start();
+    _loss = true;
+    congestion_control::on_timeout();
+  }
+
+  void udt_daimd::on_loss( uint64_t first_lost, uint64_t sent ) {
+    if( _slow_start )
+      end_slow_start();
+    _loss = true;
+
+    if( first_lost >= _last_dec_seq ) {
+      // first loss of a new congestion epoch
+      _last_dec_interval = _interval_us;
+      _interval_us      *= 1.125;
+      _avg_nak_num       = uint32_t( ceil( _avg_nak_num * 0.875 + _nak_count * 0.125 ) );
+      _nak_count         = 1;
+      _dec_count         = 1;
+      _last_dec_seq      = sent;
+      _dec_random        = _avg_nak_num ? rand() % _avg_nak_num + 1 : 1;
+    } else if( _dec_count++ < 5 && 0 == (++_nak_count % _dec_random) ) {
+      _interval_us      *= 1.125;
+      _last_dec_seq      = sent;
+    }
+  }
+
+
+  bbr::bbr()
+  :_mode(startup),_next_bw(0),_max_bw(0),_full_bw(0),_full_bw_count(0),
+   _min_rtt_us(0),_min_rtt_stamp(0),_cycle(0),_cycle_stamp(0) {
+    memset( _bw, 0, sizeof(_bw) );
+  }
+
+  double bbr::bdp()const {
+    return _max_bw * _min_rtt_us / 1000000.0;
+  }
+
+  void bbr::on_ack( const ack_info& a ) {
+    int64_t now = now_us();
+    if( a.rtt_us && ( !_min_rtt_us || a.rtt_us <= _min_rtt_us || now - _min_rtt_stamp > min_rtt_window_us ) ) {
+      _min_rtt_us    = a.rtt_us;
+      _min_rtt_stamp = now;
+    }
+    if( a.recv_rate ) {
+      _bw[_next_bw++ % bw_samples] = a.recv_rate;
+      _max_bw = *std::max_element( _bw, _bw + bw_samples );
+    }
+
+    // grow like slow start until there is a model of the path
+    if( !_max_bw || !_min_rtt_us ) {
+      _window += a.acked;
+      if( a.window_limit ) _window = (std::min)( _window, double(a.window_limit) );
+      return;
+    }
+    _bandwidth = bytes_per_sec( _max_bw, a.packet_size );
+
+    switch( _mode ) {
+      case startup:
+        if( _max_bw >= _full_bw * 1.25 ) {
+          _full_bw       = _max_bw;
+          _full_bw_count = 0;
+        } else if( ++_full_bw_count >= 3 ) {
+          _mode = drain;
+        }
+        break;
+      case drain:
+        if( a.in_flight <= bdp() ) {
+          _mode        = probe_bw;
+          _cycle       = 0;
+          _cycle_stamp = now;
+        }
+        break;
+      case probe_bw:
+        if( now - _cycle_stamp > _min_rtt_us ) {
+          _cycle       = (_cycle + 1) % gain_cycle;
+          _cycle_stamp = now;
+        }
+        break;
+    }
+
+    double pacing_gain = _mode == startup ? high_gain : _mode == drain ? 1 / high_gain : pacing_gains[_cycle];
+    double cwnd_gain   = _mode == probe_bw ? 2 : high_gain;
+    _interval_us = 1000000.0 / (pacing_gain * _max_bw);
+    _window      = (std::max)( cwnd_gain * bdp(), 4.0 );
+  }
+
+  void bbr::on_loss( uint64_t, uint64_t ) {}
+
+  // keeps pacing at the model's rate, only what is in flight is cut until
+  // the next ack rebuilds the window from it
+  void bbr::on_timeout() {
+    _window = 4;
+  }
+
+
+  arrival_history::arrival_history()
+  :_last_us(0),_last_seq(0),_gap_count(0),_pair_count(0){}
+
+  void arrival_history::on_arrival( uint32_t seq, int64_t us ) {
+    if( _last_us && us >= _last_us ) {
+      uint32_t gap = uint32_t( (std::min)( us - _last_us, int64_t(0xffffffff) ) );
+      // the counts stop at 2*samples, which keeps them congruent mod samples
+      _gaps[_gap_count % samples] = gap;
+      if( ++_gap_count == 2*samples ) _gap_count = samples;
+
+      if( is_pair_second(seq) && seq == _last_seq + 1 ) {
+        _pairs[_pair_count % samples] = gap;
+        if( ++_pair_count == 2*samples ) _pair_count = samples;
+      }
+    }
+    _last_us  = us;
+    _last_seq = seq;
+  }
+
+  uint32_t arrival_history::rate( const uint32_t* gaps, uint32_t n ) {
+    if( n < samples / 2 ) return 0;
+    uint32_t s[samples];
+    memcpy( s, gaps, n * sizeof(uint32_t) );
+    std::nth_element( s, s + n/2, s + n );
+    uint64_t median = s[n/2];
+
+    uint64_t sum   = 0;
+    uint32_t count = 0;
+    for( uint32_t i = 0; i < n; ++i ) {
+      if( gaps[i] * 8ull >= median && gaps[i] <= median * 8 ) {
+        sum += gaps[i];
+        ++count;
+      }
+    }
+    if( count <= n / 2 ) return 0;
+    return uint32_t( (std::min)( 1000000.0 * count / (std::max)( sum, uint64_t(1) ), 4294967295.0 ) );
+  }
+
+  uint32_t arrival_history::recv_rate()const {
+    return rate( _gaps, (std::min)( _gap_count, uint32_t(samples) ) );
+  }
+
+  uint32_t arrival_history::capacity()const {
+    return rate( _pairs, (std::min)( _pair_count, uint32_t(samples) ) );
+  }
+
+} // namespace tn
@@ -0,0 +1,176 @@
+#ifndef _TORNET_CONGESTION_CONTROL_HPP_
+#define _TORNET_CONGESTION_CONTROL_HPP_
+#include <boost/shared_ptr.hpp>
+#include <stdint.h>
+
+namespace tn {
+
+  /**
+   *  What an ack told the sender of a udt_channel.  The rates are measured by
+   *  the receiver, see arrival_history, and are 0 until it has enough samples
+   *  or if the peer does not report them.
+   */
+  struct ack_info {
+    ack_info():acked(0),in_flight(0),window_limit(0),packet_size(0),rtt_us(0),recv_rate(0),capacity(0){}
+
+    uint32_t acked;        ///< packets newly acknowledged
+    uint32_t in_flight;    ///< packets sent and not yet acknowledged
+    uint32_t window_limit; ///< packets the receiver has room for
+    uint32_t packet_size;  ///< bytes in a full data packet
+    uint32_t rtt_us;       ///< round trip time
+    uint32_t recv_rate;    ///< data packets per second arriving at the receiver
+    uint32_t capacity;     ///< packets per second the link carries according to packet pairs
+  };
+
+  /**
+   *  Decides how fast a udt_channel sends: how many packets may be in flight
+   *  and how long to wait between two data packets.  create() picks one of
+   *  the node::config::congestion_algorithm implementations.
+   *
+   *  Loss is reported with the index of the lost packet's first transmission
+   *  in the order the channel sent new packets, so implementations need not
+   *  deal with wrapping sequence numbers.
+   *
+   *  All calls come from the node thread.
+   */
+  class congestion_control {
+    public:
+      typedef boost::shared_ptr<congestion_control> ptr;
+
+      /// @param algorithm - a node::config::congestion_algorithm
+      static ptr create( uint32_t algorithm );
+
+      congestion_control();
+      virtual ~congestion_control(){}
+
+      virtual void on_ack( const ack_info& a ) = 0;
+      /**
+       *  @param first_lost - index of the first packet the receiver reported lost
+       *  @param sent       - packets sent so far, the next one gets this index
+       */
+      virtual void on_loss( uint64_t first_lost, uint64_t sent ) = 0;
+      /**
+       *  Nothing was acked for a retransmission timeout, the path may have
+       *  stalled.  Collapses the window and halves the rate.
+       */
+      virtual void on_timeout();
+
+      /// microseconds between two data packets, 0 sends as fast as the window allows
+      double   send_interval_us()const { return _interval_us; }
+      /// max packets in flight
+      uint32_t window()const           { return uint32_t(_window); }
+      /// bytes per second the path is believed to carry, 0 if unknown
+      uint32_t bandwidth()const        { return _bandwidth; }
+
+    protected:
+      double   _interval_us;
+      double   _window;
+      uint32_t _bandwidth;
+  };
+
+  /**
+   *  UDT's DAIMD rate control.  Slow start grows the window by every packet
+   *  acked without pacing.  After the first loss the window follows the
+   *  receive rate and the send interval is decreased every rate control period
+   *  by an amount that grows with the spare link capacity.  Loss in a new
+   *  congestion epoch increases the interval by 1/8, further loss in the same
+   *  epoch does so again at random intervals, at most 5 times.
+   */
+  class udt_daimd : public congestion_control {
+    public:
+      udt_daimd();
+
+      virtual void on_ack( const ack_info& a );
+      virtual void on_loss( uint64_t first_lost, uint64_t sent );
+      virtual void on_timeout();
+
+    private:
+      void end_slow_start();
+
+      bool     _slow_start;
+      bool     _loss;            // loss since the last rate increase
+      uint64_t _last_dec_seq;    // packets sent at the last decrease
+      double   _last_dec_interval;
+      uint32_t _nak_count;
+      uint32_t _dec_count;
+      uint32_t _dec_random;
+      uint32_t _avg_nak_num;
+      int64_t  _last_rc_us;      // time of the last rate increase
+      ack_info _last;
+  };
+
+  /**
+   *  Paces at the bottleneck bandwidth, the largest receive rate of the last
+   *  10 acks, and keeps about two bandwidth-delay products in flight, where
+   *  the delay is the smallest RTT of the last 10 seconds.  Startup paces at
+   *  2.89x until the bandwidth stops growing, drains the queue it built and
+   *  then cycles the pacing gain through 5/4, 3/4 and 6 rounds of 1 to probe
+   *  for more.  Loss does not slow it down.
+   */
+  class bbr : public congestion_control {
+    public:
+      enum { bw_samples = 10, gain_cycle = 8, min_rtt_window_us = 10000000 };
+
+      bbr();
+
+      virtual void on_ack( const ack_info& a );
+      virtual void on_loss( uint64_t first_lost, uint64_t sent );
+      virtual void on_timeout();
+
+    private:
+      enum mode { startup, drain, probe_bw };
+
+      double   bdp()const;
+
+      mode     _mode;
+      uint32_t _bw[bw_samples];  // packets per second
+      uint32_t _next_bw;
+      double   _max_bw;
+      double   _full_bw;         // largest bandwidth when startup last grew by 25%
+      uint32_t _full_bw_count;   // acks since then
+      uint32_t _min_rtt_us;
+      int64_t  _min_rtt_stamp;
+      uint32_t _cycle;
+      int64_t  _cycle_stamp;
+  };
+
+  /**
+   *  Measurements the receiver of a udt_channel reports in its acks: the rate
+   *  data packets arrive at and the link capacity.  Every packet_pair-th
+   *  packet is sent with the one after it back to back, so the gap between
+   *  their arrivals is the time the bottleneck link takes to forward one.
+   *
+   *  Both rates average the last samples that lie within a factor of 8 of
+   *  their median, which discards gaps stretched by an idle sender or
+   *  squeezed by a burst.
+   */
+  class arrival_history {
+    public:
+      enum { samples = 16, packet_pair = 16 };
+
+      arrival_history();
+
+      /// @return true if the packet with this seq is sent right after the previous one
+      static bool is_pair_second( uint32_t seq ) { return seq % packet_pair == 1; }
+
+      /// @param us - arrival time of the data packet seq
+      void     on_arrival( uint32_t seq, int64_t us );
+
+      /// packets per second, 0 until there are enough samples
+      uint32_t recv_rate()const;
+      uint32_t capacity()const;
+
+    private:
+      static uint32_t rate( const uint32_t* gaps, uint32_t n );
+
+      int64_t  _last_us;
+      uint32_t _last_seq;
+      uint32_t _gaps[samples];
+      uint32_t _gap_count;
+      uint32_t _pairs[samples];
+      uint32_t _pair_count;
+  };
+
+} // namespace tn
+
+#endif // _TORNET_CONGESTION_CONTROL_HPP_
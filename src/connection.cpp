@@ -18,11 +18,16 @@
 #include <fc/super_fast_hash.hpp>
 
 #include <boost/scoped_ptr.hpp>
+#include <boost/circular_buffer.hpp>
 #include <map>
 #include <boost/unordered_map.hpp>
 
 #include <fc/fwd_impl.hpp>
 #include "node_impl.hpp"
+#include "packet_cipher.hpp"
+#include "mpsc_queue.hpp"
+#include "ecc.hpp"
+#include "cookie_jar.hpp"
 
 namespace tn { 
   typedef fc::vector<host> route_table;
@@ -35,14 +40,63 @@ namespace tn {
       fc::optional<fc::sha1> limit; // faurthest distance 
   };
 
+  /// a channel::send() from another thread waiting for the connection's thread
+  struct outbound_msg {
+    outbound_msg( const channel& c, const tn::buffer& b ):chan(c),buf(b){}
+    channel    chan;
+    tn::buffer buf;
+  };
+
+  enum { kx_version = 2 };
+
+  /**
+   *  The public keys found in a key exchange datagram.  Key exchanges are 
+   *  never a multiple of 8 bytes long, which tells them apart from packets:
+   *
+   *    char     dh_pub[56];      // left out when answering a version 2 exchange
+   *    char     x25519_pub[32];  // version 2 only
+   *    uint8_t  version;         // version 2 only, kx_version
+   *    pad;                      // 1-7 bytes before version 2, 0-6 after
+   *
+   *  so the three forms are 57-63, 89-95 and 33-39 bytes.  Nodes that predate
+   *  version 2 read the long form as a Diffie-Hellman key followed by pad.
+   */
+  struct key_exchange {
+    key_exchange( const tn::buffer& b ):dh(0),x25519(0) {
+      uint32_t s = b.size();
+      if( s % 8 == 0 ) return;
+      if( s > 88 && s < 96 && uint8_t(b[88]) == kx_version ) {
+        dh     = b.data();
+        x25519 = b.data() + 56;
+      } else if( s > 56 ) {
+        dh     = b.data();
+      } else if( s > 32 && s < 40 && uint8_t(b[32]) == kx_version ) {
+        x25519 = b.data();
+      }
+    }
+    bool valid()const { return dh || x25519; }
+
+    const char* dh;
+    const char* x25519;
+  };
+
   class connection::impl {
     public:
-        impl( node& n ):_node(n),_behind_nat(false){}
+        impl( node& n ):_node(n),_hs_v2(false),_behind_nat(false),_rx_gen(0),_predecoded(0),
+                        _sealed_tx(false),_sealed_rx(false),_bundle_len(0),_bundle_count(0),
+                        _mtu(0),_mtu_hi(0),_probe_size(0),_probe_tries(0),_probe_id(0),
+                        _auth_gen(0),_verifying(false),_signing(false),_local_cid(0),
+                        _path_challenge(0){}
 
         uint16_t                                              _advance_count;
         node&                                                 _node;
                                                               
         boost::scoped_ptr<fc::diffie_hellman>                 _dh;
+        boost::scoped_ptr<x25519_key>                         _x25519;
+        /// 56 bytes agreed on in the key exchange, empty until then
+        std::vector<char>                                     _shared_key;
+        /// the key exchange used X25519, so the peer understands auth_v2_msg
+        bool                                                  _hs_v2;
         boost::scoped_ptr<fc::blowfish>                       _bf;
         state_enum                                            _cur_state;
                                                               
@@ -51,9 +105,99 @@ namespace tn {
         fc::ip::endpoint                                      _public_ep; // endpoint remote host reported seeing from us
         bool                                                  _behind_nat;
 
-    //    std::vector<tn::buffer>                               _in_queue;
-        std::list<tn::buffer>                                 _in_queue;
-        std::vector<tn::buffer>                               _decrypt_queue;
+        /// sized to node::config::inbound_queue_size on the first packet
+        boost::circular_buffer<inbound_packet>                _in_queue;
+
+        /// generation of _bf as published to the decrypt stage, 0 if unpublished
+        uint32_t                                              _rx_gen;
+        /// the packet being handled if the decrypt stage decoded it
+        const inbound_packet*                                 _predecoded;
+
+        /// one per direction once a cipher suite has been negotiated
+        boost::scoped_ptr<packet_cipher>                      _tx_cipher;
+        boost::scoped_ptr<packet_cipher>                      _rx_cipher;
+        replay_window                                         _replay;
+        /// the peer is known to hold our keys, send sealed packets
+        bool                                                  _sealed_tx;
+        /// the peer has sent a sealed packet, blowfish is refused from now on
+        bool                                                  _sealed_rx;
+
+        /// sends from other threads, see connection::drain_outbound()
+        mpsc_queue<outbound_msg>                              _outbound;
+
+        /// records waiting to go out as one bundle_msg, see connection::bundle_message()
+        fc::optional<tn::buffer>                              _bundle;
+        uint32_t                                              _bundle_len;
+        uint32_t                                              _bundle_count;
+        fc::future<void>                                      _bundle_timer;
+
+        void drop_bundle() {
+          if( _bundle_timer.valid() ) 
+            _bundle_timer.cancel();
+          _bundle_timer = fc::future<void>();
+          _bundle_len   = 0;
+          _bundle_count = 0;
+        }
+
+        /// path MTU search, see connection::start_mtu_search()
+        uint16_t                                              _mtu;
+        uint16_t                                              _mtu_hi;      // smallest size known or assumed to be lost
+        uint16_t                                              _probe_size;  // 0 while not searching
+        uint8_t                                               _probe_tries;
+        uint32_t                                              _probe_id;
+        fc::future<void>                                      _probe_timer;
+
+        /// when generate_dh() was called, unset once connected
+        fc::time_point                                        _handshake_start;
+        /// see connection::handle_cookie_challenge()
+        fc::time_point                                        _last_cookie_echo;
+
+        /// bumped whenever the shared key changes, crypto pool results for an
+        /// older generation are ignored
+        uint32_t                                              _auth_gen;
+        bool                                                  _verifying;
+        bool                                                  _signing;
+        /// our signed auth message for the current shared key
+        std::vector<char>                                     _auth_msg;
+
+        /// registered with the node, the peer puts it in front of sealed packets
+        uint64_t                                              _local_cid;
+
+        /// see connection::migrate()
+        fc::ip::endpoint                                      _rx_ep;          // the packet being handled came from
+        fc::ip::endpoint                                      _migrate_ep;     // the peer may have moved to
+        uint32_t                                              _path_challenge; // probe id sent there, 0 if none
+        fc::time_point                                        _last_challenge;
+
+        void drop_migration() {
+          _migrate_ep     = fc::ip::endpoint();
+          _path_challenge = 0;
+          _last_challenge = fc::time_point();
+        }
+
+        void new_auth_gen() {
+          ++_auth_gen;
+          _verifying = false;
+          _signing   = false;
+          _auth_msg.clear();
+        }
+
+        void drop_mtu_search() {
+          if( _probe_timer.valid() ) 
+            _probe_timer.cancel();
+          _probe_timer = fc::future<void>();
+          _probe_size  = 0;
+          _mtu_hi      = 0;
+          _mtu         = (std::max)( _node.my->_cfg.base_mtu, uint32_t(576) ) & ~7u;
+        }
+
+        void drop_ciphers() {
+          _tx_cipher.reset();
+          _rx_cipher.reset();
+          _replay.reset();
+          _sealed_tx = false;
+          _sealed_rx = false;
+        }
 
         //std::map<fc::sha1,fc::promise<route_table>::ptr>      _route_lookups;
         std::map<fc::sha1,route_lookup_request>               _route_lookups;
@@ -65,25 +209,53 @@ namespace tn {
   };
 
 connection::connection( node& np, const fc::ip::endpoint& ep, const db::peer::ptr& pptr )
-:my(np) {
+:_shard( np.my->creating_shard( ep ) ),my(np) {
+  my->_peers = pptr;
+  init( ep );
+}
+
+/**
+ *  Sets up a connection to ep in the state implied by the peer database,
+ *  shared by the constructor and reinit().
+ */
+void connection::init( const fc::ip::endpoint& ep ) {
   _next_chan_num = 1000;
+  _last_activity = fc::time_point::now();
   my->_remote_ep = ep;
   my->_cur_state = uninit;
   my->_advance_count = 0;
-  my->_peers = pptr;
+  my->drop_mtu_search();
 
   if( my->_peers->fetch_by_endpoint( ep, my->_remote_id, _record )  ) {
-    my->_bf.reset( new fc::blowfish() );
     wlog( "Known peer at %s start bf %s",  fc::string(ep).c_str(), fc::to_hex( _record.bf_key, 56 ).c_str() );
-    my->_bf->start( (unsigned char*)_record.bf_key, 56 );
+    // a hibernated peer, or one from a previous run, resumes with its stored key
+    my->_node.my->resumed_connection( my->_remote_id );
+    set_key( _record.bf_key );
+    start_cipher();
+    my->_sealed_tx = !!my->_tx_cipher;
     my->_node.update_dist_index( my->_remote_id, this );
     my->_cur_state = connected;
     _record.connected = true;
     my->_peers->store( my->_remote_id, _record );
+    start_mtu_search();
   } else {
     wlog( "Unknown peer at %s:%d", fc::string(ep.get_address()).c_str(), ep.port() );
     _record.last_ep   = my->_remote_ep;
   }
+  set_local_cid( _record.local_cid );
+}
+
+/**
+ *  Registers cid, or a new id if it is 0 or taken, as the id the peer puts in
+ *  front of the packets it sends us.  A connection resumed from the peer db 
+ *  keeps the id it announced before.
+ */
+void connection::set_local_cid( uint64_t cid ) {
+  if( cid && cid == my->_local_cid ) 
+    return;
+  my->_node.my->unregister_cid( this, my->_local_cid );
+  my->_local_cid    = my->_node.my->register_cid( this, cid );
+  _record.local_cid = my->_local_cid;
 }
 uint16_t connection::get_free_channel_num() { 
   ++_next_chan_num; 
@@ -93,36 +265,166 @@ uint16_t connection::get_free_channel_num() {
 }
 
 connection::connection( node& np, const fc::ip::endpoint& ep, const node_id& auth_id, state_enum init_state )
-:my(np) {
+:_shard( np.my->creating_shard( ep ) ),my(np) {
    _next_chan_num = 1000;
+   _last_activity = fc::time_point::now();
    my->_remote_ep = ep;
    my->_remote_id = auth_id;
    my->_cur_state = init_state;
    my->_advance_count = 0;
    my->_peers = np.get_peers();
+   my->drop_mtu_search();
 }
 
 connection::~connection() {
   elog( "~connection %p", this );
+  my->drop_bundle();
+  my->drop_mtu_search();
+  if( my->_rx_gen ) 
+    my->_node.retract_rx_key( my->_remote_ep );
+  if( my->_local_cid && my->_node.my ) 
+    my->_node.my->unregister_cid( this, my->_local_cid );
   if( my->_peers && _record.valid() ) {
     _record.connected = 0;
     my->_peers->store( my->_remote_id, _record );
   }
 }
 
+/**
+ *  Releases everything that belongs to the current remote endpoint and
+ *  returns to a blank uninit state so that the node can keep this object
+ *  on its free list.
+ */
+void connection::recycle() {
+  if( my->_remote_id != node_id() ) 
+    my->_node.my->unindex( my->_remote_id, this );
+  if( my->_peers && _record.valid() ) {
+    _record.connected = 0;
+    my->_peers->store( my->_remote_id, _record );
+  }
+  close_channels();
+  flush_bundle();
+  my->drop_bundle();
+  my->drop_mtu_search();
+  clear_key();
+  state_changed.disconnect_all_slots();
+
+  my->_node.my->unregister_cid( this, my->_local_cid );
+  my->_local_cid = 0;
+  my->_dh.reset();
+  my->_x25519.reset();
+  my->_shared_key.clear();
+  my->_hs_v2 = false;
+  my->_bf.reset();
+  my->_handshake_start = fc::time_point();
+  my->new_auth_gen();
+  my->_cur_state  = uninit;
+  my->_remote_id  = node_id();
+  my->_public_ep  = fc::ip::endpoint();
+  my->_behind_nat = false;
+  my->_predecoded = 0;
+  my->drop_migration();
+  my->_in_queue.clear();
+  mpsc_queue<outbound_msg>::free( my->_outbound.take_all() );
+  my->_route_lookups.clear();
+  my->_serv_clients.clear();
+
+  _record  = db::peer::record();
+  _sched   = sched_state();
+  _service = node::connection_stats();
+}
+
+void connection::reinit( const fc::ip::endpoint& ep ) {
+  init( ep );
+}
+
 size_t connection::pending_packets()const {
   return my->_in_queue.size();
 }
-void connection::post_packet( tn::buffer&& b ) {
+uint32_t connection::next_packet_size()const {
+  return my->_in_queue.front().raw.size();
+}
+
+uint32_t connection::sched_weight()const {
+  // priority is the fraction of known peers this one ranks above
+  uint32_t w = 1 + uint32_t( 7 * (std::max)( 0.0f, (std::min)( 1.0f, _record.priority ) ) );
+  if( _record.recv_credit > _record.sent_credit ) 
+    w += 4;
+  return w;
+}
+uint32_t connection::start_sched_round() {
+  _service.weight = sched_weight();
+  ++_service.rounds;
+  return _service.weight;
+}
+/**
+ *  Key exchange packets and decoded messages other than data_msg are
+ *  control traffic.  Packets the decrypt stage did not decode can not be
+ *  classified and count as data.
+ */
+static bool is_control_packet( const inbound_packet& p ) {
+  if( p.raw.size() % 8 ) return true;
+  return !!p.plain && p.plain->size() >= 4 && ((*p.plain)[3] >> 3) != connection::data_msg;
+}
+
+bool connection::post_packet( inbound_packet&& p ) {
   //slog( "received on connection to %s", fc::string(my->_remote_ep).c_str() );
-  my->_in_queue.push_back( std::move(b) );
+  _last_activity = fc::time_point::now();
+  const node::config& cfg = my->_node.my->_cfg;
+  if( !my->_in_queue.capacity() )
+    my->_in_queue.set_capacity( (std::max)( cfg.inbound_queue_size, uint32_t(1) ) );
+
+  if( my->_in_queue.full() ) {
+    bool evicted = false;
+    if( cfg.inbound_drop_policy == node::config::drop_data_first && is_control_packet(p) ) {
+      // the front may be in the middle of being processed, leave it alone
+      for( auto itr = my->_in_queue.begin() + 1; itr != my->_in_queue.end(); ++itr ) {
+        if( !is_control_packet( *itr ) ) {
+          my->_in_queue.erase( itr );
+          evicted = true;
+          break;
+        }
+      }
+    }
+    ++_service.dropped;
+    if( !evicted ) return false;
+  }
+  my->_in_queue.push_back( std::move(p) );
 //  if(my->_in_queue.size() > 2 ) { wlog( "inqueue size %d", my->_in_queue.size() ); }
+  return true;
 }
 
+/**
+ *  Plaintext from the decrypt stage is only trusted if it was decoded with
+ *  the key we are using now, otherwise the raw packet is decoded again.
+ */
 void connection::process_next_message() {
-  handle_packet( my->_in_queue.front() );
+  fc::time_point start = fc::time_point::now();
+
+  const inbound_packet& p = my->_in_queue.front();
+  inbound_packet        opened;
+  uint32_t size = p.raw.size();
+  if( !!p.plain && p.rx_gen == my->_rx_gen )
+    my->_predecoded = &p;
+  my->_rx_ep = p.ep != fc::ip::endpoint() ? p.ep : my->_remote_ep;
+  if( p.ep != fc::ip::endpoint() && p.ep != my->_remote_ep && !migrate( p, opened ) ) {
+    wlog( "dropping packet for %s from %s", fc::string(my->_remote_ep).c_str(), fc::string(p.ep).c_str() );
+  } else if( !p.cid && my->_local_cid && p.raw.size() >= 16 && 
+             !memcmp( p.raw.data(), &my->_local_cid, sizeof(my->_local_cid) ) ) {
+    // arrived before the node knew our id, as when a resumed connection is created
+    handle_packet( p.raw.subbuf( sizeof(my->_local_cid) ) );
+  } else {
+    handle_packet( p.raw );
+  }
+  my->_predecoded = 0;
   my->_in_queue.pop_front();
   //my->_in_queue.erase(my->_in_queue.begin());
+
+  uint64_t us = (fc::time_point::now() - start).count();
+  ++_service.packets;
+  _service.bytes      += size;
+  _service.service_us += us;
+  if( us > _service.max_service_us ) _service.max_service_us = us;
 }
 
 /**
@@ -130,6 +432,10 @@ void connection::process_next_message() {
  *  current state.
  */
 void connection::handle_packet( const tn::buffer& b ) {
+  if( cookie_jar::is_challenge( b ) ) {
+    handle_cookie_challenge( b );
+    return;
+  }
   switch( my->_cur_state ) {
     case failed:       wlog("failed con");     return;
     case uninit:       handle_uninit(b);       return;
@@ -141,6 +447,100 @@ void connection::handle_packet( const tn::buffer& b ) {
 }
 
 
+/**
+ *  The peer does not know us yet and wants its cookie back before it sets
+ *  anything up.  Echo it and repeat our side of the handshake, which it
+ *  dropped.  A few answers per second are enough, so spoofed challenges can
+ *  not make us send much more than we receive.
+ */
+void connection::handle_cookie_challenge( const tn::buffer& b ) {
+  fc::time_point now = fc::time_point::now();
+  if( now - my->_last_cookie_echo < fc::milliseconds(250) ) 
+    return;
+  my->_last_cookie_echo = now;
+  slog( "echoing cookie to %s", fc::string(my->_remote_ep).c_str() );
+  my->_node.send( cookie_jar::make_echo( b ), my->_remote_ep );
+  switch( my->_cur_state ) {
+    case generated_dh: 
+      send_dh();
+      return;
+    case received_dh:
+      send_dh();
+      send_auth();
+      return;
+    default:
+      return;
+  }
+}
+
+/**
+ *  A packet with our connection id arrived from another endpoint, most likely
+ *  because the peer's NAT picked a new port.  It is handled if it is a sealed
+ *  packet that opens with our key and is newer than any received so far, so a
+ *  recorded packet replayed from a forged address is not.
+ *
+ *  The connection only moves once the new endpoint echoed an mtu_probe_msg
+ *  sent there, see finish_migration().  Otherwise an observer that forwards a
+ *  fresh packet from a forged address before the original arrives could
+ *  redirect the connection to it.  One endpoint is challenged at a time.
+ *
+ *  @param opened - holds the plaintext for decode_packet() if p was opened here
+ *  @return false if p has to be dropped
+ */
+bool connection::migrate( const inbound_packet& p, inbound_packet& opened ) {
+  if( my->_cur_state != connected || !my->_rx_cipher ) 
+    return false;
+  if( !my->_predecoded || !my->_predecoded->seq ) {
+    tn::buffer plain;
+    if( !my->_rx_cipher->is_sealed( p.raw ) || !my->_rx_cipher->open( p.raw, plain, opened.seq ) ) 
+      return false;
+    opened.plain    = plain;
+    my->_predecoded = &opened;
+  }
+  if( !my->_replay.is_newest( my->_predecoded->seq ) ) 
+    return false;
+
+  fc::time_point now = fc::time_point::now();
+  if( p.ep != my->_migrate_ep ) {
+    if( my->_path_challenge && now - my->_last_challenge < fc::milliseconds(250) ) 
+      return true;
+    my->_migrate_ep     = p.ep;
+    my->_path_challenge = ++my->_probe_id;
+    my->_last_challenge = fc::time_point();
+  }
+  if( now - my->_last_challenge >= fc::milliseconds(250) ) {
+    // a probe of size 0 leaves the mtu search alone
+    char m[6];
+    fc::datastream<char*> ds( m, sizeof(m) );
+    ds << my->_path_challenge << uint16_t(0);
+    send_direct( m, sizeof(m), mtu_probe_msg, &my->_migrate_ep );
+    my->_last_challenge = now;
+  }
+  return true;
+}
+
+/**
+ *  The endpoint migrate() challenged echoed the probe, so the peer is there.
+ *  Channels and their UDT state carry on as they were.
+ */
+void connection::finish_migration() {
+  fc::ip::endpoint from = my->_remote_ep;
+  fc::ip::endpoint to   = my->_migrate_ep;
+  my->drop_migration();
+  wlog( "%s moved from %s to %s", fc::string(my->_remote_id).c_str(), 
+        fc::string(from).c_str(), fc::string(to).c_str() );
+  my->_node.my->move_connection( connection::ptr( this, true ), from, to );
+  if( my->_rx_gen ) 
+    my->_node.retract_rx_key( from );
+  my->_remote_ep  = to;
+  _record.last_ep = to;
+  my->_peers->store( my->_remote_id, _record );
+  publish_key();
+  // the new path may not carry what the old one did
+  my->drop_mtu_search();
+  start_mtu_search();
+}
+
 /**
  *  In this state we know nothing about the remote_ep and
  *  we have sent them nothing.  We can only receive public
@@ -149,10 +549,12 @@ void connection::handle_packet( const tn::buffer& b ) {
  */
 void connection::handle_uninit( const tn::buffer& b ) {
   if( my->_peers->fetch_by_endpoint( my->_remote_ep, my->_remote_id, _record )  ) {
-    my->_bf.reset( new fc::blowfish() );
     wlog( "Known peer at %s:%d start bf %s",  fc::string(my->_remote_ep.get_address()).c_str(), my->_remote_ep.port(),
         fc::to_hex( _record.bf_key, 56 ).c_str() );
-    my->_bf->start( (unsigned char*)_record.bf_key, 56 );
+    set_local_cid( _record.local_cid );
+    set_key( _record.bf_key );
+    start_cipher();
+    my->_sealed_tx = !!my->_tx_cipher;
     my->_node.update_dist_index( my->_remote_id, this );
     _record.connected = true;
     my->_peers->store( my->_remote_id, _record );
@@ -164,13 +566,16 @@ void connection::handle_uninit( const tn::buffer& b ) {
   }
 
   BOOST_ASSERT( my->_cur_state == uninit );
-  if( (b.size() % 8) && b.size() > 56 ) { // key exchange
-    generate_dh();
+  key_exchange kx(b);
+  if( kx.valid() ) {
+    generate_dh( !!kx.x25519 );
     send_dh();
     if( process_dh( b ) ) {
         send_auth();
+        goto_state( received_dh );
+    } else {
+        goto_state( generated_dh );
     }
-    goto_state( received_dh );
     return;
   } else {
     generate_dh();
@@ -187,12 +592,12 @@ void connection::handle_uninit( const tn::buffer& b ) {
 void connection::handle_generated_dh( const tn::buffer& b ) {
  // slog("");
   BOOST_ASSERT( my->_cur_state == generated_dh );
-  if( b.size() % 8 && b.size() > 56 ) { // pub key
+  if( key_exchange(b).valid() ) { // pub key
    //  send_dh();
     if( process_dh( b ) ) {
       send_auth();
+      goto_state( received_dh );
     }
-    goto_state( received_dh );
     return;
   }
   send_dh();
@@ -201,7 +606,7 @@ void connection::handle_generated_dh( const tn::buffer& b ) {
 void connection::handle_received_dh( const tn::buffer& b ) {
   //slog("%p", this);
   BOOST_ASSERT( my->_cur_state == received_dh );
-  if( b.size() % 8 && b.size() > 56 ) { // pub key
+  if( key_exchange(b).valid() ) { // pub key
     send_dh();
     if( process_dh( b ) ) {
       send_auth();
@@ -232,7 +637,7 @@ void connection::handle_authenticated( const tn::buffer& b ) {
       handle_uninit(b);
       return;
     }
-  } else if( b.size() > 56 ) { // dh pub key 
+  } else if( key_exchange(b).valid() ) { // dh pub key 
     reset();
     handle_uninit(b);
   }
@@ -254,6 +659,7 @@ void connection::handle_connected( const tn::buffer& b ) {
 
      _record.last_ep = fc::ip::endpoint();
      memset( _record.bf_key, 0, sizeof(_record.bf_key) );
+     _record.cipher_suite = packet_cipher::blowfish;
      _record.connected = 0;
      my->_peers->store( get_remote_id(), _record );
   }
@@ -267,6 +673,8 @@ bool connection::handle_auth_resp_msg( const tn::buffer& b ) {
   wlog("auth response %d", int(b[0]) );
   if( b[0] ) { 
     slog( "rank %d", uint16_t(b[0]) );
+    // the peer answers after deriving its keys from our auth message
+    if( my->_tx_cipher ) my->_sealed_tx = true;
     _record.published_rank = uint8_t(b[0]);
     goto_state( connected ); 
     return true; 
@@ -282,7 +690,7 @@ bool connection::handle_update_rank_msg( const tn::buffer& b ) {
   }
   fc::sha1::encoder  rank_sha;
   rank_sha.write( (char*)b.data(), 2*sizeof(uint64_t) );
-  rank_sha.write( _record.public_key, sizeof(_record.public_key) );
+  rank_sha.write( _record.public_key, _record.key_len );
   fc::sha1 r = rank_sha.result();
   uint8_t new_rank = 161 - fc::bigint( (const char*)r.data(), sizeof(r) ).log2();
   if( new_rank > _record.rank ) {
@@ -309,11 +717,63 @@ void connection::reset() {
     my->_peers->store( my->_remote_id, _record );
   }
   close_channels();
-  my->_node.update_dist_index( my->_remote_id, 0 );
+  my->_node.my->unindex( my->_remote_id, this );
   my->_serv_clients.clear();
+  my->drop_bundle();
+  my->drop_mtu_search();
+  my->new_auth_gen();
+  my->_shared_key.clear();
+  clear_key();
   goto_state(uninit); 
 }
 
+/**
+ *  Starts encrypting with key (56 bytes) and publishes it to the decrypt stage.
+ *  Any negotiated cipher suite belonged to the previous key and is dropped.
+ */
+void connection::set_key( const char* key ) {
+  my->_bf.reset( new fc::blowfish() );
+  my->_bf->start( (unsigned char*)key, 56 );
+  my->drop_ciphers();
+  publish_key();
+}
+
+void connection::publish_key() {
+  my->_rx_gen = my->_node.publish_rx_key( my->_remote_ep, _record.bf_key, priority(), my->_rx_cipher.get(),
+                                          my->_local_cid );
+}
+
+/**
+ *  Derives a packet_cipher for each direction from the shared key when 
+ *  _record.cipher_suite names an AEAD suite.  The remote id must be known.
+ *
+ *  Packets stay in blowfish until _sealed_tx is set, which happens once the
+ *  peer has shown that it derived the same keys.
+ */
+void connection::start_cipher() {
+  packet_cipher::suite s = packet_cipher::suite( _record.cipher_suite );
+  if( s == packet_cipher::blowfish ) return;
+  try {
+    const node_id& local = my->_node.get_id();
+    my->_tx_cipher.reset( new packet_cipher( s, _record.bf_key, 56, local, my->_remote_id ) );
+    my->_rx_cipher.reset( new packet_cipher( s, _record.bf_key, 56, my->_remote_id, local ) );
+  } catch ( ... ) {
+    elog( "%s", fc::current_exception().diagnostic_information().c_str() );
+    my->drop_ciphers();
+    _record.cipher_suite = packet_cipher::blowfish;
+    return;
+  }
+  my->_replay.reset();
+  publish_key();
+}
+
+void connection::clear_key() {
+  my->drop_ciphers();
+  if( !my->_rx_gen ) return;
+  my->_node.retract_rx_key( my->_remote_ep );
+  my->_rx_gen = 0;
+}
+
 void connection::send_close() {
   //slog( "sending close" );
   char resp = 1;
@@ -384,10 +844,13 @@ bool connection::handle_request_reverse_connect_msg( const tn::buffer& b ) {
    fc::ip::endpoint ep( ip, port );
    wlog( "handle reverse connect msg %s", fc::string(ep).c_str() );
    
-   my->_node.get_thread().async( [=]() { 
-        auto ep_con = my->_node.my->_ep_to_con.find(ep);
-        if( ep_con != my->_node.my->_ep_to_con.end() ) { 
-          ep_con->second->send_request_connect( get_endpoint() );
+   // ep may belong to another shard
+   node::impl::con_shard* s    = &my->_node.my->owner_of(ep);
+   fc::ip::endpoint       from = get_endpoint();
+   s->thread->async( [=]() { 
+        auto ep_con = s->ep_to_con.find(ep);
+        if( ep_con != s->ep_to_con.end() ) { 
+          ep_con->second->send_request_connect( from );
         }
      } 
    );
@@ -444,36 +907,229 @@ void connection::send_update_rank() {
 bool connection::decode_packet( const tn::buffer& b ) {
     _record.last_contact = fc::time_point::now().time_since_epoch().count();
 
-    my->_bf->reset_chain();
+    if( my->_predecoded ) {
+      const inbound_packet& p = *my->_predecoded;
+      my->_predecoded = 0;
+      if( p.seq ) 
+        return dispatch_sealed( *p.plain, p.seq );
+      if( !my->_sealed_rx ) 
+        return dispatch_packet( *p.plain );
+    } else if( my->_rx_cipher && my->_rx_cipher->is_sealed( b ) ) {
+      tn::buffer plain;
+      uint64_t   seq;
+      if( my->_rx_cipher->open( b, plain, seq ) ) 
+        return dispatch_sealed( plain, seq );
+      // otherwise it may be a blowfish packet that happens to look sealed
+    }
+    if( my->_sealed_rx ) {
+      elog( "refusing unsealed packet from %s", fc::string(my->_remote_ep).c_str() );
+      return false;
+    }
+    if( !decrypt_packet( *my->_bf, b ) ) {
+      elog( "decrytpion checksum failed" );
+      return false;
+    }
+    return dispatch_packet( b );
+}
 
-    my->_bf->decrypt( (unsigned char*)b.data(), b.size(), fc::blowfish::CBC );
+bool connection::decrypt_packet( fc::blowfish& bf, const tn::buffer& b ) {
+    bf.reset_chain();
+    bf.decrypt( (unsigned char*)b.data(), b.size(), fc::blowfish::CBC );
 
     uint32_t checksum = fc::super_fast_hash( (char*)b.data()+4, b.size()-4 );
-    if( memcmp( &checksum, b.data(), 3 ) != 0 ) {
-      elog( "decrytpion checksum failed" );
-      return false;
+    return memcmp( &checksum, b.data(), 3 ) == 0;
+}
+
+/**
+ *  A replayed packet is dropped without failing the connection, otherwise
+ *  anyone who recorded a packet could reset it.
+ */
+bool connection::dispatch_sealed( const tn::buffer& plain, uint64_t seq ) {
+    if( !my->_replay.accept( seq ) ) {
+      wlog( "dropping replayed packet from %s", fc::string(my->_remote_ep).c_str() );
+      ++my->_node.my->_replayed_packets;
+      return true;
     }
+    // the peer has our keys, so it can open what we send as well
+    my->_sealed_rx = true;
+    my->_sealed_tx = true;
+    return dispatch_packet( plain );
+}
+
+bool connection::dispatch_packet( const tn::buffer& b ) {
     uint8_t pad = b[3] & 0x07;
     uint8_t msg_type = b[3] >> 3;
 
 //    slog( "%1% bytes type %2%  pad %3%", b.size(), int(msg_type), int(pad) );
+    return dispatch_message( msg_type, b.subbuf(4,b.size()-4-pad) );
+}
 
+bool connection::dispatch_message( uint8_t msg_type, const tn::buffer& m ) {
     switch( msg_type ) {
-      case data_msg:                    return handle_data_msg( b.subbuf(4,b.size()-4-pad) );  
-      case auth_msg:                    return handle_auth_msg( b.subbuf(4,b.size()-4-pad) );  
-      case auth_resp_msg:               return handle_auth_resp_msg( b.subbuf(4,b.size()-4-pad) );  
-      case route_lookup_msg:            return handle_lookup_msg( b.subbuf(4,b.size()-4-pad) );
-      case route_msg:                   return handle_route_msg( b.subbuf(4,b.size()-4-pad) );
-      case close_msg:                   return handle_close_msg( b.subbuf(4,b.size()-4-pad) );  
-      case update_rank:                 return handle_update_rank_msg( b.subbuf(4,b.size()-4-pad) );  
-      case req_reverse_connect_msg:     return handle_request_reverse_connect_msg( b.subbuf(4,b.size()-4-pad) );  
-      case req_connect_msg:             return handle_request_connect_msg( b.subbuf(4,b.size()-4-pad) );  
+      case data_msg:                    return handle_data_msg( m );  
+      case auth_msg:                    return handle_auth_msg( m );  
+      case auth_v2_msg:                 return handle_auth_v2_msg( m );  
+      case auth_resp_msg:               return handle_auth_resp_msg( m );  
+      case route_lookup_msg:            return handle_lookup_msg( m );
+      case route_msg:                   return handle_route_msg( m );
+      case close_msg:                   return handle_close_msg( m );  
+      case update_rank:                 return handle_update_rank_msg( m );  
+      case req_reverse_connect_msg:     return handle_request_reverse_connect_msg( m );  
+      case req_connect_msg:             return handle_request_connect_msg( m );  
+      case bundle_msg:                  return handle_bundle_msg( m );
+      case mtu_probe_msg:               return handle_mtu_probe_msg( m );
+      case mtu_ack_msg:                 return handle_mtu_ack_msg( m );
       default:
         wlog( "Unknown message type" );
     }
     return true;
 }
 
+/**
+ *  A bundle is a sequence of records:
+ *
+ *    uint8_t  type;
+ *    uint16_t size;
+ *    char     msg[size];
+ *
+ *  each handled as if it had arrived in its own packet.
+ */
+bool connection::handle_bundle_msg( const tn::buffer& b ) {
+    uint32_t pos = 0;
+    while( pos + 3 <= b.size() ) {
+      uint8_t  type;
+      uint16_t size;
+      fc::datastream<const char*> ds( b.data() + pos, 3 );
+      ds >> type >> size;
+      if( type == bundle_msg || pos + 3 + size > b.size() ) {
+        wlog( "malformed bundle from %s", fc::string(my->_remote_ep).c_str() );
+        return true;
+      }
+      if( !dispatch_message( type, b.subbuf( pos + 3, size ) ) ) 
+        return false;
+      pos += 3 + size;
+    }
+    return true;
+}
+
+/**
+ *  Searches for the largest datagram that reaches the peer in the spirit of
+ *  DPLPMTUD (RFC 8899): a probe is padded to a candidate size and sent with 
+ *  the don't fragment bit set, an acknowledged probe raises the mtu and three
+ *  unanswered ones mark the size as too large.  Candidates are binary searched
+ *  in steps of 8 bytes between the current mtu and max_mtu.  A lost probe only
+ *  narrows the search, it is never treated as congestion or a dead peer.
+ *
+ *  Only batched I/O sets the don't fragment bit, without it every connection
+ *  stays at base_mtu.  Peers that did not announce their receive buffer size
+ *  are not probed since they would truncate larger datagrams.
+ */
+void connection::start_mtu_search() {
+  const node::config& cfg = my->_node.my->_cfg;
+  my->_probe_size = 0;
+  if( !my->_node.my->batched_io() || my->_cur_state != connected || !_record.max_datagram ) 
+    return;
+  uint32_t hi = (std::min)( (std::min)( cfg.max_mtu, uint32_t(_record.max_datagram) ), 
+                            uint32_t(tn::buffer::max_size) ) & ~7u;
+  if( hi <= my->_mtu ) 
+    return;
+  my->_mtu_hi = hi + 8;
+  // give the handshake traffic a moment first
+  my->_probe_timer = get_thread().schedule( [this]() { next_mtu_probe(); },
+                       fc::time_point::now() + fc::seconds(1), "mtu_probe" );
+}
+
+void connection::next_mtu_probe() {
+  if( my->_cur_state != connected ) 
+    return;
+  uint32_t size = ((uint32_t(my->_mtu) + my->_mtu_hi) / 2) & ~7u;
+  if( size <= my->_mtu ) {
+    my->_probe_size = 0;
+    slog( "path mtu to %s is %d", fc::string(my->_remote_ep).c_str(), int(my->_mtu) );
+    uint32_t raise = my->_node.my->_cfg.pmtu_raise_sec;
+    if( raise ) {
+      my->_probe_timer = get_thread().schedule( [this]() { start_mtu_search(); },
+                           fc::time_point::now() + fc::seconds(raise), "raise_mtu" );
+    }
+    return;
+  }
+  my->_probe_size  = size;
+  my->_probe_tries = 0;
+  ++my->_probe_id;
+  send_mtu_probe();
+}
+
+/**
+ *  Pads the probe so that the datagram is exactly _probe_size bytes long with
+ *  the cipher in use:
+ *
+ *    uint32_t id;
+ *    uint16_t size;
+ *    char     zeros[];
+ */
+void connection::send_mtu_probe() {
+  uint32_t framing = my->_sealed_tx ? packet_cipher::header_size + 1 + packet_cipher::tag_size : 4;
+  if( my->_sealed_tx && _record.remote_cid ) 
+    framing += sizeof(_record.remote_cid);
+  uint32_t len     = my->_probe_size - framing;
+  tn::buffer m( len );
+  memset( m.data(), 0, len );
+  fc::datastream<char*> ds( m.data(), len );
+  ds << my->_probe_id << my->_probe_size;
+  send_direct( m.data(), len, mtu_probe_msg );
+  ++my->_node.my->_mtu_probes;
+
+  int64_t wait_us = (std::max)( int64_t(2) * _record.avg_rtt_us, int64_t(250000) );
+  my->_probe_timer = get_thread().schedule( [this]() { mtu_probe_timeout(); },
+                       fc::time_point::now() + fc::microseconds(wait_us), "mtu_probe" );
+}
+
+void connection::mtu_probe_timeout() {
+  if( my->_cur_state != connected || !my->_probe_size ) 
+    return;
+  if( ++my->_probe_tries < 3 ) {
+    send_mtu_probe();
+    return;
+  }
+  my->_mtu_hi = my->_probe_size;
+  next_mtu_probe();
+}
+
+/// echoes the probe's id and size
+bool connection::handle_mtu_probe_msg( const tn::buffer& b ) {
+  if( b.size() < 6 || my->_cur_state != connected ) 
+    return true;
+  send( b.data(), 6, mtu_ack_msg );
+  return true;
+}
+
+/**
+ *  Any acknowledged size between the mtu and the smallest lost size raises
+ *  the mtu, even the ack of an earlier probe that was thought lost.  The ack
+ *  of a migrate() challenge that came from the challenged endpoint moves the
+ *  connection there.
+ */
+bool connection::handle_mtu_ack_msg( const tn::buffer& b ) {
+  if( b.size() < 6 ) 
+    return true;
+  uint32_t id;
+  uint16_t size;
+  fc::datastream<const char*> ds( b.data(), b.size() );
+  ds >> id >> size;
+  if( my->_path_challenge && id == my->_path_challenge ) {
+    if( my->_rx_ep == my->_migrate_ep ) 
+      finish_migration();
+    return true;
+  }
+  if( size <= my->_mtu || size >= my->_mtu_hi || size % 8 ) 
+    return true;
+  if( my->_probe_timer.valid() && !my->_probe_timer.ready() ) 
+    my->_probe_timer.cancel();
+  my->_mtu = size;
+  next_mtu_probe();
+  return true;
+}
+
 
 
 
@@ -585,42 +1241,169 @@ bool connection::handle_data_msg( const tn::buffer& b ) {
 }
 
 /**
+ *  An auth message waiting for its signature check on the crypto pool.
+ */
+struct pending_auth {
+  bool             ed25519;    // signed with an Ed25519 identity
+  fc::signature_t  sig;
+  fc::public_key_t pubk;
+  unsigned char    ed_sig[ed25519_key::sig_size];
+  char             key[256];   // pubk serialized, or the Ed25519 key
+  uint16_t         key_len;
+  fc::sha1         digest;     // what sig must sign
+  fc::sha1         id;         // of key
+  uint64_t         nonce[2];
+  uint16_t         rport;
+  uint8_t          suites;
+  uint8_t          features;
+  uint16_t         max_dgram;
+  uint64_t         cid;        // to put in front of packets we send, 0 for none
+  bool             rank_known; // rank came from the verified key cache
+  uint8_t          rank;
+  boost::shared_ptr<ed25519_public_key> ed_key; // key decoded, from the cache or by the check
+  fc::sha1         auth;       // of digest and signature, see node::impl::verified_key
+  bool             valid;      // set before the check if this message verified before
+};
+
+/**
+ *  The signature is checked on the crypto pool and finish_auth() picks the
+ *  result up on the connection's thread.  Retransmissions that arrive meanwhile are
+ *  ignored.
+ *
  *  Returning false, it will send us back to uninit state
  *
- *  sig pub_key utc nonce[2] ip port
+ *  sig pub_key utc nonce[2] ip port [cipher_suites] [feature_flags] [max_datagram] [conn_id]
  */
 bool connection::handle_auth_msg( const tn::buffer& b ) {
+    return receive_auth( b, false );
+}
+
+/**
+ *  Same as auth_msg with a 64 byte Ed25519 signature and 32 byte key in 
+ *  place of the RSA ones.
+ */
+bool connection::handle_auth_v2_msg( const tn::buffer& b ) {
+    if( my->_node.my->_cfg.handshake_version < 2 || !ecc_available() ) {
+      wlog( "ignoring Ed25519 auth message" );
+      return true;
+    }
+    return receive_auth( b, true );
+}
+
+bool connection::receive_auth( const tn::buffer& b, bool ed25519 ) {
     slog( "" );
-    fc::signature_t  sig;
-    fc::public_key_t pubk;
+    if( my->_verifying ) 
+      return true;
+    if( my->_shared_key.size() != 56 ) {
+      wlog( "auth message before key exchange" );
+      return true;
+    }
+    boost::shared_ptr<pending_auth> a( new pending_auth() );
     uint64_t             utc_us;
-    uint64_t             remote_nonce[2];
 
     fc::datastream<const char*> ds( b.data(), b.size() );
-    ds >> sig >> pubk >> utc_us >> remote_nonce[0] >> remote_nonce[1];
+    a->ed25519 = ed25519;
+    if( ed25519 ) {
+      a->key_len = ed25519_key::key_size;
+      ds.read( (char*)a->ed_sig, sizeof(a->ed_sig) );
+      ds.read( a->key, a->key_len );
+    } else {
+      ds >> a->sig >> a->pubk;
+      fc::datastream<char*> kds( a->key, sizeof(a->key) );
+      kds << a->pubk;
+      a->key_len = sizeof(a->key);
+    }
+    ds >> utc_us >> a->nonce[0] >> a->nonce[1];
     uint32_t rip;
-    uint16_t rport;
-    ds >> rip >> rport;
-    my->_public_ep = fc::ip::endpoint( fc::ip::address(rip), rport );
-
+    ds >> rip >> a->rport;
+    my->_public_ep = fc::ip::endpoint( fc::ip::address(rip), a->rport );
+    // older nodes do not announce any suites
+    a->suites    = 0;
+    a->features  = 0;
+    a->max_dgram = 0;
+    if( ds.remaining() ) 
+      ds >> a->suites;
+    if( ds.remaining() ) 
+      ds >> a->features;
+    if( ds.remaining() >= sizeof(a->max_dgram) ) 
+      ds >> a->max_dgram;
+    a->cid = 0;
+    if( (a->features & feature_conn_id) && ds.remaining() >= sizeof(a->cid) ) 
+      ds >> a->cid;
 
     fc::sha1::encoder  sha;
-    sha.write( &my->_dh->shared_key.front(), my->_dh->shared_key.size() );
+    sha.write( &my->_shared_key.front(), my->_shared_key.size() );
     sha.write( (char*)&utc_us, sizeof(utc_us) );
-    
+    a->digest = sha.result();
+
+    fc::sha1::encoder  auth_sha;
+    auth_sha.write( (const char*)&a->digest, sizeof(a->digest) );
+    if( ed25519 ) auth_sha.write( (const char*)a->ed_sig, sizeof(a->ed_sig) );
+    else          auth_sha.write( (const char*)&a->sig, sizeof(a->sig) );
+    a->auth = auth_sha.result();
+
+    a->id         = fc::sha1::hash( a->key, a->key_len );
+    a->rank_known = false;
+    a->valid      = false;
+    // the digest covers this session's shared key, so only a retransmission
+    // of a message that was verified already skips the signature check
+    node::impl::verified_key vk;
+    if( my->_node.my->cached_key( a->id, vk ) ) {
+      a->ed_key     = vk.ed_key;
+      a->rank_known = !memcmp( vk.nonce, a->nonce, sizeof(a->nonce) );
+      a->rank       = vk.rank;
+      a->valid      = vk.last_auth == a->auth;
+    }
 
-    if( !pubk.verify( sha.result(), sig ) ) {
+    my->_verifying = true;
+    uint32_t        gen  = my->_auth_gen;
+    connection::ptr self( this, true );
+    get_thread().async( [=]() { self->finish_auth( gen, a ); }, "finish_auth" );
+    return true;
+}
+
+/**
+ *  Waits for the crypto pool to check the signature and, unless the 
+ *  connection was reset or recycled meanwhile, completes handle_auth_msg().
+ */
+void connection::finish_auth( uint32_t gen, const boost::shared_ptr<pending_auth>& pa ) {
+    my->_node.my->_crypto->async( [pa]() {
+      if( pa->valid ) {
+        // a retransmission of a message that verified
+      } else if( pa->ed25519 ) {
+        if( !pa->ed_key ) 
+          pa->ed_key.reset( new ed25519_public_key( (const unsigned char*)pa->key ) );
+        pa->valid = pa->ed_key->verify( (const char*)pa->digest.data(), sizeof(pa->digest), pa->ed_sig );
+      } else
+        pa->valid = pa->pubk.verify( pa->digest, pa->sig );
+      if( pa->valid && !pa->rank_known ) {
+        fc::sha1::encoder  rank_sha;
+        rank_sha.write( (char*)pa->nonce, sizeof(pa->nonce) );
+        rank_sha.write( pa->key, pa->key_len );
+        fc::sha1 r = rank_sha.result();
+        pa->rank = 161 - fc::bigint( r.data(), sizeof(r) ).log2();
+      }
+    } ).wait();
+    if( gen != my->_auth_gen ) 
+      return;
+    const pending_auth& a = *pa;
+    my->_verifying = false;
+    if( my->_shared_key.size() != 56 || my->_cur_state < received_dh ) 
+      return;
+
+    if( !a.valid ) {
       elog( "Invalid authentication" );
       send_auth_response(false);
       send_close();
-      return false;
+      reset();
+      return;
     } else {
       if( my->_public_ep.get_address() != my->_remote_ep.get_address() ) {
         wlog( "Behind NAT  remote side reported %s but we received %s",
               fc::string(my->_public_ep).c_str(),
               fc::string(my->_remote_ep).c_str()
             );
-        if( rport != my->_remote_ep.port() ) {
+        if( a.rport != my->_remote_ep.port() ) {
           wlog( "Warning: NAT Port Rewrite!!" );
         }
         my->_behind_nat = true;
@@ -631,17 +1414,24 @@ bool connection::handle_auth_msg( const tn::buffer& b ) {
       
 
       slog( "Authenticated! %s with dh key %s", fc::string(my->_remote_ep).c_str(), 
-                fc::to_hex( my->_dh->shared_key.data(), my->_dh->shared_key.size()).c_str()  );
+                fc::to_hex( my->_shared_key.data(), my->_shared_key.size()).c_str()  );
 
-      fc::sha1::encoder pkds; pkds << pubk;
-      set_remote_id( pkds.result() );
+      set_remote_id( a.id );
       my->_peers->fetch( my->_remote_id, _record );
-      memcpy( _record.bf_key, &my->_dh->shared_key.front(), 56 );
-
-      fc::datastream<char*> recds( _record.public_key, sizeof(_record.public_key) );
-      recds << pubk;
-      _record.nonce[0] = remote_nonce[0];
-      _record.nonce[1] = remote_nonce[1];
+      memcpy( _record.bf_key, &my->_shared_key.front(), 56 );
+      _record.cipher_suite = packet_cipher::select( local_cipher_suites(), a.suites );
+      slog( "cipher suite %d", int(_record.cipher_suite) );
+      start_cipher();
+      _record.remote_features = a.features;
+      _record.max_datagram    = a.max_dgram;
+      _record.remote_cid      = a.cid;
+      _record.local_cid       = my->_local_cid;
+
+      memset( _record.public_key, 0, sizeof(_record.public_key) );
+      memcpy( _record.public_key, a.key, a.key_len );
+      _record.key_len  = a.key_len;
+      _record.nonce[0] = a.nonce[0];
+      _record.nonce[1] = a.nonce[1];
       _record.last_ep   = my->_remote_ep;
 
       uint64_t utc_us = fc::time_point::now().time_since_epoch().count();
@@ -649,11 +1439,13 @@ bool connection::handle_auth_msg( const tn::buffer& b ) {
         _record.first_contact = utc_us;
       _record.last_contact = utc_us;
 
-      fc::sha1::encoder  rank_sha;
-      rank_sha.write( (char*)remote_nonce, sizeof(remote_nonce) );
-      rank_sha << pubk;
-      fc::sha1 r = rank_sha.result();
-      _record.rank = 161 - fc::bigint( r.data(), sizeof(r) ).log2();
+      _record.rank = a.rank;
+      node::impl::verified_key vk;
+      memcpy( vk.nonce, a.nonce, sizeof(vk.nonce) );
+      vk.rank      = a.rank;
+      vk.ed_key    = a.ed_key;
+      vk.last_auth = a.auth;
+      my->_node.my->cache_key( a.id, vk );
 
       send_auth_response(true);
       _record.connected = 1;
@@ -675,7 +1467,6 @@ bool connection::handle_auth_msg( const tn::buffer& b ) {
         ++rlr;
       }
     }
-    return true;
 }
 
 void connection::set_remote_id( const connection::node_id& nid ) {
@@ -684,36 +1475,57 @@ void connection::set_remote_id( const connection::node_id& nid ) {
 
 void connection::goto_state( state_enum s ) {
   if( my->_cur_state != s ) {
+    if( s == connected && my->_handshake_start != fc::time_point() ) {
+      my->_node.my->record_handshake( fc::time_point::now() - my->_handshake_start );
+      my->_handshake_start = fc::time_point();
+    }
     state_changed( my->_cur_state = s );
+    // a state_changed slot may have reset us already
+    if( s == connected && my->_cur_state == connected ) 
+      start_mtu_search();
   }
 }
 
-void connection::generate_dh() {
-  try {
-      my->_dh.reset( new fc::diffie_hellman() );
-      static std::string decode_param = 
-            fc::base64_decode( "lyIvBWa2SzbSeqb4HgBASJEj3SJrYFAIaErwx5GMt71CtFE4FYXDrVw1bPTBaRX4GTDAIBQM8Rs=" );
-      my->_dh->p.clear();
-      my->_dh->g = 5;
-      my->_dh->p.insert( my->_dh->p.begin(), decode_param.begin(), decode_param.end() );
-      my->_dh->pub_key.reserve(63);
-      do {
-        my->_dh->generate_pub_key(); 
-      } while ( my->_dh->pub_key.size() != 56 );
-  } catch ( ... ) {
-    elog( "%s", fc::current_exception().diagnostic_information().c_str() );
-    throw;
+/**
+ *  Creates fresh keypairs and starts timing the handshake.  Unless version 2
+ *  is disabled an X25519 key is offered next to the Diffie-Hellman one, which
+ *  comes from the node's pool and is left out when the peer offered X25519.
+ */
+void connection::generate_dh( bool peer_v2 ) {
+  my->_handshake_start = fc::time_point::now();
+  bool v2 = my->_node.my->_cfg.handshake_version >= 2 && ecc_available();
+  my->_x25519.reset( v2 ? new x25519_key() : 0 );
+  if( v2 && peer_v2 ) {
+    my->_dh.reset();
+    return;
   }
+  dh_pool* pool = my->_node.my->_dh_pool.get();
+  my->_dh.reset( pool ? pool->take() : dh_pool::generate() );
 }
 
 
+/**
+ *  Sends our public keys laid out as described by key_exchange.
+ */
 void connection::send_dh() {
   //slog("");
-  BOOST_ASSERT( my->_dh );
-  int init_size = my->_dh->pub_key.size();
-  my->_dh->pub_key.resize(my->_dh->pub_key.size()+ rand()%7+1 );
-  my->_node.send( &my->_dh->pub_key.front(), my->_dh->pub_key.size(), my->_remote_ep );
-  my->_dh->pub_key.resize(init_size);
+  BOOST_ASSERT( my->_dh || my->_x25519 );
+  char     msg[56 + x25519_key::key_size + 1 + 7];
+  uint32_t len = 0;
+  memset( msg, 0, sizeof(msg) );
+  if( my->_dh ) {
+    memcpy( msg, &my->_dh->pub_key.front(), (std::min)( my->_dh->pub_key.size(), size_t(56) ) );
+    len = 56;
+  }
+  if( my->_x25519 ) {
+    memcpy( msg + len, my->_x25519->pub(), x25519_key::key_size );
+    len += x25519_key::key_size;
+    msg[len++] = char(kx_version);
+    len += rand()%7;
+  } else {
+    len += rand()%7+1;
+  }
+  my->_node.send( msg, len, my->_remote_ep );
 }
 
 /**
@@ -721,32 +1533,100 @@ void connection::send_dh() {
  *  node owns the public_key it claims.  It also is used to report the IP:PORT 
  *  
  *  sign( sha1(shared_key + utc) ) + pub_key + utc + nonce[2] + uint32_t(local_ip) + uint16_t(local_port)
+ *    + uint8_t(cipher_suites) + uint8_t(feature_flags) + uint16_t(max_datagram)
+ *    + uint64_t(conn_id)
+ *
+ *  A node with an Ed25519 identity sends it as an auth_v2_msg, which only
+ *  peers that agreed on an X25519 key understand.
  *
+ *  The trailing bytes announce the packet_cipher suites, the protocol 
+ *  features we support, the largest datagram we receive and the id to put in
+ *  front of sealed packets, older nodes ignore them.
+ *
+ *  The signature is made on the crypto pool and the message is kept, so the
+ *  retransmissions of advance() cost nothing until the shared key changes.
  */
 void connection::send_auth() {
    // slog("");
-    BOOST_ASSERT( my->_dh );
-    BOOST_ASSERT( my->_dh->shared_key.size() == 56 );
+    if( my->_shared_key.size() != 56 ) 
+      return;
+    bool ed25519 = !!my->_node.my->_ed_key;
+    if( my->_auth_msg.size() ) {
+      send( &my->_auth_msg.front(), my->_auth_msg.size(), ed25519 ? auth_v2_msg : auth_msg );
+      return;
+    }
+    if( my->_signing ) 
+      return;
+    if( ed25519 && !my->_hs_v2 ) {
+      elog( "%s does not support Ed25519 identities", fc::string(my->_remote_ep).c_str() );
+      return;
+    }
     uint64_t utc_us = fc::time_point::now().time_since_epoch().count();
 
     fc::sha1::encoder sha;
-    sha.write( &my->_dh->shared_key.front(), my->_dh->shared_key.size() );
+    sha.write( &my->_shared_key.front(), my->_shared_key.size() );
     sha.write( (char*)&utc_us, sizeof(utc_us) );
+    fc::sha1 digest = sha.result();
 
-    fc::signature_t s = my->_node.sign( sha.result() );
+    my->_signing = true;
+    uint32_t        gen  = my->_auth_gen;
+    connection::ptr self( this, true );
+    get_thread().async( [=]() { self->finish_send_auth( gen, utc_us, digest ); }, "send_auth" );
+}
 
-    char buf[sizeof(s)+sizeof(my->_node.pub_key())+sizeof(utc_us)+16 + 6];
-    //BOOST_ASSERT( sizeof(tmp) == ps.tellp() );
+void connection::finish_send_auth( uint32_t gen, uint64_t utc_us, const fc::sha1& digest ) {
+    const ed25519_key* ek = my->_node.my->_ed_key.get();
+    std::vector<char>  id_part;
+    if( ek ) {
+      id_part.resize( ed25519_key::sig_size + ed25519_key::key_size );
+      unsigned char* out = (unsigned char*)&id_part.front();
+      my->_node.my->_crypto->async( [=]() { 
+        ek->sign( (const char*)digest.data(), sizeof(digest), out ); 
+      } ).wait();
+      memcpy( out + ed25519_key::sig_size, ek->pub(), ed25519_key::key_size );
+    } else {
+      node* n = &my->_node;
+      fc::signature_t s = my->_node.my->_crypto->async( [=]() { return n->sign( digest ); } ).wait();
+      id_part.resize( sizeof(s)+sizeof(my->_node.pub_key()) );
+      fc::datastream<char*> ids( &id_part.front(), id_part.size() );
+      ids << s << my->_node.pub_key();
+    }
+    if( gen != my->_auth_gen ) 
+      return;
+    my->_signing = false;
 
-    fc::datastream<char*> ds(buf,sizeof(buf));
+    my->_auth_msg.resize( id_part.size()+sizeof(utc_us)+16 + 6 + 2 + 2 + 8 );
+    fc::datastream<char*> ds( &my->_auth_msg.front(), my->_auth_msg.size() );
 
-    // allocate buffer with unused space in front for header info and back for padding, send() will then use
-    // the extra space to put the encryption, pad, and type info.
-    ds << s << my->_node.pub_key() << utc_us << my->_node.nonce()[0] << my->_node.nonce()[1];
+    ds.write( &id_part.front(), id_part.size() );
+    ds << utc_us << my->_node.nonce()[0] << my->_node.nonce()[1];
     ds << uint32_t(my->_node.local_endpoint(my->_remote_ep).get_address()) << my->_node.local_endpoint().port();
-    send( buf, sizeof(buf), auth_msg );
+    ds << local_cipher_suites() << uint8_t(feature_bundle | (my->_local_cid ? feature_conn_id : 0));
+    ds << uint16_t(my->_node.my->_cfg.rx_buffer_size()) << my->_local_cid;
+    send( &my->_auth_msg.front(), my->_auth_msg.size(), ek ? auth_v2_msg : auth_msg );
 }
 
+uint8_t connection::local_cipher_suites()const {
+    return uint8_t( my->_node.my->_cfg.cipher_suites & packet_cipher::available() );
+}
+
+
+  /**
+   *  Writes the padding behind the size bytes at p+4 and the header in front 
+   *  of them.
+   *
+   *  @return the length of the packet starting at p
+   */
+  static uint32_t frame_packet( unsigned char* p, uint32_t size, connection::proto_message_type t ) {
+      uint8_t  pad = 8 - ((size + 4) % 8);
+      if( pad == 8 ) pad = 0;
+      if( pad )
+        memset( p + 4 + size, 0, pad );
+      uint32_t check = fc::super_fast_hash( (char*)p + 4, size + pad );
+      memcpy( p, (char*)&check, 3 );
+      p[3] = pad | (uint8_t(t)<<3);
+      return size + pad + 4;
+  }
 
   /**
    *  All data is sent via the my->_node and is encrypted.  That means that 
@@ -760,53 +1640,113 @@ void connection::send_auth() {
    *  uint3     pad_bytes;
    *  data+pad
    *
+   *  unless the peer negotiated a cipher suite, then packet_cipher::seal() 
+   *  produces the packet.
+   *
+   *  Small messages may wait to share a packet, see bundle_message().
    */
   void connection::send( const char* buf, uint32_t size, connection::proto_message_type t ) {
-      BOOST_ASSERT( size <= 2044 );
-      BOOST_ASSERT( my->_bf );
+      if( !bundle_message( t, 0, 0, buf, size ) )
+        send_direct( buf, size, t );
+  }
 
-      unsigned char  buffer[2048];
-      unsigned char* data = buffer+4;
-      uint8_t  pad = 8 - ((size + 4) % 8);
-      if( pad == 8 ) pad = 0;
+  void connection::send_direct( const char* buf, uint32_t size, connection::proto_message_type t,
+                                const fc::ip::endpoint* to ) {
+      /// TODO: Throttle Connection if we are sending faster than connection priority allows 
+      if( my->_sealed_tx ) {
+        BOOST_ASSERT( size + packet_cipher::header_size + 1 + packet_cipher::tag_size + 8 <= tn::buffer::max_size );
+        uint64_t   cid = _record.remote_cid;
+        uint32_t   pre = cid ? sizeof(cid) : 0;
+        tn::buffer out( (std::min)( pre + size + packet_cipher::overhead, uint32_t(tn::buffer::max_size) ) );
+        memcpy( out.data(), &cid, pre );
+        out.resize( pre + my->_tx_cipher->seal( t, buf, size, (unsigned char*)out.data() + pre ) );
+        my->_node.send( out, to ? *to : my->_remote_ep );
+        return;
+      }
+      BOOST_ASSERT( size + 4 <= tn::buffer::max_size );
+      BOOST_ASSERT( my->_bf );
 
-      memcpy( data,buf,size);
-      if( pad )
-        memset( data + size, 0, pad );
-      uint32_t check = fc::super_fast_hash( (char*)data, size + pad );
-      uint32_t size_pad = size+pad;
-      memcpy( buffer, (char*)&check, 3 );
-      buffer[3] = pad | (uint8_t(t)<<3);
-      //slog( "%1%", fc::to_hex( (char*)buffer, size_pad+4 ) );
-
-      uint32_t buf_len = size_pad+4;
+      tn::buffer out( (std::min)( size + 4 + 7, uint32_t(tn::buffer::max_size) ) );
+      memcpy( out.data() + 4, buf, size );
+      uint32_t len = frame_packet( (unsigned char*)out.data(), size, t );
       my->_bf->reset_chain();
-      my->_bf->encrypt(  buffer, buf_len, fc::blowfish::CBC );
+      my->_bf->encrypt( (unsigned char*)out.data(), len, fc::blowfish::CBC );
+      out.resize( len );
+      //slog( "Sending %1% bytes: pad %2%  type: %3%", len, int(len-size-4), int(t) );
+      my->_node.send( out, to ? *to : my->_remote_ep );
+  }
 
-      /// TODO: Throttle Connection if we are sending faster than connection priority allows 
+  /**
+   *  Sends m, which has 4 bytes of headroom and 7 of tailroom, without copying
+   *  it first: the header and padding go into the room around m and the
+   *  cipher writes straight into the datagram.  m's data is left untouched.
+   */
+  void connection::send_packet( const tn::buffer& m, connection::proto_message_type t ) {
+      if( my->_sealed_tx ) {
+        send_direct( m.data(), m.size(), t );
+        return;
+      }
+      BOOST_ASSERT( m.size() + 4 <= tn::buffer::max_size );
+      BOOST_ASSERT( m.headroom() >= 4 && m.tailroom() >= 7 );
+      BOOST_ASSERT( my->_bf );
 
-      //slog( "Sending %1% bytes: pad %2%  type: %3%", buf_len, int(pad), int(t) );
-      my->_node.send( (char*)buffer, buf_len, my->_remote_ep );
+      tn::buffer p(m);
+      p.move_start( -4 );
+      uint32_t   len = frame_packet( (unsigned char*)p.data(), m.size(), t );
+      tn::buffer out( len );
+      my->_bf->reset_chain();
+      my->_bf->encrypt( (const unsigned char*)p.data(), (unsigned char*)out.data(), len, fc::blowfish::CBC );
+      my->_node.send( out, my->_remote_ep );
   }
 
+  /**
+   *  Agrees on the shared key with X25519 when both sides offered it and
+   *  with Diffie-Hellman otherwise.  A retransmitted key exchange yields the
+   *  same key and leaves the auth state alone.
+   *
+   *  @return false if b has no key we can use
+   */
   bool connection::process_dh( const tn::buffer& b ) {
    // slog( "" );
-    BOOST_ASSERT( b.size() >= 56 );
-    my->_dh->compute_shared_key( b.data(), 56 );
-    while( my->_dh->shared_key.size() < 56 ) 
-      my->_dh->shared_key.push_back('\0');
-    //wlog( "shared key: %s", fc::base64_encode( (const unsigned char*)&my->_dh->shared_key.front(), my->_dh->shared_key.size() ).c_str() ); 
-
-    // make sure shared key make sense!
-
-    my->_bf.reset( new fc::blowfish() );
-    my->_bf->start( (unsigned char*)&my->_dh->shared_key.front(), 56 );
-    //wlog( "start bf %s", fc::to_hex( (char*)&my->_dh->shared_key.front(), 56 ).c_str() );
-    memcpy( _record.bf_key, &my->_dh->shared_key.front(), 56 );
+    key_exchange      kx(b);
+    std::vector<char> key(56);
+    bool              v2 = false;
+    if( kx.x25519 && my->_x25519 ) {
+      if( !my->_x25519->derive( (const unsigned char*)kx.x25519, &key.front(), key.size() ) ) {
+        wlog( "invalid X25519 key from %s", fc::string(my->_remote_ep).c_str() );
+        return false;
+      }
+      v2 = true;
+    } else if( kx.dh && my->_dh ) {
+      my->_dh->compute_shared_key( kx.dh, 56 );
+      while( my->_dh->shared_key.size() < 56 ) 
+        my->_dh->shared_key.push_back('\0');
+      memcpy( &key.front(), &my->_dh->shared_key.front(), 56 );
+    } else {
+      wlog( "no key exchange in common with %s", fc::string(my->_remote_ep).c_str() );
+      return false;
+    }
+    //wlog( "shared key: %s", fc::base64_encode( (const unsigned char*)&key.front(), key.size() ).c_str() ); 
+    if( key == my->_shared_key ) 
+      return true;
+
+    my->_shared_key.swap( key );
+    my->_hs_v2 = v2;
+    if( v2 ) ++my->_node.my->_x25519_exchanges;
+    my->new_auth_gen();
+    memcpy( _record.bf_key, &my->_shared_key.front(), 56 );
+    set_key( _record.bf_key );
+    //wlog( "start bf %s", fc::to_hex( (char*)&my->_shared_key.front(), 56 ).c_str() );
     return true;
   }
 
   void connection::close_channel( const channel& ch ) {
+    if( !get_thread().is_current() ) {
+      connection::ptr self( this, true );
+      channel         c( ch );
+      get_thread().async( [=]() { self->close_channel( c ); }, "close_channel" );
+      return;
+    }
     //wlog("not implemented removing channel");
     uint32_t k = (uint32_t(ch.local_channel_num()) << 16) | ch.remote_channel_num();
     my->_channels.erase( my->_channels.find(k) );
@@ -814,25 +1754,149 @@ void connection::send_auth() {
   }
 
   connection::node_id connection::get_remote_id()const { return my->_remote_id; }
+  size_t              connection::channel_count()const { return my->_channels.size(); }
 
   node& connection::get_node()const {
     return my->_node;
   }
 
+  fc::thread& connection::get_thread()const {
+    return *my->_node.my->_shards[_shard]->thread;
+  }
+
   /**
-   *  @todo - find a way to preallocate the header info and the just fill in
-   *  before the start of buffer... 
+   *  Buffers with channel::send_headroom and send_tailroom to spare get the
+   *  channel numbers written in front of them and go to send_packet(), others
+   *  are copied first.
+   *
+   *  Other threads only queue the message, the first one to find the queue
+   *  empty asks the connection's thread to drain it.
    */
   void connection::send( const channel& c, const tn::buffer& b  ) {
-    if( !my->_node.get_thread().is_current() ) my->_node.get_thread().async( [=]() { send(c,b); } );
+    if( !get_thread().is_current() ) {
+      if( my->_outbound.push( outbound_msg( c, b ) ) ) {
+        // the reaper or node::shutdown() may free the connection before its
+        // thread gets to the drain
+        connection::ptr self( this, true );
+        get_thread().async( [=]() { self->drain_outbound(); }, "drain_outbound" );
+      }
+    }
     else {
-        //wlog("send from %1% to %2%", c.local_channel_num(), c.remote_channel_num() );
-        char buf[2048];
-        fc::datastream<char*> ds(buf,sizeof(buf));
-        ds << c.local_channel_num() << c.remote_channel_num(); 
-        ds.write( b.data(), b.size() );
-        send( buf, ds.tellp(), data_msg );
+        char hdr[4];
+        fc::datastream<char*> hds( hdr, sizeof(hdr) );
+        hds << c.local_channel_num() << c.remote_channel_num(); 
+        if( bundle_message( data_msg, hdr, sizeof(hdr), b.data(), b.size() ) )
+          return;
+
+        if( b.headroom() >= channel::send_headroom && b.tailroom() >= channel::send_tailroom ) {
+          tn::buffer m(b);
+          m.move_start( -4 );
+          memcpy( m.data(), hdr, sizeof(hdr) );
+          send_packet( m, data_msg );
+        } else {
+          //wlog("send from %1% to %2%", c.local_channel_num(), c.remote_channel_num() );
+          tn::buffer m( sizeof(hdr) + b.size(), 4, 7 );
+          memcpy( m.data(), hdr, sizeof(hdr) );
+          memcpy( m.data() + sizeof(hdr), b.data(), b.size() );
+          send_packet( m, data_msg );
+        }
+    }
+  }
+
+  /**
+   *  Appends hdr + m as a record of the pending bundle if the peer understands
+   *  bundles and the message is small enough to be worth delaying, a quarter
+   *  of bundle_size at most.  The bundle goes out when the next record does
+   *  not fit or bundle_delay_us after its first record, whichever is first.
+   *  Without a delay it goes out once the sending task yields, so only the
+   *  messages sent back to back share a datagram and none is held back.
+   *
+   *  Handshake and control messages are never bundled.  Any message that is
+   *  not bundled flushes the pending bundle first so that messages leave in 
+   *  the order they were sent.
+   *
+   *  @return false if the caller has to send the message itself
+   */
+  bool connection::bundle_message( proto_message_type t, const char* hdr, uint32_t hdr_len, 
+                                   const char* m, uint32_t l ) {
+    const node::config& cfg  = my->_node.my->_cfg;
+    uint32_t            max  = (std::min)( cfg.bundle_size, max_message_size() );
+    uint32_t            rec  = 3 + hdr_len + l;
+    bool bundleable = t == data_msg || t == route_lookup_msg || t == route_msg || t == update_rank;
+    if( !bundleable || rec > max / 4 || my->_cur_state != connected ||
+        !(_record.remote_features & feature_bundle) ) {
+      flush_bundle();
+      return false;
+    }
+
+    // max grows with the path mtu, a bundle allocated before must grow too
+    bool grow = my->_bundle && my->_bundle->size() < max;
+    if( my->_bundle_len + rec > max || grow ) 
+      flush_bundle();
+    if( !my->_bundle || grow ) 
+      my->_bundle = tn::buffer( max, 4, 7 ); // room for send_packet()
+    if( !my->_bundle_len && (!my->_bundle_timer.valid() || my->_bundle_timer.ready()) ) {
+      if( cfg.bundle_delay_us )
+        my->_bundle_timer = get_thread().schedule( [this]() { flush_bundle(); }, 
+                               fc::time_point::now() + fc::microseconds( cfg.bundle_delay_us ), "flush_bundle" );
+      else
+        my->_bundle_timer = get_thread().async( [this]() { flush_bundle(); } );
+    }
+
+    char* p = my->_bundle->data() + my->_bundle_len;
+    fc::datastream<char*> ds( p, 3 );
+    ds << uint8_t(t) << uint16_t(hdr_len + l);
+    memcpy( p + 3, hdr, hdr_len );
+    memcpy( p + 3 + hdr_len, m, l );
+    my->_bundle_len += rec;
+    ++my->_bundle_count;
+    return true;
+  }
+
+  /**
+   *  A bundle of one goes out as a plain message.  The bundle buffer is reused
+   *  right away because send_packet() does not keep it.
+   */
+  void connection::flush_bundle() {
+    if( !my->_bundle_len ) return;
+    tn::buffer b( *my->_bundle );
+    uint32_t   n = my->_bundle_count;
+    b.resize( my->_bundle_len );
+    my->_bundle_len   = 0;
+    my->_bundle_count = 0;
+
+    if( n == 1 ) {
+      uint8_t  type;
+      uint16_t size;
+      fc::datastream<const char*> ds( b.data(), 3 );
+      ds >> type >> size;
+      send_direct( b.data() + 3, size, proto_message_type(type) );
+      return;
+    }
+    send_packet( b, bundle_msg );
+    ++my->_node.my->_bundles_sent;
+    my->_node.my->_bundled_msgs += n;
+  }
+
+  /**
+   *  Sends everything other threads queued since the last drain as one burst.
+   *  With batched I/O the burst is flushed together at the end rather than 
+   *  waiting for this task to yield.
+   */
+  void connection::drain_outbound() {
+    mpsc_queue<outbound_msg>::node* head = my->_outbound.take_all();
+    // the connection may have been reset or recycled since the messages were queued
+    bool keyed = my->_sealed_tx || my->_bf;
+    for( mpsc_queue<outbound_msg>::node* n = head; n && keyed; n = n->next ) {
+      try {
+        send( n->value.chan, n->value.buf );
+      } catch ( ... ) {
+        elog( "%s", fc::current_exception().diagnostic_information().c_str() );
+      }
     }
+    mpsc_queue<outbound_msg>::free( head );
+    if( my->_node.my->batched_io() ) 
+      my->_node.my->flush_sends();
   }
 
   /**
@@ -842,6 +1906,7 @@ void connection::send_auth() {
    */
   void connection::advance() {
     wlog( "advance!" );
+    _last_activity = fc::time_point::now();
     if( ++my->_advance_count >= 10 ) {
       goto_state(failed);
       return;
@@ -906,6 +1971,29 @@ void connection::send_auth() {
     return my->_behind_nat;
   }
 
+  uint32_t connection::get_mtu()const {
+    return my->_mtu;
+  }
+
+  /**
+   *  A sealed packet adds the most framing.  The mtu is a multiple of 8 so the
+   *  cipher padding never pushes a message of this size over it.
+   */
+  uint32_t connection::max_message_size()const {
+    return my->_mtu - (packet_cipher::header_size + 1 + packet_cipher::tag_size + sizeof(_record.remote_cid));
+  }
+
+  /**
+   *  Kept in memory like avg_rtt_us, the record is written with the next
+   *  store of the peer.
+   */
+  void connection::report_bandwidth( uint32_t bytes_per_sec ) {
+    if( !_record.est_bandwidth )
+      _record.est_bandwidth = bytes_per_sec;
+    else
+      _record.est_bandwidth = uint32_t( (uint64_t(_record.est_bandwidth)*7 + bytes_per_sec) / 8 );
+  }
+
   /**
    *  Sends a message requesting a node lookup and waits up to 1s for a response.  If no
    *  response in 1 second, then a timeout exception is thrown.  
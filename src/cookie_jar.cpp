@@ -0,0 +1,77 @@
+#include "cookie_jar.hpp"
+#include <fc/log.hpp>
+#include <fc/error.hpp>
+#include <fc/exception.hpp>
+#include <fc/time.hpp>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+#include <string.h>
+
+namespace tn {
+
+  static uint32_t now_sec() {
+    return uint32_t( fc::time_point::now().time_since_epoch().count() / 1000000 );
+  }
+
+  cookie_jar::cookie_jar() {
+    if( RAND_bytes( _secret, sizeof(_secret) ) != 1 ) 
+      FC_THROW_MSG( "Unable to create cookie secret" );
+  }
+
+  cookie_jar::~cookie_jar() {
+    memset( _secret, 0, sizeof(_secret) );
+  }
+
+  bool cookie_jar::is_challenge( const tn::buffer& b ) {
+    return b.size() == cookie_size && uint8_t(b[0]) == challenge;
+  }
+
+  bool cookie_jar::is_echo( const tn::buffer& b ) {
+    return b.size() == cookie_size && uint8_t(b[0]) == echo;
+  }
+
+  void cookie_jar::mac( const fc::ip::endpoint& ep, uint32_t t, unsigned char out[16] )const {
+    unsigned char msg[10];
+    uint32_t ip   = uint32_t(ep.get_address());
+    uint16_t port = ep.port();
+    memcpy( msg,   &t,    4 );
+    memcpy( msg+4, &ip,   4 );
+    memcpy( msg+8, &port, 2 );
+
+    unsigned char h[EVP_MAX_MD_SIZE];
+    unsigned int  hl = 0;
+    HMAC( EVP_sha256(), _secret, sizeof(_secret), msg, sizeof(msg), h, &hl );
+    memcpy( out, h, 16 );
+  }
+
+  tn::buffer cookie_jar::make( const fc::ip::endpoint& ep )const {
+    tn::buffer b( cookie_size );
+    uint32_t   t = now_sec();
+    b[0] = char(challenge);
+    memcpy( b.data()+1, &t, 4 );
+    mac( ep, t, (unsigned char*)b.data()+5 );
+    return b;
+  }
+
+  tn::buffer cookie_jar::make_echo( const tn::buffer& c ) {
+    tn::buffer b( cookie_size );
+    memcpy( b.data(), c.data(), cookie_size );
+    b[0] = char(echo);
+    return b;
+  }
+
+  bool cookie_jar::verify( const fc::ip::endpoint& ep, const tn::buffer& b )const {
+    if( !is_echo(b) ) return false;
+    uint32_t t;
+    memcpy( &t, b.data()+1, 4 );
+    uint32_t now = now_sec();
+    if( t > now || now - t > lifetime ) 
+      return false;
+    unsigned char m[16];
+    mac( ep, t, m );
+    return CRYPTO_memcmp( m, b.data()+5, sizeof(m) ) == 0;
+  }
+
+} // namespace tn
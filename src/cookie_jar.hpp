@@ -0,0 +1,61 @@
+#ifndef _TORNET_COOKIE_JAR_HPP_
+#define _TORNET_COOKIE_JAR_HPP_
+#include <tornet/buffer.hpp>
+#include <fc/ip.hpp>
+#include <stdint.h>
+
+namespace tn {
+
+  /**
+   *  Stateless cookies that an endpoint without a connection must echo before
+   *  the node allocates one for it, see node::config::unverified_cons_per_sec.
+   *
+   *  A cookie datagram is laid out as:
+   *
+   *    uint8_t   type;      // challenge or echo
+   *    uint32_t  time;      // seconds, when the challenge was made
+   *    char      mac[16];   // HMAC-SHA256( secret, time || ip || port )
+   *
+   *  Its 21 bytes are neither a multiple of 8 nor the size of a key exchange,
+   *  so it can not be mistaken for either.  The echo is the challenge with
+   *  the type changed, so echoing costs the peer no more than it received.
+   */
+  class cookie_jar {
+    public:
+      enum type {
+        challenge = 0xc0,
+        echo      = 0xc1
+      };
+      enum { 
+        cookie_size = 21,
+        /// seconds an echo stays acceptable
+        lifetime    = 30
+      };
+
+      /// creates a random secret, cookies from a previous run are refused
+      cookie_jar();
+      ~cookie_jar();
+
+      static bool is_challenge( const tn::buffer& b );
+      static bool is_echo( const tn::buffer& b );
+
+      /// a challenge for ep
+      tn::buffer make( const fc::ip::endpoint& ep )const;
+      /// @return true if b is an unexpired echo of a challenge we made for ep
+      bool       verify( const fc::ip::endpoint& ep, const tn::buffer& b )const;
+
+      /// the echo of challenge b
+      static tn::buffer make_echo( const tn::buffer& b );
+
+    private:
+      cookie_jar( const cookie_jar& );
+      cookie_jar& operator=( const cookie_jar& );
+
+      void mac( const fc::ip::endpoint& ep, uint32_t t, unsigned char out[16] )const;
+
+      unsigned char _secret[32];
+  };
+
+} // namespace tn
+
+#endif // _TORNET_COOKIE_JAR_HPP_
@@ -0,0 +1,19 @@
+#include "crypto_pool.hpp"
+#include <boost/lexical_cast.hpp>
+
+namespace tn {
+
+  crypto_pool::crypto_pool( uint32_t threads )
+  :_next(0),_jobs(0) {
+    for( uint32_t i = 0; i < threads; ++i ) {
+      _threads.push_back( boost::shared_ptr<fc::thread>( 
+          new fc::thread( ("node::crypto" + boost::lexical_cast<std::string>(i)).c_str() ) ) );
+    }
+  }
+
+  crypto_pool::~crypto_pool() {
+    for( uint32_t i = 0; i < _threads.size(); ++i ) 
+      _threads[i]->quit();
+  }
+
+} // namespace tn
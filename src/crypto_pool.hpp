@@ -0,0 +1,44 @@
+#ifndef _TORNET_CRYPTO_POOL_HPP_
+#define _TORNET_CRYPTO_POOL_HPP_
+#include <fc/thread.hpp>
+#include <boost/shared_ptr.hpp>
+#include <vector>
+#include <atomic>
+#include <stdint.h>
+
+namespace tn {
+
+  /**
+   *  Threads that run the RSA work of handshakes, signing our auth messages
+   *  and verifying those of our peers, away from the node thread.
+   *
+   *  Jobs are handed out round robin.  A fiber on the node thread waits for
+   *  the returned future, which lets the node thread handle other packets
+   *  in the meantime.  With no threads jobs run as tasks of the calling
+   *  thread.
+   */
+  class crypto_pool {
+    public:
+      crypto_pool( uint32_t threads );
+      ~crypto_pool();
+
+      template<typename Functor>
+      auto async( Functor&& f ) -> fc::future<decltype(f())> {
+        ++_jobs;
+        if( _threads.empty() ) 
+          return fc::thread::current().async( std::forward<Functor>(f), "crypto_job" );
+        return _threads[ _next++ % _threads.size() ]->async( std::forward<Functor>(f), "crypto_job" );
+      }
+
+      /// jobs posted so far
+      uint64_t jobs()const { return _jobs; }
+
+    private:
+      std::vector< boost::shared_ptr<fc::thread> > _threads;
+      std::atomic<uint32_t>                        _next;
+      std::atomic<uint64_t>                        _jobs;
+  };
+
+} // namespace tn
+
+#endif // _TORNET_CRYPTO_POOL_HPP_
@@ -1,6 +1,9 @@
 //#include <tornet/error.hpp>
 #include <tornet/db/peer.hpp>
 #include <string.h>
+#include <stddef.h>
+#include <algorithm>
+#include <vector>
 #include <fc/log.hpp>
 #include <fc/thread.hpp>
 #include <fc/filesystem.hpp>
@@ -16,10 +19,122 @@ namespace tn { namespace db {
 
   bool peer::record::valid()const {
     peer::record tmp;
-    return memcmp( tmp.public_key, public_key, sizeof(public_key) ) != 0;
+    return key_len && key_len <= sizeof(public_key) && 
+           memcmp( tmp.public_key, public_key, key_len ) != 0;
   }
   fc::sha1 peer::record::id()const {
-    return fc::sha1::hash( public_key, sizeof(public_key) );
+    return fc::sha1::hash( public_key, key_len );
+  }
+  uint32_t peer::record::packed_size()const {
+    return offsetof( record, public_key ) + (std::min)( uint32_t(key_len), uint32_t(sizeof(public_key)) );
+  }
+
+  namespace {
+    /**
+     *  Version of the record layout, kept in peer_meta.  Databases written 
+     *  before the version was kept hold original_layout records.
+     */
+    enum layout_version {
+      original_layout = 0,
+      current_layout  = 1
+    };
+    const char layout_key[] = "layout";
+
+    /// records as stored before the key length and connection settings
+    struct original_record {
+      original_record() { memset( this, 0, sizeof(original_record) ); }
+
+      fc::ip::endpoint last_ep;
+      uint32_t         est_bandwidth; 
+      uint32_t         avg_rtt_us;
+      uint64_t         nonce[2];
+      uint64_t         first_contact;
+      uint64_t         last_contact;
+      uint64_t         sent_credit;
+      uint64_t         recv_credit;
+      uint64_t         total_btc_recv;
+      uint64_t         total_btc_sent;
+      uint8_t          firewalled;             
+      uint8_t          rank;
+      uint8_t          published_rank;
+      char             public_key[256];        
+      char             bf_key[56];             
+      char             recv_btc[40];
+      char             send_btc[40];
+      float            priority;
+      char             connected;
+    };
+
+    /**
+     *  The settings negotiated with the peer are left at 0 so they are 
+     *  negotiated again, the keys were always 256 byte RSA keys.
+     */
+    void upgrade( const original_record& o, peer::record& r ) {
+      r = peer::record();
+      r.last_ep        = o.last_ep;
+      r.est_bandwidth  = o.est_bandwidth;
+      r.avg_rtt_us     = o.avg_rtt_us;
+      r.nonce[0]       = o.nonce[0];
+      r.nonce[1]       = o.nonce[1];
+      r.first_contact  = o.first_contact;
+      r.last_contact   = o.last_contact;
+      r.sent_credit    = o.sent_credit;
+      r.recv_credit    = o.recv_credit;
+      r.total_btc_recv = o.total_btc_recv;
+      r.total_btc_sent = o.total_btc_sent;
+      r.firewalled     = o.firewalled;
+      r.rank           = o.rank;
+      r.published_rank = o.published_rank;
+      memcpy( r.bf_key,   o.bf_key,   sizeof(r.bf_key) );
+      memcpy( r.recv_btc, o.recv_btc, sizeof(r.recv_btc) );
+      memcpy( r.send_btc, o.send_btc, sizeof(r.send_btc) );
+      r.priority       = o.priority;
+      r.connected      = o.connected;
+      r.key_len        = sizeof(o.public_key);
+      memcpy( r.public_key, o.public_key, sizeof(o.public_key) );
+    }
+
+    /**
+     *  Records stored in peer_data2 by builds that had key_len but no
+     *  connection ids, they share every field up to max_datagram.
+     */
+    struct no_cid_record {
+      no_cid_record() { memset( this, 0, sizeof(no_cid_record) ); }
+
+      fc::ip::endpoint last_ep;
+      uint32_t         est_bandwidth; 
+      uint32_t         avg_rtt_us;
+      uint64_t         nonce[2];
+      uint64_t         first_contact;
+      uint64_t         last_contact;
+      uint64_t         sent_credit;
+      uint64_t         recv_credit;
+      uint64_t         total_btc_recv;
+      uint64_t         total_btc_sent;
+      uint8_t          firewalled;             
+      uint8_t          rank;
+      uint8_t          published_rank;
+      char             bf_key[56];             
+      char             recv_btc[40];
+      char             send_btc[40];
+      float            priority;
+      char             connected;
+      uint8_t          cipher_suite;
+      uint8_t          remote_features;
+      uint16_t         max_datagram;
+      uint16_t         key_len;
+      char             public_key[256];
+    };
+
+    void upgrade( const no_cid_record& o, peer::record& r ) {
+      r = peer::record();
+      memcpy( &r, &o, offsetof( no_cid_record, max_datagram ) + sizeof(o.max_datagram) );
+      r.key_len = (std::min)( o.key_len, uint16_t(sizeof(r.public_key)) );
+      memcpy( r.public_key, o.public_key, r.key_len );
+    }
+
+    /// records stored in peer_data3 already have the current layout
+    void upgrade( const peer::record& o, peer::record& r ) { r = o; }
   }
 
 
@@ -36,6 +151,18 @@ namespace tn { namespace db {
 
       Db*                 m_peer_db;
       Db*                 m_ep_index_db;
+      Db*                 m_meta_db;
+
+      uint32_t get_layout();
+      void     set_layout( uint32_t v );
+      /// rewrites every record from layout v in the current one
+      void     upgrade_records( uint32_t v );
+      /**
+       *  Moves the records of a db that earlier builds kept in their own
+       *  files into peer_data and removes those files.
+       */
+      template<typename Record>
+      void     import_renamed( const char* data_name, const char* index_name );
   };
   const fc::sha1& peer::get_local_id()const { return my->m_node_id; }
   peer::peer( const fc::sha1& node_id, const fc::path& dir )
@@ -54,10 +181,112 @@ namespace tn { namespace db {
   }
 
   peer_private::peer_private( const fc::sha1& node_id, const fc::path& envdir ) 
-  :m_thread("db::peer"), m_node_id(node_id), m_envdir(envdir), m_env(0), m_peer_db(0), m_ep_index_db(0)
+  :m_thread("db::peer"), m_node_id(node_id), m_envdir(envdir), m_env(0), m_peer_db(0), m_ep_index_db(0), m_meta_db(0)
   {
   }
 
+  uint32_t peer_private::get_layout() {
+    uint32_t v = original_layout;
+    Dbt key( (void*)layout_key, sizeof(layout_key) );
+    Dbt val( &v, sizeof(v) );
+    val.set_ulen( sizeof(v) );
+    val.set_flags( DB_DBT_USERMEM );
+    if( m_meta_db->get( 0, &key, &val, 0 ) == DB_NOTFOUND ) 
+      return original_layout;
+    return v;
+  }
+
+  void peer_private::set_layout( uint32_t v ) {
+    Dbt key( (void*)layout_key, sizeof(layout_key) );
+    Dbt val( &v, sizeof(v) );
+    m_meta_db->put( 0, &key, &val, DB_AUTO_COMMIT );
+  }
+
+  void peer_private::upgrade_records( uint32_t v ) {
+    if( v != original_layout ) 
+      FC_THROW_MSG( "Unknown peer record layout" );
+
+    // read everything first, the cursor must not see the rewritten records
+    std::vector<fc::sha1>        keys;
+    std::vector<original_record> olds;
+    Dbc* cur;
+    m_peer_db->cursor( NULL, &cur, 0 );
+    Dbt key, val;
+    while( cur->get( &key, &val, DB_NEXT ) == 0 ) {
+      if( key.get_size() != sizeof(fc::sha1) ) continue;
+      keys.push_back( fc::sha1() );
+      memcpy( keys.back().data(), key.get_data(), sizeof(fc::sha1) );
+      olds.push_back( original_record() );
+      memcpy( &olds.back(), val.get_data(), (std::min)( uint32_t(val.get_size()), uint32_t(sizeof(original_record)) ) );
+    }
+    cur->close();
+
+    DbTxn* txn = NULL;
+    m_env.txn_begin( NULL, &txn, 0 );
+    try {
+      for( uint32_t i = 0; i < keys.size(); ++i ) {
+        peer::record r;
+        upgrade( olds[i], r );
+        Dbt k( keys[i].data(), sizeof(fc::sha1) );
+        Dbt d( (char*)&r, r.packed_size() );
+        m_peer_db->put( txn, &k, &d, 0 );
+      }
+      txn->commit( 0 );
+    } catch ( const DbException& e ) {
+      txn->abort();
+      FC_THROW_MSG( "%s", e.what() );
+    }
+    slog( "upgraded %d peer records", int(keys.size()) );
+  }
+
+  template<typename Record>
+  void peer_private::import_renamed( const char* data_name, const char* index_name ) {
+    std::vector<fc::sha1> keys;
+    std::vector<Record>   olds;
+    Db old( &m_env, 0 );
+    try {
+      old.open( NULL, data_name, data_name, DB_BTREE, DB_AUTO_COMMIT, 0 );
+    } catch( const DbException& ) {
+      old.close(0);
+      return; // this node never ran such a build
+    }
+    Dbc* cur;
+    old.cursor( NULL, &cur, 0 );
+    Dbt key, val;
+    while( cur->get( &key, &val, DB_NEXT ) == 0 ) {
+      if( key.get_size() != sizeof(fc::sha1) ) continue;
+      keys.push_back( fc::sha1() );
+      memcpy( keys.back().data(), key.get_data(), sizeof(fc::sha1) );
+      olds.push_back( Record() );
+      memcpy( &olds.back(), val.get_data(), (std::min)( uint32_t(val.get_size()), uint32_t(sizeof(Record)) ) );
+    }
+    cur->close();
+    old.close(0);
+
+    DbTxn* txn = NULL;
+    m_env.txn_begin( NULL, &txn, 0 );
+    try {
+      // the renamed files were written after peer_data, their records win
+      for( uint32_t i = 0; i < keys.size(); ++i ) {
+        peer::record r;
+        upgrade( olds[i], r );
+        Dbt k( keys[i].data(), sizeof(fc::sha1) );
+        Dbt d( (char*)&r, r.packed_size() );
+        m_peer_db->put( txn, &k, &d, 0 );
+      }
+      txn->commit( 0 );
+    } catch ( const DbException& e ) {
+      txn->abort();
+      FC_THROW_MSG( "%s", e.what() );
+    }
+    slog( "imported %d peer records from %s", int(keys.size()), data_name );
+
+    m_env.dbremove( NULL, data_name, NULL, DB_AUTO_COMMIT );
+    try {
+      m_env.dbremove( NULL, index_name, NULL, DB_AUTO_COMMIT );
+    } catch( const DbException& ) {}
+  }
+
   int get_peer_ep( Db* sdb, const Dbt* key, const Dbt* data, Dbt* skey ) {
     skey->set_data(data->get_data() ); 
     skey->set_size( sizeof( fc::ip::endpoint ) );
@@ -108,6 +337,28 @@ namespace tn { namespace db {
       elog( "%s", fc::current_exception().diagnostic_information().c_str() );
       fc::rethrow_exception( fc::current_exception() );
     }
+
+    try { 
+      my->m_meta_db = new Db(&my->m_env, 0);
+      my->m_meta_db->open( NULL, "peer_meta", "peer_meta", DB_BTREE, DB_CREATE | DB_AUTO_COMMIT, 0 );
+      uint32_t v = my->get_layout();
+      if( v > current_layout ) 
+        FC_THROW_MSG( "Peer database was written by a newer version" );
+      if( v != current_layout ) {
+        wlog( "upgrading peer database from layout %d to %d", v, int(current_layout) );
+        my->upgrade_records( v );
+        my->set_layout( current_layout );
+      }
+      // oldest first, so the newest copy of a record is the one kept
+      my->import_renamed<no_cid_record>( "peer_data2", "peer_ep_index2" );
+      my->import_renamed<peer::record>( "peer_data3", "peer_ep_index3" );
+    } catch( const DbException& e ) {
+      elog( "Error opening peer_meta database: %s", e.what() );
+      FC_THROW_MSG( "%s", e.what() );
+    } catch( ... ) {
+      elog( "%s", fc::current_exception().diagnostic_information().c_str() );
+      fc::rethrow_exception( fc::current_exception() );
+    }
   }
 
   void peer::close() {
@@ -128,6 +379,11 @@ namespace tn { namespace db {
           delete my->m_ep_index_db;
           my->m_ep_index_db = 0;
         }
+        if( my->m_meta_db ) {
+          my->m_meta_db->close(0);    
+          delete my->m_meta_db;
+          my->m_meta_db = 0;
+        }
         slog( "closing environment" );
         my->m_env.close(0);
     } catch ( const DbException& e ) {
@@ -182,7 +438,9 @@ namespace tn { namespace db {
       key.set_ulen( sizeof(dist) );
       key.set_flags( DB_DBT_USERMEM );
       
+      r = record();
       Dbt val;
+      val.set_data( &r );
       val.set_size( sizeof(r) );
       val.set_ulen( sizeof(r) );
       val.set_flags( DB_DBT_USERMEM );
@@ -219,7 +477,7 @@ namespace tn { namespace db {
     }
     slog("storing %s at ep %s", fc::string(id).c_str(), fc::string(m.last_ep).c_str() );
 
-    fc::sha1 check = fc::sha1::hash( m.public_key, sizeof(m.public_key) );
+    fc::sha1 check = m.id();
     if( check != id ) {
       FC_THROW( "sha1(data) does not match given id" );
     }
@@ -233,7 +491,7 @@ namespace tn { namespace db {
     try {
         Dbt key(dist.data(),sizeof(dist));
         key.set_flags( DB_DBT_USERMEM );
-        Dbt val( (char*)&m, sizeof(m));
+        Dbt val( (char*)&m, m.packed_size() );
         val.set_flags( DB_DBT_USERMEM );
         my->m_peer_db->put( txn, &key, &val, 0 );
         txn->commit( DB_TXN_WRITE_NOSYNC );
@@ -277,6 +535,7 @@ namespace tn { namespace db {
   }
 
   bool peer::fetch_by_endpoint( const fc::ip::endpoint& ep, fc::sha1& id, peer::record& m ) {
+      m = record();
       Dbt skey((char*)&ep, sizeof(ep));
       skey.set_flags( DB_DBT_USERMEM );
 
@@ -312,7 +571,8 @@ namespace tn { namespace db {
     if( rtn != DB_NOTFOUND ) {
       memcpy(id.data(), key.get_data(), key.get_size() );
       id = id ^ my->m_node_id;
-      memcpy( &m, val.get_data(), val.get_size() );
+      m = record();
+      memcpy( &m, val.get_data(), (std::min)( uint32_t(val.get_size()), uint32_t(sizeof(m)) ) );
       return true;
     }
     wlog( "Unable to find recno %1%", recnum );
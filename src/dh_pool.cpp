@@ -0,0 +1,96 @@
+#include "dh_pool.hpp"
+#include <fc/dh.hpp>
+#include <fc/base64.hpp>
+#include <fc/log.hpp>
+#include <fc/error.hpp>
+#include <fc/exception.hpp>
+
+namespace tn {
+
+  dh_pool::dh_pool( uint32_t size )
+  :_size(size),_refilling(false),_done(false),_hits(0),_misses(0) {
+    if( !_size ) return;
+    _thread.reset( new fc::thread( "node::dh" ) );
+    _refilling   = true;
+    _refill_done = _thread->async( [this](){ refill(); } );
+  }
+
+  dh_pool::~dh_pool() {
+    _done = true;
+    if( _refill_done.valid() ) 
+      _refill_done.wait();
+    if( _thread ) 
+      _thread->quit();
+    for( uint32_t i = 0; i < _ready.size(); ++i ) 
+      delete _ready[i];
+  }
+
+  fc::diffie_hellman* dh_pool::take() {
+    fc::diffie_hellman* d = 0;
+    bool start = false;
+    {
+      boost::unique_lock<boost::mutex> lock(_mutex);
+      if( _ready.size() ) {
+        d = _ready.front();
+        _ready.pop_front();
+      }
+      if( _thread && !_refilling && _ready.size() < _size ) 
+        start = _refilling = true;
+    }
+    // take() is only called from the node thread, so is this
+    if( start ) 
+      _refill_done = _thread->async( [this](){ refill(); } );
+
+    if( d ) {
+      ++_hits;
+      return d;
+    }
+    ++_misses;
+    return generate();
+  }
+
+  /**
+   *  Public keys that happen to be shorter than 56 bytes are thrown away so
+   *  that every key goes out in 56 bytes.
+   */
+  fc::diffie_hellman* dh_pool::generate() {
+    try {
+      static std::string decode_param = 
+            fc::base64_decode( "lyIvBWa2SzbSeqb4HgBASJEj3SJrYFAIaErwx5GMt71CtFE4FYXDrVw1bPTBaRX4GTDAIBQM8Rs=" );
+      fc::diffie_hellman* d = new fc::diffie_hellman();
+      d->p.clear();
+      d->g = 5;
+      d->p.insert( d->p.begin(), decode_param.begin(), decode_param.end() );
+      d->pub_key.reserve(63);
+      do {
+        d->generate_pub_key(); 
+      } while ( d->pub_key.size() != 56 );
+      return d;
+    } catch ( ... ) {
+      elog( "%s", fc::current_exception().diagnostic_information().c_str() );
+      throw;
+    }
+  }
+
+  void dh_pool::refill() {
+    try {
+      while( !_done ) {
+        {
+          boost::unique_lock<boost::mutex> lock(_mutex);
+          if( _ready.size() >= _size ) {
+            _refilling = false;
+            return;
+          }
+        }
+        fc::diffie_hellman* d = generate();
+        boost::unique_lock<boost::mutex> lock(_mutex);
+        _ready.push_back(d);
+      }
+    } catch ( ... ) { 
+      elog( "%s", fc::current_exception().diagnostic_information().c_str() ); 
+    }
+    boost::unique_lock<boost::mutex> lock(_mutex);
+    _refilling = false;
+  }
+
+} // namespace tn
@@ -0,0 +1,53 @@
+#ifndef _TORNET_DH_POOL_HPP_
+#define _TORNET_DH_POOL_HPP_
+#include <fc/thread.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <deque>
+#include <atomic>
+#include <stdint.h>
+
+namespace fc { struct diffie_hellman; }
+
+namespace tn {
+
+  /**
+   *  Keeps a number of Diffie-Hellman keypairs ready so that a new connection
+   *  does not have to wait for a modular exponentiation on the node thread.
+   *
+   *  A worker thread tops the pool up whenever a keypair is taken.  Each
+   *  keypair is handed out exactly once.  When the pool runs dry take()
+   *  generates one inline and counts a miss.
+   */
+  class dh_pool {
+    public:
+      /// @param size - keypairs to keep ready, 0 generates every keypair inline
+      dh_pool( uint32_t size );
+      ~dh_pool();
+
+      /// @return a keypair with a 56 byte public key, owned by the caller
+      fc::diffie_hellman* take();
+
+      /// generates a keypair on the calling thread
+      static fc::diffie_hellman* generate();
+
+      uint64_t hits()const   { return _hits;   }
+      uint64_t misses()const { return _misses; }
+
+    private:
+      void refill();
+
+      uint32_t                          _size;
+      boost::mutex                      _mutex;
+      std::deque<fc::diffie_hellman*>   _ready;
+      bool                              _refilling;
+      std::atomic<bool>                 _done;
+      std::atomic<uint64_t>             _hits;
+      std::atomic<uint64_t>             _misses;
+      boost::scoped_ptr<fc::thread>     _thread;
+      fc::future<void>                  _refill_done;
+  };
+
+} // namespace tn
+
+#endif // _TORNET_DH_POOL_HPP_
@@ -0,0 +1,161 @@
+#include "ecc.hpp"
+#include <fc/log.hpp>
+#include <fc/error.hpp>
+#include <fc/exception.hpp>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <string.h>
+#include <algorithm>
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(OPENSSL_NO_EC)
+#define TORNET_HAVE_ECC 1
+#endif
+
+namespace tn {
+
+#ifdef TORNET_HAVE_ECC
+
+  bool ecc_available() { return true; }
+
+  static EVP_PKEY* generate_key( int type ) {
+    EVP_PKEY*     k   = 0;
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id( type, 0 );
+    bool ok = ctx && EVP_PKEY_keygen_init( ctx ) > 0 && EVP_PKEY_keygen( ctx, &k ) > 0;
+    if( ctx ) EVP_PKEY_CTX_free( ctx );
+    if( !ok ) FC_THROW_MSG( "Unable to generate key of type %d", type );
+    return k;
+  }
+
+  static void raw_public_key( EVP_PKEY* k, unsigned char* out, size_t len ) {
+    size_t l = len;
+    if( EVP_PKEY_get_raw_public_key( k, out, &l ) <= 0 || l != len ) 
+      FC_THROW_MSG( "Unable to get public key" );
+  }
+
+  x25519_key::x25519_key()
+  :_key( generate_key( EVP_PKEY_X25519 ) ) {
+    raw_public_key( _key, _pub, sizeof(_pub) );
+  }
+
+  x25519_key::~x25519_key() {
+    EVP_PKEY_free( _key );
+  }
+
+  bool x25519_key::agree( const unsigned char* peer_pub, unsigned char secret[key_size] )const {
+    EVP_PKEY* peer = EVP_PKEY_new_raw_public_key( EVP_PKEY_X25519, 0, peer_pub, key_size );
+    if( !peer ) return false;
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new( _key, 0 );
+    size_t len = key_size;
+    bool ok = ctx && EVP_PKEY_derive_init( ctx ) > 0 && EVP_PKEY_derive_set_peer( ctx, peer ) > 0 &&
+              EVP_PKEY_derive( ctx, secret, &len ) > 0 && len == key_size;
+    if( ctx ) EVP_PKEY_CTX_free( ctx );
+    EVP_PKEY_free( peer );
+
+    unsigned char any = 0;
+    for( uint32_t i = 0; i < key_size; ++i ) any |= secret[i];
+    return ok && any;
+  }
+
+  bool x25519_key::derive( const unsigned char* peer_pub, char* out, uint32_t len )const {
+    static const char label[] = "tornet x25519";
+    unsigned char s[key_size];
+    if( len > SHA512_DIGEST_LENGTH || !agree( peer_pub, s ) ) 
+      return false;
+
+    const unsigned char* lo = _pub;
+    const unsigned char* hi = peer_pub;
+    if( memcmp( lo, hi, key_size ) > 0 ) std::swap( lo, hi );
+
+    unsigned char h[SHA512_DIGEST_LENGTH];
+    SHA512_CTX sha;
+    SHA512_Init( &sha );
+    SHA512_Update( &sha, label, sizeof(label) );
+    SHA512_Update( &sha, s, sizeof(s) );
+    SHA512_Update( &sha, lo, key_size );
+    SHA512_Update( &sha, hi, key_size );
+    SHA512_Final( h, &sha );
+    memcpy( out, h, len );
+    memset( h, 0, sizeof(h) );
+    memset( s, 0, sizeof(s) );
+    return true;
+  }
+
+  ed25519_key::ed25519_key()
+  :_key( generate_key( EVP_PKEY_ED25519 ) ) {
+    init_pub();
+  }
+
+  ed25519_key::ed25519_key( const unsigned char* seed )
+  :_key( EVP_PKEY_new_raw_private_key( EVP_PKEY_ED25519, 0, seed, seed_size ) ) {
+    if( !_key ) FC_THROW_MSG( "Invalid Ed25519 seed" );
+    init_pub();
+  }
+
+  ed25519_key::~ed25519_key() {
+    EVP_PKEY_free( _key );
+  }
+
+  void ed25519_key::init_pub() {
+    raw_public_key( _key, _pub, sizeof(_pub) );
+  }
+
+  void ed25519_key::get_seed( unsigned char seed[seed_size] )const {
+    size_t l = seed_size;
+    if( EVP_PKEY_get_raw_private_key( _key, seed, &l ) <= 0 || l != seed_size ) 
+      FC_THROW_MSG( "Unable to get Ed25519 seed" );
+  }
+
+  void ed25519_key::sign( const char* msg, uint32_t len, unsigned char sig[sig_size] )const {
+    EVP_MD_CTX* ctx  = EVP_MD_CTX_new();
+    size_t      slen = sig_size;
+    bool ok = ctx && EVP_DigestSignInit( ctx, 0, 0, 0, _key ) > 0 &&
+              EVP_DigestSign( ctx, sig, &slen, (const unsigned char*)msg, len ) > 0 && slen == sig_size;
+    if( ctx ) EVP_MD_CTX_free( ctx );
+    if( !ok ) FC_THROW_MSG( "Unable to sign with Ed25519" );
+  }
+
+  bool ed25519_key::verify( const unsigned char* pub, const char* msg, uint32_t len, 
+                            const unsigned char* sig ) {
+    return ed25519_public_key( pub ).verify( msg, len, sig );
+  }
+
+  ed25519_public_key::ed25519_public_key( const unsigned char* pub )
+  :_key( EVP_PKEY_new_raw_public_key( EVP_PKEY_ED25519, 0, pub, ed25519_key::key_size ) ){}
+
+  ed25519_public_key::~ed25519_public_key() {
+    if( _key ) EVP_PKEY_free( _key );
+  }
+
+  bool ed25519_public_key::verify( const char* msg, uint32_t len, const unsigned char* sig )const {
+    if( !_key ) return false;
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+    bool ok = ctx && EVP_DigestVerifyInit( ctx, 0, 0, 0, _key ) > 0 &&
+              EVP_DigestVerify( ctx, sig, ed25519_key::sig_size, (const unsigned char*)msg, len ) == 1;
+    if( ctx ) EVP_MD_CTX_free( ctx );
+    return ok;
+  }
+
+#else // no X25519/Ed25519 in this OpenSSL
+
+  bool ecc_available() { return false; }
+
+  x25519_key::x25519_key():_key(0) { FC_THROW_MSG( "X25519 is not supported by this OpenSSL" ); }
+  x25519_key::~x25519_key() {}
+  bool x25519_key::agree( const unsigned char*, unsigned char* )const { return false; }
+  bool x25519_key::derive( const unsigned char*, char*, uint32_t )const { return false; }
+
+  ed25519_key::ed25519_key():_key(0) { FC_THROW_MSG( "Ed25519 is not supported by this OpenSSL" ); }
+  ed25519_key::ed25519_key( const unsigned char* ):_key(0) { FC_THROW_MSG( "Ed25519 is not supported by this OpenSSL" ); }
+  ed25519_key::~ed25519_key() {}
+  void ed25519_key::init_pub() {}
+  void ed25519_key::get_seed( unsigned char* )const {}
+  void ed25519_key::sign( const char*, uint32_t, unsigned char* )const {}
+  bool ed25519_key::verify( const unsigned char*, const char*, uint32_t, const unsigned char* ) { return false; }
+
+  ed25519_public_key::ed25519_public_key( const unsigned char* ):_key(0) {}
+  ed25519_public_key::~ed25519_public_key() {}
+  bool ed25519_public_key::verify( const char*, uint32_t, const unsigned char* )const { return false; }
+
+#endif
+
+} // namespace tn
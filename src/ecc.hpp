@@ -0,0 +1,97 @@
+#ifndef _TORNET_ECC_HPP_
+#define _TORNET_ECC_HPP_
+#include <stdint.h>
+
+typedef struct evp_pkey_st EVP_PKEY;
+
+namespace tn {
+
+  /// true if the linked OpenSSL provides X25519 and Ed25519
+  bool ecc_available();
+
+  /**
+   *  An ephemeral X25519 keypair for one key exchange.
+   */
+  class x25519_key {
+    public:
+      enum { key_size = 32 };
+
+      /// generates a new keypair
+      x25519_key();
+      ~x25519_key();
+
+      const unsigned char* pub()const { return _pub; }
+
+      /**
+       *  @return false if peer_pub is not a usable public key, such as one
+       *          of small order that would make the secret all zeros.
+       */
+      bool agree( const unsigned char* peer_pub, unsigned char secret[key_size] )const;
+
+      /**
+       *  Hashes the agreed secret together with both public keys into len
+       *  bytes of key material, len <= 64.  Both peers get the same result.
+       */
+      bool derive( const unsigned char* peer_pub, char* out, uint32_t len )const;
+
+    private:
+      x25519_key( const x25519_key& );
+      x25519_key& operator=( const x25519_key& );
+
+      EVP_PKEY*     _key;
+      unsigned char _pub[key_size];
+  };
+
+  /**
+   *  A peer's Ed25519 public key, decoded once so that verifying several
+   *  signatures with it does not decode it each time.  Verifying is thread
+   *  safe.
+   */
+  class ed25519_public_key {
+    public:
+      explicit ed25519_public_key( const unsigned char* pub );
+      ~ed25519_public_key();
+
+      /// false if pub is not a valid key, every signature then fails
+      bool valid()const { return _key != 0; }
+      bool verify( const char* msg, uint32_t len, const unsigned char* sig )const;
+
+    private:
+      ed25519_public_key( const ed25519_public_key& );
+      ed25519_public_key& operator=( const ed25519_public_key& );
+
+      EVP_PKEY*     _key;
+  };
+
+  /**
+   *  An Ed25519 node identity.  Signing and verifying are thread safe.
+   */
+  class ed25519_key {
+    public:
+      enum { key_size = 32, seed_size = 32, sig_size = 64 };
+
+      /// generates a new identity
+      ed25519_key();
+      /// restores the identity saved with get_seed()
+      explicit ed25519_key( const unsigned char* seed );
+      ~ed25519_key();
+
+      const unsigned char* pub()const { return _pub; }
+      void get_seed( unsigned char seed[seed_size] )const;
+
+      void sign( const char* msg, uint32_t len, unsigned char sig[sig_size] )const;
+      static bool verify( const unsigned char* pub, const char* msg, uint32_t len, 
+                          const unsigned char* sig );
+
+    private:
+      ed25519_key( const ed25519_key& );
+      ed25519_key& operator=( const ed25519_key& );
+      void init_pub();
+
+      EVP_PKEY*     _key;
+      unsigned char _pub[key_size];
+  };
+
+} // namespace tn
+
+#endif // _TORNET_ECC_HPP_
@@ -0,0 +1,161 @@
+#ifndef _TORNET_ENDPOINT_TABLE_HPP_
+#define _TORNET_ENDPOINT_TABLE_HPP_
+#include <fc/ip.hpp>
+#include <stdint.h>
+#include <vector>
+#include <utility>
+
+namespace tn {
+
+  /**
+   *  Hash table from IPv4 endpoints to V using open addressing with linear
+   *  probing.  Endpoints are packed into a single 64 bit key that is probed
+   *  in its own array, so a lookup usually touches one cache line and never
+   *  chases a pointer.
+   *
+   *  Erasing uses backward shift deletion, there are no tombstones, and the
+   *  table shrinks again when it becomes sparse so that its size follows the
+   *  number of live entries.
+   *
+   *  Any insert or erase invalidates iterators and references.
+   */
+  template<typename V>
+  class endpoint_table {
+    public:
+      typedef std::pair<fc::ip::endpoint,V> value_type;
+
+      template<typename T, typename Table>
+      class iterator_base {
+        public:
+          iterator_base( Table* t = 0, uint32_t i = 0 ):_t(t),_i(i){ skip(); }
+          template<typename T2, typename Table2>
+          iterator_base( const iterator_base<T2,Table2>& o ):_t(o._t),_i(o._i){}
+
+          T& operator*()const  { return _t->_values[_i];  }
+          T* operator->()const { return &_t->_values[_i]; }
+          iterator_base& operator++() { ++_i; skip(); return *this; }
+
+          bool operator==( const iterator_base& o )const { return _i == o._i; }
+          bool operator!=( const iterator_base& o )const { return _i != o._i; }
+
+        private:
+          template<typename,typename> friend class iterator_base;
+          friend class endpoint_table;
+          void skip() { while( _t && _i < _t->_keys.size() && !_t->_keys[_i] ) ++_i; }
+          Table*   _t;
+          uint32_t _i;
+      };
+      typedef iterator_base<value_type,endpoint_table>                   iterator;
+      typedef iterator_base<const value_type,const endpoint_table>       const_iterator;
+
+      endpoint_table():_size(0){ rehash( min_capacity ); }
+
+      uint32_t size()const { return _size; }
+      bool     empty()const{ return !_size; }
+
+      iterator       begin()       { return iterator(this,0); }
+      iterator       end()         { return iterator(this,_keys.size()); }
+      const_iterator begin()const  { return const_iterator(this,0); }
+      const_iterator end()const    { return const_iterator(this,_keys.size()); }
+
+      iterator find( const fc::ip::endpoint& ep ) {
+        return iterator( this, lookup( pack(ep) ) );
+      }
+      const_iterator find( const fc::ip::endpoint& ep )const {
+        return const_iterator( this, lookup( pack(ep) ) );
+      }
+
+      V& operator[]( const fc::ip::endpoint& ep ) {
+        uint64_t k = pack(ep);
+        uint32_t i = lookup(k);
+        if( i != _keys.size() ) return _values[i].second;
+        if( (_size+1) * 4 > _keys.size() * 3 )
+          rehash( _keys.size() * 2 );
+        i = slot(k);
+        while( _keys[i] ) i = (i+1) & mask();
+        _keys[i]   = k;
+        _values[i] = value_type( ep, V() );
+        ++_size;
+        return _values[i].second;
+      }
+
+      void erase( iterator itr ) { erase_slot( itr._i ); }
+      uint32_t erase( const fc::ip::endpoint& ep ) {
+        uint32_t i = lookup( pack(ep) );
+        if( i == _keys.size() ) return 0;
+        erase_slot(i);
+        return 1;
+      }
+
+      void clear() {
+        _size = 0;
+        std::vector<uint64_t>().swap(_keys);
+        std::vector<value_type>().swap(_values);
+        rehash( min_capacity );
+      }
+
+    private:
+      enum { min_capacity = 64 };
+
+      // 0 is reserved for empty slots, no peer sends from 0.0.0.0:0
+      static uint64_t pack( const fc::ip::endpoint& ep ) {
+        return (uint64_t(uint32_t(ep.get_address())) << 16) | ep.port();
+      }
+      uint32_t mask()const { return _keys.size() - 1; }
+      uint32_t slot( uint64_t k )const {
+        // fibonacci hashing spreads sequential addresses and ports
+        return uint32_t( (k * 0x9E3779B97F4A7C15ull) >> 32 ) & mask();
+      }
+      uint32_t lookup( uint64_t k )const {
+        if( !k ) return _keys.size();
+        uint32_t i = slot(k);
+        while( _keys[i] ) {
+          if( _keys[i] == k ) return i;
+          i = (i+1) & mask();
+        }
+        return _keys.size();
+      }
+
+      void erase_slot( uint32_t i ) {
+        _keys[i]   = 0;
+        _values[i] = value_type();
+        --_size;
+        // move later members of the probe run back so lookups still find them
+        uint32_t j = i;
+        while( true ) {
+          j = (j+1) & mask();
+          if( !_keys[j] ) break;
+          uint32_t home = slot(_keys[j]);
+          bool between = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+          if( between ) continue;
+          _keys[i] = _keys[j];
+          std::swap( _values[i], _values[j] );
+          _keys[j] = 0;
+          i = j;
+        }
+        if( _keys.size() > min_capacity && _size * 8 < _keys.size() )
+          rehash( _keys.size() / 2 );
+      }
+
+      void rehash( uint32_t cap ) {
+        std::vector<uint64_t>   keys( cap, 0 );
+        std::vector<value_type> values( cap );
+        keys.swap(_keys);
+        values.swap(_values);
+        for( uint32_t i = 0; i < keys.size(); ++i ) {
+          if( !keys[i] ) continue;
+          uint32_t s = slot(keys[i]);
+          while( _keys[s] ) s = (s+1) & mask();
+          _keys[s] = keys[i];
+          std::swap( _values[s], values[i] );
+        }
+      }
+
+      uint32_t                _size;
+      std::vector<uint64_t>   _keys;
+      std::vector<value_type> _values;
+  };
+
+} // namespace tn
+
+#endif // _TORNET_ENDPOINT_TABLE_HPP_
@@ -116,7 +116,23 @@ namespace tn {
             return l->priority() > r->priority();
           } 
         );
+        ++b;
       }
   }
 
+  /**
+   *  A connection holds one of the k slots of its bucket if fewer than k 
+   *  other connections in the bucket have a higher priority.
+   */
+  bool kbucket::holds_slot( const connection* c, uint32_t k ) {
+    bref buck = get_bucket_for_target( c->get_remote_id() );
+    uint32_t better = 0;
+    for( auto itr = buck.begin(); itr != buck.end(); ++itr ) {
+      if( *itr == c ) continue;
+      if( (*itr)->priority() > c->priority() && ++better >= k )
+        return false;
+    }
+    return std::find( buck.begin(), buck.end(), c ) != buck.end();
+  }
+
 } // namespace tn
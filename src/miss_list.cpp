@@ -1,96 +1,306 @@
 #include <tornet/miss_list.hpp>
 #include <iostream>
+#include <string.h>
 
 namespace tn {
 
-void miss_list::clear() { m_ml.clear(); }
+typedef miss_list::seq_num seq_num;
 
-void miss_list::add( seq_num start, seq_num end ) {
-  mlist::iterator itr = m_ml.begin();
-  while( itr != m_ml.end() && (itr->second+1) < start ) { 
-    ++itr;
+/// how far b is after a
+static uint32_t gap( seq_num a, seq_num b ) {
+  return seq_num( b.value() - a.value() ).value();
+}
+
+static void set_bits( std::vector<uint64_t>& b, uint32_t i, uint32_t n, uint32_t& count ) {
+  uint32_t mask = b.size() * 64 - 1;
+  while( n ) {
+    uint32_t o = i & 63;
+    uint32_t k = (std::min)( 64 - o, n );
+    uint64_t m = (k == 64 ? ~0ull : ((1ull << k) - 1)) << o;
+    count    += __builtin_popcountll( m & ~b[i>>6] );
+    b[i>>6]  |= m;
+    i = (i + k) & mask;
+    n -= k;
+  }
+}
+
+static void put_seq( char* out, seq_num s, bool seq32 ) {
+  uint32_t v32 = s.value();
+  uint16_t v16 = s.value();
+  if( seq32 ) memcpy( out, &v32, sizeof(v32) );
+  else        memcpy( out, &v16, sizeof(v16) );
+}
+
+static seq_num get_seq( const char* in, bool seq32, seq_num ref ) {
+  if( seq32 ) {
+    uint32_t v;
+    memcpy( &v, in, sizeof(v) );
+    return seq_num(v);
+  }
+  uint16_t v;
+  memcpy( &v, in, sizeof(v) );
+  return sequence::widen( v, ref );
+}
+
+static uint32_t put_varint( char* out, uint32_t v ) {
+  uint32_t l = 0;
+  while( v >= 0x80 ) {
+    out[l++] = char( (v & 0x7f) | 0x80 );
+    v >>= 7;
+  }
+  out[l++] = char(v);
+  return l;
+}
+
+static bool get_varint( const char* in, uint32_t len, uint32_t& pos, uint32_t& v ) {
+  v = 0;
+  for( uint32_t shift = 0; pos < len && shift < 32; shift += 7 ) {
+    uint8_t c = in[pos++];
+    v |= uint32_t(c & 0x7f) << shift;
+    if( !(c & 0x80) ) return true;
+  }
+  return false;
+}
+
+miss_list::miss_list():_count(0){}
+
+void miss_list::clear() {
+  if( _count ) std::fill( _bits.begin(), _bits.end(), 0 );
+  _count = 0;
+}
+
+bool miss_list::test( seq_num s )const {
+  uint32_t i = s.value() & (bits() - 1);
+  return (_bits[i>>6] >> (i & 63)) & 1;
+}
+
+void miss_list::set_range( seq_num s, uint32_t n ) {
+  set_bits( _bits, s.value() & (bits() - 1), n, _count );
+}
+
+/**
+ *  Makes the bitmap larger than span and moves the members to their slots
+ *  in the larger one.
+ */
+void miss_list::grow( uint32_t span ) {
+  uint64_t words = (std::max)( uint64_t(_bits.size()), uint64_t(16) );
+  while( words * 64 <= span ) words *= 2;
+  if( words == _bits.size() ) return;
+
+  std::vector<uint64_t> nb( words );
+  uint32_t n = 0;
+  if( _count ) {
+    seq_num s = _first;
+    for(;;) {
+      seq_num e = next_gap(s) - 1;
+      set_bits( nb, s.value() & (words * 64 - 1), gap(s,e) + 1, n );
+      if( e == _last ) break;
+      s = next_member( e + 1 );
+    }
+  }
+  _bits.swap(nb);
+}
+
+seq_num miss_list::next_member( seq_num s )const {
+  uint32_t mask = bits() - 1;
+  uint32_t i    = s.value() & mask;
+  uint32_t off  = 0;
+  for(;;) {
+    uint32_t b = i & 63;
+    uint64_t w = _bits[i>>6] >> b;
+    if( w ) return s + int( off + __builtin_ctzll(w) );
+    off += 64 - b;
+    i    = (i + 64 - b) & mask;
+  }
+}
+
+seq_num miss_list::prev_member( seq_num s )const {
+  uint32_t mask = bits() - 1;
+  uint32_t i    = s.value() & mask;
+  uint32_t off  = 0;
+  for(;;) {
+    uint32_t b = i & 63;
+    uint64_t w = _bits[i>>6] << (63 - b);
+    if( w ) return s - int( off + __builtin_clzll(w) );
+    off += b + 1;
+    i    = (i - b - 1) & mask;
   }
-  if( itr == m_ml.end() ) {
-    m_ml.push_back( std::make_pair(start,end) );
-    return;
+}
+
+// the bitmap is larger than the span of the members, so there is a gap
+// after _last before the bits wrap around to _first
+seq_num miss_list::next_gap( seq_num s )const {
+  uint32_t mask = bits() - 1;
+  uint32_t i    = s.value() & mask;
+  uint32_t off  = 0;
+  for(;;) {
+    uint32_t b = i & 63;
+    uint64_t w = ~_bits[i>>6] >> b;
+    if( w ) return s + int( off + __builtin_ctzll(w) );
+    off += 64 - b;
+    i    = (i + 64 - b) & mask;
   }
-  if( itr->second+1 == start )  {
-    itr->second = end;
-    return;
-  } else { itr++; }
+}
 
-  if( itr == m_ml.end() ) {
-    m_ml.push_back( std::make_pair(start,end) );
+void miss_list::add( seq_num start, seq_num end ) {
+  if( !_count ) {
+    grow( gap(start,end) + 1 );
+    _first = start;
+    _last  = end;
   } else {
-    if( end+1 == itr->first ) 
-      itr->first = end;
-    else
-      m_ml.insert( itr, std::make_pair(start,end) );
+    seq_num f = start < _first ? start : _first;
+    seq_num l = end   > _last  ? end   : _last;
+    grow( gap(f,l) + 1 );
+    _first = f;
+    _last  = l;
   }
+  set_range( start, gap(start,end) + 1 );
 }
 
 uint32_t miss_list::size()const {
-  uint32_t s = 0;
-  mlist::const_iterator itr = m_ml.begin();
-  while( itr != m_ml.end() ) {
-    s += itr->second - itr->first + 1;
-    ++itr;
-  }
-  return s;
+  return _count;
 }
+
 bool miss_list::pop_front( seq_num& seq ) {
-  if( !m_ml.size() ) 
+  if( !_count )
     return false;
-  seq = m_ml.front().first;
-  if( m_ml.front().first == m_ml.front().second )
-    m_ml.pop_front();
-  else
-    ++m_ml.front().first;
+  seq = _first;
+  remove( seq );
   return true;
 }
 
 void miss_list::remove( seq_num seq ) {
-  mlist::iterator itr = m_ml.begin();
-  while( itr != m_ml.end() ) {
-    if( itr->first <= seq && seq <= itr->second ) { 
-      if( itr->first == seq && itr->second == seq ) {
-        m_ml.erase(itr);
-      } else if( itr->first == seq ) {
-        itr->first++;
-        return;
-      } else if( itr->second == seq ) {
-        itr->second--;
-        return;
-      } else if( itr->first < seq && seq < itr->second  ) {
-        m_ml.insert( itr, std::make_pair( itr->first, seq-1 ) );
-        itr->first = seq+1;
-      }
-      return;
-    } 
-    if( itr->first > seq )
-      return;
-    ++itr;
-  }
+  if( !contains(seq) ) return;
+  uint32_t i = seq.value() & (bits() - 1);
+  _bits[i>>6] &= ~(1ull << (i & 63));
+  if( !--_count ) return;
+  if( seq == _first )     _first = next_member( seq + 1 );
+  else if( seq == _last ) _last  = prev_member( seq - 1 );
 }
 
 bool miss_list::contains( seq_num seq )const {
-  mlist::const_iterator itr = m_ml.begin();
-  while( itr != m_ml.end() ) {
-    if( itr->first <= seq && itr->second >= seq ) { 
-      return true;
+  return _count && _first <= seq && seq <= _last && test(seq);
+}
+
+bool miss_list::find_range( seq_num from, seq_num& start, seq_num& end )const {
+  if( !_count ) return false;
+  if( from < _first ) from = _first;
+  if( from > _last )  return false;
+  start = next_member( from );
+  end   = next_gap( start ) - 1;
+  return true;
+}
+
+void miss_list::print()const {
+  seq_num s, e, from = _first;
+  while( find_range( from, s, e ) ) {
+    std::cerr<<"["<<std::string(s)<<", "<<std::string(e)<<"]";
+    if( e == _last ) break;
+    from = e + 1;
+  }
+}
+
+uint32_t miss_list::pack_sack( char* out, uint32_t budget, bool seq32 )const {
+  uint32_t hdr = sack_header(seq32);
+  if( !_count || budget < hdr + 2 ) return 0;
+
+  // runs
+  uint32_t pos  = hdr;
+  bool     more = false;
+  seq_num  last = _first, s, e, from = _first;
+  while( find_range( from, s, e ) ) {
+    char     tmp[10];
+    uint32_t l = 0;
+    if( s != _first ) l += put_varint( tmp, gap(last,s) - 1 );
+    l += put_varint( tmp + l, gap(s,e) + 1 );
+    if( pos + l > budget ) { more = true; break; }
+    memcpy( out + pos, tmp, l );
+    pos += l;
+    last = e;
+    if( e == _last ) break;
+    from = e + 1;
+  }
+  uint8_t mode = sack_runs;
+
+  // the bitmap if it is shorter or describes more
+  uint32_t total = gap(_first,_last) + 1;
+  uint32_t nbits = (std::min)( total, (budget - hdr) * 8 );
+  if( more ? nbits - 1 > gap(_first,last) : hdr + (total + 7) / 8 < pos ) {
+    mode = sack_bitmap;
+    more = nbits < total;
+    last = _first + int(nbits - 1);
+    pos  = hdr + (nbits + 7) / 8;
+    memset( out + hdr, 0, pos - hdr );
+    unsigned char* b = (unsigned char*)out + hdr;
+    from = _first;
+    while( find_range( from, s, e ) ) {
+      uint32_t a = gap(_first,s);
+      if( a >= nbits ) break;
+      uint32_t z = (std::min)( gap(_first,e), nbits - 1 );
+      for( uint32_t j = a; j <= z; ++j )
+        b[j/8] |= 1 << (j%8);
+      if( e == _last ) break;
+      from = e + 1;
     }
-    ++itr;
   }
-  return false;
+
+  out[0] = char( mode | (more ? sack_more : 0) );
+  put_seq( out + 1, _first, seq32 );
+  put_seq( out + 1 + (hdr - 1) / 2, last, seq32 );
+  return pos;
 }
 
-void miss_list::print()const {
-  mlist::const_iterator itr = m_ml.begin();
-  while( itr != m_ml.end() ) {
-    std::cerr<<"["<<std::string(itr->first)<<", "<<std::string(itr->second)<<"]";
-    ++itr;
+bool miss_list::unpack_sack( const char* in, uint32_t len, bool seq32, seq_num ref, seq_num& last, bool& more ) {
+  uint32_t hdr = sack_header(seq32);
+  clear();
+  more = false;
+  if( !len ) return true;
+  if( len < hdr ) return false;
+
+  uint8_t mode = in[0];
+  more  = mode & sack_more;
+  mode &= ~sack_more;
+  seq_num first = get_seq( in + 1, seq32, ref );
+  last = get_seq( in + 1 + (hdr - 1) / 2, seq32, ref );
+  // the peer picks first and last, the bitmap must not grow to whatever
+  // they span
+  if( gap(first,last) >= uint32_t(seq32 ? max_span32 : max_span16) ) {
+    clear();
+    return false;
   }
+  uint32_t total = gap(first,last) + 1;
 
+  if( mode == sack_runs ) {
+    uint32_t pos     = hdr;
+    uint32_t off     = 0;
+    bool     missing = true;
+    while( pos < len ) {
+      uint32_t v;
+      if( !get_varint( in, len, pos, v ) || !v || v > total - off ) return false;
+      if( missing ) add( first + int(off), first + int(off + v - 1) );
+      off    += v;
+      missing = !missing;
+    }
+    return true;
+  }
+  if( mode == sack_bitmap ) {
+    const unsigned char* b = (const unsigned char*)in + hdr;
+    uint32_t nbits = (std::min)( (len - hdr) * 8, total );
+    uint32_t run   = 0;
+    bool     in_run = false;
+    for( uint32_t i = 0; i <= nbits; ++i ) {
+      bool m = i < nbits && ((b[i/8] >> (i%8)) & 1);
+      if( m && !in_run ) {
+        run    = i;
+        in_run = true;
+      } else if( !m && in_run ) {
+        add( first + int(run), first + int(i - 1) );
+        in_run = false;
+      }
+    }
+    return true;
+  }
+  return false;
 }
 
 } // tornet
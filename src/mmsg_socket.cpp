@@ -0,0 +1,246 @@
+#include "mmsg_socket.hpp"
+#include <fc/log.hpp>
+#include <fc/exception.hpp>
+#include <fc/error.hpp>
+
+#ifndef WIN32
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+#include <string.h>
+
+namespace tn {
+
+  batch_stats::batch_stats()
+  :calls(0),packets(0) {
+    memset( hist, 0, sizeof(hist) );
+  }
+
+  void batch_stats::record( uint32_t n ) {
+    ++calls;
+    packets += n;
+    uint32_t b = 0;
+    while( (n >>= 1) && b < hist_buckets-1 ) ++b;
+    ++hist[b];
+  }
+
+#ifndef WIN32
+  // the number of datagrams moved by one recvmmsg/sendmmsg call, larger
+  // requests are split into multiple calls.
+  enum { max_batch = 64 };
+
+  static void to_sockaddr( const fc::ip::endpoint& ep, sockaddr_in& sa ) {
+    memset( &sa, 0, sizeof(sa) );
+    sa.sin_family      = AF_INET;
+    sa.sin_addr.s_addr = htonl( uint32_t(ep.get_address()) );
+    sa.sin_port        = htons( ep.port() );
+  }
+  static fc::ip::endpoint from_sockaddr( const sockaddr_in& sa ) {
+    return fc::ip::endpoint( ntohl(sa.sin_addr.s_addr), ntohs(sa.sin_port) );
+  }
+
+  mmsg_socket::mmsg_socket():_fd(-1){}
+  mmsg_socket::~mmsg_socket() { close(); }
+
+  void mmsg_socket::open( bool reuse_port ) {
+    close();
+    _fd = ::socket( AF_INET, SOCK_DGRAM, 0 );
+    if( _fd < 0 )
+      FC_THROW_MSG( "Unable to open UDP socket: %s", strerror(errno) );
+    if( reuse_port ) {
+#ifdef SO_REUSEPORT
+      int on = 1;
+      if( ::setsockopt( _fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on) ) != 0 )
+        FC_THROW_MSG( "Unable to set SO_REUSEPORT: %s", strerror(errno) );
+#else
+      FC_THROW_MSG( "SO_REUSEPORT is not supported on this platform" );
+#endif
+    }
+  }
+
+  void mmsg_socket::bind( const fc::ip::endpoint& ep ) {
+    sockaddr_in sa;
+    to_sockaddr( ep, sa );
+    if( ::bind( _fd, (sockaddr*)&sa, sizeof(sa) ) != 0 )
+      FC_THROW_MSG( "Unable to bind to %s: %s", fc::string(ep).c_str(), strerror(errno) );
+  }
+
+  void mmsg_socket::close() {
+    if( _fd >= 0 ) {
+      ::shutdown( _fd, SHUT_RDWR );
+      ::close( _fd );
+      _fd = -1;
+    }
+  }
+
+  void mmsg_socket::set_receive_buffer_size( size_t s ) {
+    int v = s;
+    if( ::setsockopt( _fd, SOL_SOCKET, SO_RCVBUF, &v, sizeof(v) ) != 0 )
+      wlog( "Unable to set receive buffer size to %d: %s", v, strerror(errno) );
+  }
+
+  void mmsg_socket::set_send_buffer_size( size_t s ) {
+    int v = s;
+    if( ::setsockopt( _fd, SOL_SOCKET, SO_SNDBUF, &v, sizeof(v) ) != 0 )
+      wlog( "Unable to set send buffer size to %d: %s", v, strerror(errno) );
+  }
+
+  void mmsg_socket::set_receive_timeout( const fc::microseconds& t ) {
+    timeval tv;
+    tv.tv_sec  = t.count() / 1000000;
+    tv.tv_usec = t.count() % 1000000;
+    if( ::setsockopt( _fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv) ) != 0 )
+      wlog( "Unable to set receive timeout: %s", strerror(errno) );
+  }
+
+  void mmsg_socket::set_dont_fragment( bool df ) {
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+    int v = df ? IP_PMTUDISC_PROBE : IP_PMTUDISC_DONT;
+    if( ::setsockopt( _fd, IPPROTO_IP, IP_MTU_DISCOVER, &v, sizeof(v) ) != 0 )
+      wlog( "Unable to set IP_MTU_DISCOVER: %s", strerror(errno) );
+#elif defined(IP_DONTFRAG)
+    int v = df;
+    if( ::setsockopt( _fd, IPPROTO_IP, IP_DONTFRAG, &v, sizeof(v) ) != 0 )
+      wlog( "Unable to set IP_DONTFRAG: %s", strerror(errno) );
+#else
+    if( df ) wlog( "Unable to set the don't fragment bit on this platform" );
+#endif
+  }
+
+  uint16_t mmsg_socket::local_port()const {
+    sockaddr_in sa;
+    socklen_t   sl = sizeof(sa);
+    if( ::getsockname( _fd, (sockaddr*)&sa, &sl ) != 0 ) return 0;
+    return ntohs( sa.sin_port );
+  }
+
+  uint32_t mmsg_socket::receive_batch( std::vector<tn::buffer>& bufs, std::vector<fc::ip::endpoint>& from ) {
+    uint32_t    want = (std::min)( size_t(max_batch), bufs.size() );
+    sockaddr_in addrs[max_batch];
+    int         got  = 0;
+    if( from.size() < want ) from.resize(want);
+
+#ifdef __linux__
+    mmsghdr     hdrs[max_batch];
+    iovec       iovs[max_batch];
+    memset( hdrs, 0, sizeof(mmsghdr)*want );
+    for( uint32_t i = 0; i < want; ++i ) {
+      iovs[i].iov_base               = bufs[i].data();
+      iovs[i].iov_len                = bufs[i].size();
+      hdrs[i].msg_hdr.msg_iov        = &iovs[i];
+      hdrs[i].msg_hdr.msg_iovlen     = 1;
+      hdrs[i].msg_hdr.msg_name       = &addrs[i];
+      hdrs[i].msg_hdr.msg_namelen    = sizeof(addrs[i]);
+    }
+    // block for the first datagram, then take whatever else is already queued
+    got = ::recvmmsg( _fd, hdrs, want, MSG_WAITFORONE, 0 );
+    if( got < 0 ) {
+      if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+        FC_THROW_MSG( "recvmmsg failed: %s", strerror(errno) );
+      return 0;
+    }
+    for( int i = 0; i < got; ++i ) {
+      bufs[i].resize( hdrs[i].msg_len );
+      from[i] = from_sockaddr( addrs[i] );
+    }
+#else
+    for( uint32_t i = 0; i < want; ++i ) {
+      socklen_t sl = sizeof(addrs[i]);
+      ssize_t   s  = ::recvfrom( _fd, bufs[i].data(), bufs[i].size(), i ? MSG_DONTWAIT : 0,
+                                 (sockaddr*)&addrs[i], &sl );
+      if( s < 0 ) {
+        if( i == 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+          FC_THROW_MSG( "recvfrom failed: %s", strerror(errno) );
+        break;
+      }
+      bufs[i].resize( s );
+      from[i] = from_sockaddr( addrs[i] );
+      ++got;
+    }
+#endif
+    if( got ) _recv_stats.record( got );
+    return got;
+  }
+
+  uint32_t mmsg_socket::send_batch( const tn::buffer* bufs, const fc::ip::endpoint* to, uint32_t n ) {
+    uint32_t sent = 0;
+    while( sent < n ) {
+      uint32_t    cnt = (std::min)( uint32_t(max_batch), n - sent );
+      sockaddr_in addrs[max_batch];
+      for( uint32_t i = 0; i < cnt; ++i )
+        to_sockaddr( to[sent+i], addrs[i] );
+
+#ifdef __linux__
+      mmsghdr hdrs[max_batch];
+      iovec   iovs[max_batch];
+      memset( hdrs, 0, sizeof(mmsghdr)*cnt );
+      for( uint32_t i = 0; i < cnt; ++i ) {
+        iovs[i].iov_base            = (void*)bufs[sent+i].data();
+        iovs[i].iov_len             = bufs[sent+i].size();
+        hdrs[i].msg_hdr.msg_iov     = &iovs[i];
+        hdrs[i].msg_hdr.msg_iovlen  = 1;
+        hdrs[i].msg_hdr.msg_name    = &addrs[i];
+        hdrs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+      }
+      int r = ::sendmmsg( _fd, hdrs, cnt, 0 );
+      if( r < 0 ) {
+        if( errno == EINTR ) continue;
+        // drop the datagram at the head of the batch, UDP makes no promises
+        wlog( "sendmmsg failed: %s", strerror(errno) );
+        r = 1;
+      } else if( r == 0 ) {
+        // nothing sent and no error set, drop the head rather than spin
+        wlog( "sendmmsg sent nothing" );
+        r = 1;
+      } else {
+        _send_stats.record( r );
+      }
+      sent += r;
+#else
+      for( uint32_t i = 0; i < cnt; ++i ) {
+        if( ::sendto( _fd, bufs[sent+i].data(), bufs[sent+i].size(), 0,
+                      (sockaddr*)&addrs[i], sizeof(addrs[i]) ) < 0 )
+          wlog( "sendto failed: %s", strerror(errno) );
+      }
+      _send_stats.record( cnt );
+      sent += cnt;
+#endif
+    }
+    return sent;
+  }
+
+  uint32_t mmsg_socket::send_to( const char* d, uint32_t l, const fc::ip::endpoint& to ) {
+    sockaddr_in sa;
+    to_sockaddr( to, sa );
+    ssize_t s = ::sendto( _fd, d, l, 0, (sockaddr*)&sa, sizeof(sa) );
+    if( s < 0 ) {
+      wlog( "sendto failed: %s", strerror(errno) );
+      return 0;
+    }
+    _send_stats.record( 1 );
+    return s;
+  }
+
+#else // WIN32
+
+  mmsg_socket::mmsg_socket():_fd(-1){}
+  mmsg_socket::~mmsg_socket(){}
+  void     mmsg_socket::open( bool ) { FC_THROW_MSG( "Batched socket I/O is not supported on this platform" ); }
+  void     mmsg_socket::bind( const fc::ip::endpoint& ) {}
+  void     mmsg_socket::close() {}
+  void     mmsg_socket::set_receive_buffer_size( size_t ) {}
+  void     mmsg_socket::set_send_buffer_size( size_t ) {}
+  void     mmsg_socket::set_receive_timeout( const fc::microseconds& ) {}
+  void     mmsg_socket::set_dont_fragment( bool ) {}
+  uint16_t mmsg_socket::local_port()const { return 0; }
+  uint32_t mmsg_socket::receive_batch( std::vector<tn::buffer>&, std::vector<fc::ip::endpoint>& ) { return 0; }
+  uint32_t mmsg_socket::send_batch( const tn::buffer*, const fc::ip::endpoint*, uint32_t ) { return 0; }
+  uint32_t mmsg_socket::send_to( const char*, uint32_t, const fc::ip::endpoint& ) { return 0; }
+
+#endif
+
+} // namespace tn
@@ -0,0 +1,98 @@
+#ifndef _TORNET_MMSG_SOCKET_HPP_
+#define _TORNET_MMSG_SOCKET_HPP_
+#include <tornet/buffer.hpp>
+#include <fc/ip.hpp>
+#include <fc/time.hpp>
+#include <vector>
+
+namespace tn {
+
+  /**
+   *  Counts how many datagrams each recv/send call moved.  Bucket i of
+   *  the histogram counts calls that moved [2^i, 2^(i+1)) datagrams, the
+   *  last bucket collects everything larger.
+   */
+  struct batch_stats {
+    enum { hist_buckets = 8 };
+    batch_stats();
+
+    void record( uint32_t n );
+
+    uint64_t calls;
+    uint64_t packets;
+    uint64_t hist[hist_buckets];
+  };
+
+  /**
+   *  Thin wrapper around a native UDP socket that moves datagrams in batches
+   *  using recvmmsg/sendmmsg where the platform provides them and falls back to
+   *  one recvfrom/sendto per datagram elsewhere.
+   *
+   *  Unlike fc::udp_socket, calls block the calling OS thread, therefore
+   *  receive_batch() should only be called from a thread dedicated to reading.
+   *  Each direction keeps its own stats and must only be driven by one thread.
+   */
+  class mmsg_socket {
+    public:
+      mmsg_socket();
+      ~mmsg_socket();
+
+      /**
+       *  @param reuse_port - set SO_REUSEPORT so several sockets can share one port
+       */
+      void     open( bool reuse_port = false );
+      void     bind( const fc::ip::endpoint& ep );
+      void     close();
+      bool     is_open()const { return _fd >= 0; }
+
+      void     set_receive_buffer_size( size_t s );
+      void     set_send_buffer_size( size_t s );
+
+      /**
+       *  receive_batch() returns 0 after waiting this long without receiving
+       *  anything so that the reading thread can check whether it should quit.
+       */
+      void     set_receive_timeout( const fc::microseconds& t );
+
+      /**
+       *  Sets the don't fragment bit on outgoing datagrams and ignores the
+       *  kernel's path MTU cache, so datagrams larger than the path are lost
+       *  instead of fragmented.  Used to probe the path MTU.
+       */
+      void     set_dont_fragment( bool df );
+
+      uint16_t local_port()const;
+
+      /**
+       *  Waits for at least one datagram, then reads as many as are queued up to
+       *  bufs.size().  Each filled buffer is resized to the datagram length
+       *  and from[i] is set to its sender.
+       *
+       *  @return the number of datagrams read, 0 on timeout
+       */
+      uint32_t receive_batch( std::vector<tn::buffer>& bufs, std::vector<fc::ip::endpoint>& from );
+
+      /**
+       *  Sends n datagrams, bufs[i] to to[i].  Datagrams the kernel refuses are
+       *  dropped, just as if they had been lost on the wire.
+       *
+       *  @return the number of datagrams handed to the kernel
+       */
+      uint32_t send_batch( const tn::buffer* bufs, const fc::ip::endpoint* to, uint32_t n );
+      uint32_t send_to( const char* d, uint32_t l, const fc::ip::endpoint& to );
+
+      const batch_stats& recv_stats()const { return _recv_stats; }
+      const batch_stats& send_stats()const { return _send_stats; }
+
+    private:
+      mmsg_socket( const mmsg_socket& );
+      mmsg_socket& operator=( const mmsg_socket& );
+
+      int          _fd;
+      batch_stats  _recv_stats;
+      batch_stats  _send_stats;
+  };
+
+} // namespace tn
+
+#endif // _TORNET_MMSG_SOCKET_HPP_
@@ -0,0 +1,75 @@
+#ifndef _TORNET_MPSC_QUEUE_HPP_
+#define _TORNET_MPSC_QUEUE_HPP_
+#include <atomic>
+
+namespace tn {
+
+  /**
+   *  Queue that any number of threads push into without locking and one
+   *  consumer empties all at once.
+   *
+   *  Producers push onto a lock free stack.  The consumer swaps the whole
+   *  stack out and reverses it, so items come out in the order each producer
+   *  pushed them.
+   */
+  template<typename T>
+  class mpsc_queue {
+    public:
+      struct node {
+        node( const T& v ):next(0),value(v){}
+        node* next;
+        T     value;
+      };
+
+      mpsc_queue():_head(0){}
+      ~mpsc_queue() { free( take_all() ); }
+
+      /**
+       *  @return true if the queue was empty, the caller should then make
+       *          sure the consumer runs.
+       */
+      bool push( const T& v ) {
+        node* n = new node(v);
+        node* h = _head.load( std::memory_order_relaxed );
+        do {
+          n->next = h;
+        } while( !_head.compare_exchange_weak( h, n, std::memory_order_release, std::memory_order_relaxed ) );
+        return !h;
+      }
+
+      /**
+       *  Removes everything pushed so far.
+       *
+       *  @return the oldest item, linked to newer ones through next.  The
+       *          caller owns the list, see free().
+       */
+      node* take_all() {
+        node* h = _head.exchange( 0, std::memory_order_acquire );
+        node* r = 0;
+        while( h ) {
+          node* n = h->next;
+          h->next = r;
+          r = h;
+          h = n;
+        }
+        return r;
+      }
+
+      static void free( node* n ) {
+        while( n ) {
+          node* next = n->next;
+          delete n;
+          n = next;
+        }
+      }
+
+    private:
+      mpsc_queue( const mpsc_queue& );
+      mpsc_queue& operator=( const mpsc_queue& );
+
+      std::atomic<node*> _head;
+  };
+
+} // namespace tn
+
+#endif // _TORNET_MPSC_QUEUE_HPP_
@@ -4,11 +4,39 @@
 #include <fc/bigint.hpp>
 #include <fc/error.hpp>
 #include <fc/fstream.hpp>
+#include <fc/datastream.hpp>
+#include <string.h>
 
 namespace tn {
 
   typedef detail::node_private node_private;
 
+  node::config::config()
+  :io_batch_size(0),io_shards(1),decrypt_threads(0),pipeline_depth(64),sched_quantum(2048),
+   inbound_queue_size(256),inbound_drop_policy(drop_data_first),
+   idle_timeout_sec(120),connection_pool_size(256),unverified_cons_per_sec(32),
+   hibernate_after_sec(600),kbucket_slots(20),cipher_suites(0x03),
+   bundle_delay_us(0),bundle_size(1200),base_mtu(1232),max_mtu(1472),pmtu_raise_sec(600),dh_pool_size(16),crypto_threads(2),key_cache_size(1024),
+   handshake_version(2),ed25519_identity(false),udt_congestion(udt_daimd),
+   udt_rx_budget_mb(256){}
+
+  uint32_t node::config::rx_buffer_size()const {
+    return (std::min)( (std::max)( max_mtu, uint32_t(tn::buffer::default_size) ), uint32_t(tn::buffer::max_size) );
+  }
+
+  node::connection_stats::connection_stats()
+  :weight(0),packets(0),bytes(0),service_us(0),max_service_us(0),rounds(0),dropped(0),mtu(0){}
+
+  node::stats::stats()
+  :recv_calls(0),recv_packets(0),send_calls(0),send_packets(0),buffer_heap_allocs(0),
+   pipeline_drops(0),pipeline_decrypted(0),pipeline_decrypt_failures(0),inbound_drops(0),
+   connections(0),free_connections(0),recycled_connections(0),reused_connections(0),cookies_verified(0),cookies_rejected(0),
+   hibernated_connections(0),rehydrated_connections(0),migrated_connections(0),replayed_packets(0),bundles_sent(0),bundled_messages(0),mtu_probes(0),dh_pool_hits(0),dh_pool_misses(0),crypto_jobs(0),key_cache_hits(0),x25519_exchanges(0),rank(0),rank_hashes(0),rank_hash_rate(0) {
+    memset( recv_batch_hist, 0, sizeof(recv_batch_hist) );
+    memset( send_batch_hist, 0, sizeof(send_batch_hist) );
+    memset( handshake_hist, 0, sizeof(handshake_hist) );
+  }
+
   node::node( ) {
     my = new node::impl( *this );
   }
@@ -21,6 +49,7 @@ namespace tn {
   }
 
   fc::thread&          node::get_thread()const { return my->_thread; }
+  const node::config& node::get_config()const { return my->_cfg;    }
   const node::id_type& node::get_id()const     { return my->_id;     }
 
   fc::path             node::datadir()const    { return my->_datadir; }
@@ -31,21 +60,30 @@ namespace tn {
     }
     // TODO ... 
    
-    auto itr = my->_ep_to_con.begin();
-    while( itr != my->_ep_to_con.end() ) {
-      itr->second->close();
-      ++itr;
+    for( uint32_t i = 0; i < my->_shards.size(); ++i ) {
+      node::impl::con_shard& s = *my->_shards[i];
+      my->on_shard( s, [&]() {
+        auto itr = s.ep_to_con.begin();
+        while( itr != s.ep_to_con.end() ) {
+          itr->second->close();
+          ++itr;
+        }
+        s.ep_to_con.clear();
+        s.free_cons.clear();
+      } );
     }
-    my->_ep_to_con.clear();
+    boost::unique_lock<boost::mutex> lock(my->_moved_mutex);
+    my->_moved_eps.clear();
   }
 
 
-  void node::init( const fc::path& datadir, uint16_t port ) {
+  void node::init( const fc::path& datadir, uint16_t port, const config& cfg ) {
     if( !my->_thread.is_current() ) {
-       my->_thread.async( [&,this](){ init( datadir, port ); } ).wait();
+       my->_thread.async( [&,this](){ init( datadir, port, cfg ); } ).wait();
        return;
     }
 
+    my->_cfg     = cfg;
     my->_datadir = datadir;
     fc::path kf = datadir/"identity";
     if( !fc::exists( datadir ) ) {
@@ -54,26 +92,43 @@ namespace tn {
     }
     if( !fc::exists(kf) ) {
       slog( "Creating new node identity: %s", kf.string().c_str() );
-      fc::ofstream os( kf.string().c_str(), std::ios::out | std::ios::binary );
       fc::generate_keys( my->_pub_key,my->_priv_key );
-      os << my->_pub_key << my->_priv_key;
-      os.write( (char*)my->_nonce, sizeof(my->_nonce) );
-      os.write( (char*)my->_nonce_search, sizeof(my->_nonce_search) );
+      my->save_identity();
     } else {
       fc::ifstream ink;
       ink.open( kf.string().c_str(), std::ios::in | std::ios::binary );
       ink >> my->_pub_key >> my->_priv_key;
       ink.read( (char*)my->_nonce, sizeof(my->_nonce) );
       ink.read( (char*)my->_nonce_search, sizeof(my->_nonce_search) );
-
-      fc::sha1::encoder  rank_sha;
-      rank_sha.write( (char*)my->_nonce, sizeof(my->_nonce) );
-      rank_sha << my->_pub_key;
-      fc::sha1 r = rank_sha.result();
-      my->_rank = 161 - fc::bigint( r.data(), sizeof(r) ).log2();
+      my->_rank = my->calc_rank( my->_nonce );
     }
 
-    my->_id = fc::sha1::hash(my->_pub_key); 
+    if( cfg.ed25519_identity ) {
+      if( !ecc_available() ) 
+        FC_THROW_MSG( "ed25519_identity requires OpenSSL 1.1.1 or newer" );
+      // the RSA nonce means nothing for the Ed25519 key, start over
+      my->_nonce[0] = my->_nonce[1] = 0;
+      my->_nonce_search[0] = my->_nonce_search[1] = 0;
+      fc::path ek = datadir/"identity.ed25519";
+      if( !fc::exists(ek) ) {
+        slog( "Creating new Ed25519 node identity: %s", ek.string().c_str() );
+        my->_ed_key.reset( new ed25519_key() );
+        my->save_identity();
+      } else {
+        unsigned char seed[ed25519_key::seed_size];
+        fc::ifstream ink;
+        ink.open( ek.string().c_str(), std::ios::in | std::ios::binary );
+        ink.read( (char*)seed, sizeof(seed) );
+        ink.read( (char*)my->_nonce, sizeof(my->_nonce) );
+        ink.read( (char*)my->_nonce_search, sizeof(my->_nonce_search) );
+        my->_ed_key.reset( new ed25519_key( seed ) );
+        memset( seed, 0, sizeof(seed) );
+      }
+      my->_rank = my->calc_rank( my->_nonce );
+      my->_id   = fc::sha1::hash( (const char*)my->_ed_key->pub(), ed25519_key::key_size );
+    } else {
+      my->_id = fc::sha1::hash(my->_pub_key); 
+    }
     my->_kbuckets.set_id(my->_id);
 
     // load peers
@@ -83,7 +138,10 @@ namespace tn {
     my->_publish_db = new db::publish( datadir/"publish_db" );
     my->_publish_db->init();
 
+    my->_dh_pool.reset( new dh_pool( cfg.dh_pool_size ) );
+    my->_crypto.reset( new crypto_pool( cfg.crypto_threads ) );
     my->listen(port);
+    my->schedule_reaper();
   }
 
   fc::vector<fc::sha1> node::get_kbucket( int l, int max ) {
@@ -99,25 +157,36 @@ namespace tn {
     return vec;
   }
 
+  /**
+   *  Runs on the thread of the shard that owns ep, the NAT endpoint may be 
+   *  owned by another one.
+   */
   fc::sha1 node::connect_to( const endpoint& ep, const endpoint& nat_ep ) {
-    if( !my->_thread.is_current() ) {
-       return my->_thread.async( [&,this](){ return connect_to( ep, nat_ep ); } ).wait();
+    node::impl::con_shard& s = my->owner_of(ep);
+    if( !s.thread->is_current() ) {
+       return s.thread->async( [&,this](){ return connect_to( ep, nat_ep ); } ).wait();
     }
     elog( "connect to %s via %s", fc::string(ep).c_str(), fc::string(nat_ep).c_str() );
 
-    ep_to_con_map::iterator ep_con = my->_ep_to_con.find(ep);
-    if( ep_con != my->_ep_to_con.end() ) { return ep_con->second->get_remote_id(); }
-
-    ep_to_con_map::iterator nat_con = my->_ep_to_con.find(nat_ep);
-    if( nat_con == my->_ep_to_con.end() || nat_con->second->get_state() != connection::connected ) { 
+    ep_to_con_map::iterator ep_con = s.ep_to_con.find(ep);
+    if( ep_con != s.ep_to_con.end() ) { return ep_con->second->get_remote_id(); }
+
+    node::impl::con_shard& ns = my->owner_of(nat_ep);
+    connection::ptr nat_con = my->on_shard( ns, [&]() -> connection::ptr {
+      ep_to_con_map::iterator itr = ns.ep_to_con.find(nat_ep);
+      if( itr == ns.ep_to_con.end() || itr->second->get_state() != connection::connected ) 
+        return connection::ptr();
+      return itr->second;
+    } );
+    if( !nat_con ) { 
       FC_THROW_MSG( "No active connection to NAT endpoint %s", nat_ep );
     }
 
-    connection::ptr con(new connection( *this, ep, my->_peers ));
-    my->_ep_to_con[ep] = con;
+    connection::ptr con = my->new_connection( s, ep );
+    s.ep_to_con[ep] = con;
     con->send_punch();
 
-    nat_con->second->request_reverse_connect(ep);
+    my->on_shard( ns, [&]() { nat_con->request_reverse_connect(ep); } );
 
     // wait for the reverse connection...
     while ( true ) { // keep waiting for the state to change
@@ -142,16 +211,17 @@ namespace tn {
 
 
   node::id_type node::connect_to( const node::endpoint& ep ) {
-    if( !my->_thread.is_current() ) {
-       return my->_thread.async( [&,this](){ return connect_to( ep ); } ).wait();
+    node::impl::con_shard& s = my->owner_of(ep);
+    if( !s.thread->is_current() ) {
+       return s.thread->async( [&,this](){ return connect_to( ep ); } ).wait();
     }
 
-    ep_to_con_map::iterator itr = my->_ep_to_con.find(ep);
+    ep_to_con_map::iterator itr = s.ep_to_con.find(ep);
     connection::ptr con;
-    if( itr == my->_ep_to_con.end() ) {
-      connection::ptr c(new connection( *this, ep, my->_peers ));
-      my->_ep_to_con[ep] = c;
-      itr = my->_ep_to_con.find(ep);
+    if( itr == s.ep_to_con.end() ) {
+      connection::ptr c = my->new_connection( s, ep );
+      s.ep_to_con[ep] = c;
+      itr = s.ep_to_con.find(ep);
     }
     con = itr->second;
     while ( true ) { // keep waiting for the state to change
@@ -179,11 +249,13 @@ namespace tn {
     if( !my->_thread.is_current() ) {
       return my->_thread.async( [&,this](){ return open_channel( nid, remote_chan_num ); } ).wait();
     }
-    connection* c = my->get_connection(nid);
+    connection::ptr c = my->get_connection(nid);
+    return my->on_shard( my->shard(*c), [&]() {
       //channel ch( itr->second->shared_from_this(),  remote_chan_num, get_new_channel_num() ); 
-    channel ch( c,  remote_chan_num, c->get_free_channel_num() ); 
-    c->add_channel(ch);
-    return ch;
+      channel ch( c.get(),  remote_chan_num, c->get_free_channel_num() ); 
+      c->add_channel(ch);
+      return ch;
+    } );
   } 
 
 
@@ -194,9 +266,10 @@ namespace tn {
    *
    *  Nodes are stored by their 'distance' from this node in the _dist_to_con map.  
    *
-   *  How do I determine which nodes to 'keep in memory' and which ones to 'flush to disk'?  
+   *  Which nodes are kept in memory and which ones are flushed to disk:
    *    - Keep all connections in memory that have a slot in the kbucket.
-   *    - Save connections to DB that have been idle for 30 minutes
+   *    - Connections idle for config::hibernate_after_sec are left in the
+   *      peer DB and freed, see node::impl::reap_idle_connections()
    *    - Free nodes from DB upon user request??
    */
   fc::vector<host> node::find_nodes_near( const id_type& target, uint32_t n, const fc::optional<id_type>& limit ) {
@@ -239,24 +312,105 @@ namespace tn {
 
 
   fc::ip::endpoint node::local_endpoint( const fc::ip::endpoint& dst )const {
+    if( !my->_thread.is_current() ) {
+      return my->_thread.async( [=](){ return local_endpoint( dst ); } ).wait();
+    }
     auto ep = dst;
     if( dst == fc::ip::endpoint() ) {
       ep = fc::ip::endpoint( fc::ip::address("74.125.228.40"), 8000 );
     }
     my->_lookup_sock.connect( ep );
     auto lp = my->_lookup_sock.local_endpoint();
-    lp.set_port( my->_sock.local_endpoint().port() );
+    lp.set_port( my->_port );
     return lp;
   }
 
+  /**
+   *  Only batched I/O keeps socket counters, with batching disabled they 
+   *  are all zeros.
+   */
+  node::stats node::get_stats()const {
+    node::stats s;
+    s.buffer_heap_allocs = tn::buffer::heap_allocs();
+    s.inbound_drops      = my->_inbound_drops;
+    for( uint32_t i = 0; i < my->_shards.size(); ++i ) {
+      node::impl::con_shard& cs = *my->_shards[i];
+      my->on_shard( cs, [&]() {
+        s.connections      += cs.ep_to_con.size();
+        s.free_connections += cs.free_cons.size();
+      } );
+    }
+    s.recycled_connections = my->_recycled_cons;
+    s.reused_connections   = my->_reused_cons;
+    s.cookies_verified     = my->_cookies_verified;
+    s.cookies_rejected     = my->_cookies_rejected;
+    s.rank                 = my->_rank;
+    s.rank_hashes          = my->_miner ? my->_miner->hashes()    : 0;
+    s.rank_hash_rate       = my->_miner ? my->_miner->hash_rate() : 0;
+    s.hibernated_connections = my->_hibernated_cons;
+    s.rehydrated_connections = my->_rehydrated_cons;
+    s.migrated_connections   = my->_migrated_cons;
+    s.replayed_packets       = my->_replayed_packets;
+    s.bundles_sent           = my->_bundles_sent;
+    s.bundled_messages       = my->_bundled_msgs;
+    s.mtu_probes             = my->_mtu_probes;
+    s.dh_pool_hits           = my->_dh_pool ? my->_dh_pool->hits()   : 0;
+    s.dh_pool_misses         = my->_dh_pool ? my->_dh_pool->misses() : 0;
+    for( uint32_t i = 0; i < node::stats::handshake_buckets; ++i )
+      s.handshake_hist[i] = my->_handshake_hist[i];
+    s.crypto_jobs            = my->_crypto ? my->_crypto->jobs() : 0;
+    s.key_cache_hits         = my->_key_cache_hits;
+    s.x25519_exchanges       = my->_x25519_exchanges;
+    if( !my->_reader ) 
+      return s;
+
+    const std::vector<io_shard::ptr>& shards = my->_reader->shards();
+    for( uint32_t i = 0; i < shards.size(); ++i ) {
+      const batch_stats& r = shards[i]->sock.recv_stats();
+      const batch_stats& w = shards[i]->sock.send_stats();
+      s.recv_calls   += r.calls;
+      s.recv_packets += r.packets;
+      s.send_calls   += w.calls;
+      s.send_packets += w.packets;
+      for( uint32_t b = 0; b < node::stats::hist_buckets; ++b ) {
+        s.recv_batch_hist[b] += r.hist[b];
+        s.send_batch_hist[b] += w.hist[b];
+      }
+    }
+    s.pipeline_drops            = my->_reader->dropped_packets();
+    s.pipeline_decrypted        = my->_reader->decrypted_packets();
+    s.pipeline_decrypt_failures = my->_reader->decrypt_failures();
+    return s;
+  }
+
+
+  fc::vector<node::connection_stats> node::get_connection_stats()const {
+    if( !my->_thread.is_current() ) {
+      return my->_thread.async( [this](){ return get_connection_stats(); } ).wait();
+    }
+    fc::vector<connection_stats> r;
+    for( uint32_t i = 0; i < my->_shards.size(); ++i ) {
+      node::impl::con_shard& s = *my->_shards[i];
+      my->on_shard( s, [&]() {
+        r.reserve( r.size() + s.ep_to_con.size() );
+        for( auto itr = s.ep_to_con.begin(); itr != s.ep_to_con.end(); ++itr ) {
+          r.push_back( itr->second->get_service_stats() );
+          r.back().ep = itr->first;
+          r.back().id = itr->second->get_remote_id();
+          r.back().mtu = itr->second->get_mtu();
+        }
+      } );
+    }
+    return r;
+  }
 
   fc::vector<host> node::remote_nodes_near( const id_type& rnode, const id_type& target, uint32_t n, 
                                           const fc::optional<id_type>& limit  ) {
     if( !my->_thread.is_current() ) {
       return my->_thread.async( [&,this](){ return remote_nodes_near( rnode, target, n, limit ); } ).wait();
     }
-    connection* con = my->get_connection( rnode ); 
-    return con->find_nodes_near( target, n, limit );
+    connection::ptr con = my->get_connection( rnode ); 
+    return my->on_shard( my->shard(*con), [&]() { return con->find_nodes_near( target, n, limit ); } );
   }
 
   void node::start_service( uint16_t cn, const fc::string& name, const node::new_channel_handler& cb ) {
@@ -277,6 +431,53 @@ namespace tn {
     // TODO
   }
 
+  fc::future<node::id_type> node::connect_to_async( const endpoint& ep ) {
+    return my->_thread.async( [=](){ return connect_to( ep ); }, "connect_to" );
+  }
+  fc::future<node::id_type> node::connect_to_async( const endpoint& ep, const endpoint& nat_ep ) {
+    return my->_thread.async( [=](){ return connect_to( ep, nat_ep ); }, "connect_to" );
+  }
+  fc::future<channel> node::open_channel_async( const fc::sha1& nid, uint16_t remote_chan_num ) {
+    return my->_thread.async( [=](){ return open_channel( nid, remote_chan_num ); }, "open_channel" );
+  }
+  fc::future<fc::vector<host> > node::find_nodes_near_async( const id_type& target, uint32_t n, const fc::optional<id_type>& limit ) {
+    return my->_thread.async( [=](){ return find_nodes_near( target, n, limit ); }, "find_nodes_near" );
+  }
+  fc::future<fc::vector<host> > node::remote_nodes_near_async( const id_type& rnode, const id_type& target, uint32_t n, 
+                                                               const fc::optional<id_type>& limit ) {
+    return my->_thread.async( [=](){ return remote_nodes_near( rnode, target, n, limit ); }, "remote_nodes_near" );
+  }
+  fc::future<fc::vector<fc::sha1> > node::get_kbucket_async( int l, int max ) {
+    return my->_thread.async( [=](){ return get_kbucket( l, max ); }, "get_kbucket" );
+  }
+  fc::future<fc::vector<db::peer::record> > node::active_peers_async()const {
+    return my->_thread.async( [=](){ return active_peers(); }, "active_peers" );
+  }
+  fc::future<void> node::start_service_async( uint16_t cn, const fc::string& name, const node::new_channel_handler& cb ) {
+    return my->_thread.async( [=](){ start_service( cn, name, cb ); }, "start_service" );
+  }
+
+  fc::future<void> node::run_batch( const std::vector<operation>& ops ) {
+    return my->_thread.async( [=]() {
+      std::vector<fc::future<void> > pending;
+      pending.reserve( ops.size() );
+      for( uint32_t i = 0; i < ops.size(); ++i )
+        pending.push_back( fc::async( ops[i], "run_batch" ) );
+
+      bool              failed = false;
+      fc::exception_ptr first_error;
+      for( uint32_t i = 0; i < pending.size(); ++i ) {
+        try {
+          pending[i].wait();
+        } catch ( ... ) {
+          if( !failed ) first_error = fc::current_exception();
+          failed = true;
+        }
+      }
+      if( failed ) fc::rethrow_exception( first_error );
+    }, "run_batch" );
+  }
+
   /**
    *  Unlike accessing the peer database, this only returns currently
    *  connected peers and includes data not yet saved in the peer db.
@@ -286,14 +487,25 @@ namespace tn {
       return my->_thread.async( [this](){ return active_peers(); } ).wait();
     }
     fc::vector<db::peer::record> recs(my->_dist_to_con.size());
+    // each shard copies the records of its own connections
+    typedef std::vector<std::pair<uint32_t,connection::ptr> > con_list;
+    std::vector<con_list> by_shard( my->_shards.size() );
     auto itr = my->_dist_to_con.begin();
     auto end = my->_dist_to_con.end();
     int i = 0;
     while( itr != end ) {
-      recs[i] = itr->second->get_db_record();
+      by_shard[ itr->second->get_shard() ].push_back( std::make_pair( i, itr->second ) );
       ++i;
       ++itr;
     }
+    for( uint32_t s = 0; s < by_shard.size(); ++s ) {
+      const con_list& cons = by_shard[s];
+      if( cons.empty() ) continue;
+      my->on_shard( *my->_shards[s], [&]() {
+        for( uint32_t c = 0; c < cons.size(); ++c )
+          recs[cons[c].first] = cons[c].second->get_db_record();
+      } );
+    }
     return recs;
   }
 
@@ -303,18 +515,30 @@ namespace tn {
   }
 
   /**
-   *  Starts a thread looking for nonce's that result in a higher node rank.
+   *  Starts threads looking for nonce's that result in a higher node rank.
+   *  Calling it again changes the effort, an effort of 0 stops the search.
+   *
+   *  Improved nonces are written to the identity file and sent to every
+   *  connected peer with an update_rank message.
    *
-   *  @param effort - the percent of a thread to apply to this effort.
+   *  @param effort - the fraction of the machine's CPU to apply to this effort.
    */
   void node::start_rank_search( double effort ) {
-    /*
-    my->rank_search_effort = effort;
-    if( !my->rank_search_thread ) {
-      my->rank_search_thread = boost::cmt::thread::create("rank");
-      my->rank_search_thread->async( boost::bind( &node_private::rank_search, my ) );
+    if( !my->_thread.is_current() ) {
+      my->_thread.async( [=](){ start_rank_search( effort ); } ).wait();
+      return;
+    }
+    if( !my->_miner ) {
+      std::vector<char> pk = my->identity_key();
+
+      node::impl* self = my;
+      my->_miner.reset( new rank_miner( pk, my->_nonce_search, rank_miner::leading_zeros( my->_nonce, &pk.front(), pk.size() ),
+        [self]( const uint64_t* n ) {
+          uint64_t n0 = n[0], n1 = n[1];
+          self->_thread.async( [=](){ self->on_rank_nonce( n0, n1 ); }, "on_rank_nonce" );
+        } ) );
     }
-    */
+    my->_miner->start( effort );
   }
 
 /*
@@ -338,38 +562,39 @@ namespace tn {
 
   /**
    *  The connection is responsible for updating the node index that maps ids to active connections.
+   *  The index belongs to the node thread, connections on other threads post the update.
    */
   void                     node::update_dist_index( const id_type& nid, connection* c ) {
+    if( !my->_thread.is_current() ) {
+      connection::ptr cp;
+      if( c ) cp = connection::ptr( c, true );
+      my->_thread.async( [=](){ update_dist_index( nid, cp.get() ); }, "update_dist_index" );
+      return;
+    }
     //elog( "%s %p", fc::string(nid).c_str(), c );
     auto dist = nid ^ my->_id;
     auto itr = my->_dist_to_con.find(dist);
     if( c ) {
         if( itr == my->_dist_to_con.end() ) {
           my->_kbuckets.add(c);
-          my->_dist_to_con[dist] = c; // add it
+          my->_dist_to_con[dist] = connection::ptr( c, true ); // add it
         } else {
-          if( itr->second != c ) {
-              itr->second->close();
+          if( itr->second.get() != c ) {
+              connection::ptr old = itr->second;
+              old->get_thread().async( [=](){ old->close(); }, "close" );
               wlog( "Already have a connection to node %1%, closing it", nid );
-              itr->second = c;
+              my->_kbuckets.remove(old.get());
+              my->_kbuckets.add(c);
+              itr->second = connection::ptr( c, true );
           }
         }
     } else {  // clear the connection
         if( itr != my->_dist_to_con.end() ) {
-          auto ep = itr->second->get_endpoint();
-          my->_kbuckets.remove(itr->second);
+          my->_kbuckets.remove(itr->second.get());
           my->_dist_to_con.erase(itr);
 
-          /*  Keep one connection around for the endpoint, we will
-           *  just recylce it instead of 'removing it'. 
-           *
-          node::ptr me(this,true); 
-          fc::async( [me,ep]() { 
-           auto epitr = me->my->_ep_to_con.find( ep );
-           if( epitr != me->my->_ep_to_con.end() ) { 
-             me->my->_ep_to_con.erase(epitr); 
-           }
-          } ); */ 
+          // The connection stays in its shard's ep_to_con in case the endpoint
+          // comes back, reap_idle_connections() recycles it once it goes idle.
         }
     }
   }
@@ -383,6 +608,9 @@ namespace tn {
    *  @param lcn - local channel number
    */
   channel                  node::create_channel( connection* c, uint16_t rcn, uint16_t lcn ) {
+    if( !my->_thread.is_current() ) {
+      return my->_thread.async( [=](){ return create_channel( c, rcn, lcn ); }, "create_channel" ).wait();
+    }
     auto itr = my->_services.find( lcn );
     auto e = my->_services.end();
     if( itr == e ) 
@@ -392,8 +620,38 @@ namespace tn {
     return nc;
   }
   void                     node::send( const char* d, uint32_t l, const fc::ip::endpoint& e ) {
+    if( my->batched_io() ) {
+      my->queue_send( tn::buffer( d, l ), e );
+      return;
+    }
     my->_sock.send_to( d, l, e );
   }
+  void                     node::send( const tn::buffer& b, const fc::ip::endpoint& e ) {
+    if( my->batched_io() ) {
+      my->queue_send( b, e );
+      return;
+    }
+    my->_sock.send_to( b.data(), b.size(), e );
+  }
+
+  /**
+   *  Called by connections whenever their receive key changes.  sealed is
+   *  the connection's receive packet_cipher once one has been negotiated, the
+   *  decrypt stage makes its own copy.
+   *
+   *  @return the generation the decrypt stage will tag plaintext with, 
+   *          never 0.
+   */
+  uint32_t                 node::publish_rx_key( const fc::ip::endpoint& ep, const char* key, float priority,
+                                                 const packet_cipher* sealed, uint64_t cid ) {
+    uint32_t gen = ++my->_next_rx_gen;
+    if( !gen ) gen = ++my->_next_rx_gen;
+    if( my->_reader ) my->_reader->set_rx_key( ep, key, gen, priority, sealed, cid );
+    return gen;
+  }
+  void                     node::retract_rx_key( const fc::ip::endpoint& ep ) {
+    if( my && my->_reader ) my->_reader->clear_rx_key( ep );
+  }
 
   fc::signature_t          node::sign( const fc::sha1& h ) {
     fc::signature_t s;
@@ -414,11 +672,20 @@ namespace tn {
   }
 
   void node::add_client( const fc::sha1& id, const fc::shared_ptr<service_client>& c ) {
-    return my->get_connection(id)->add_client(c);
+    if( !my->_thread.is_current() ) {
+      my->_thread.async( [&,this](){ add_client( id, c ); } ).wait();
+      return;
+    }
+    connection::ptr con = my->get_connection(id);
+    my->on_shard( my->shard(*con), [&]() { con->add_client(c); } );
   }
     
   fc::shared_ptr<service_client> node::get_client( const fc::sha1& id, const fc::string& name ) {
-    return my->get_connection(id)->get_client(name);
+    if( !my->_thread.is_current() ) {
+      return my->_thread.async( [&,this](){ return get_client( id, name ); } ).wait();
+    }
+    connection::ptr con = my->get_connection(id);
+    return my->on_shard( my->shard(*con), [&]() { return con->get_client(name); } );
   }
 
 } // namespace tornet
@@ -4,11 +4,30 @@
 #include <fc/thread.hpp>
 #include <fc/udp_socket.hpp>
 #include <fc/error.hpp>
+#include <fc/sha1.hpp>
+#include <fc/fstream.hpp>
+#include <fc/bigint.hpp>
+#include <fc/datastream.hpp>
 #include <tornet/db/peer.hpp>
 #include <tornet/db/publish.hpp>
 #include <tornet/connection.hpp>
 #include <tornet/kbucket.hpp>
+#include "read_thread.hpp"
+#include "endpoint_table.hpp"
+#include "rank_miner.hpp"
+#include "ecc.hpp"
+#include "dh_pool.hpp"
+#include "crypto_pool.hpp"
+#include "cookie_jar.hpp"
 #include <boost/unordered_map.hpp>
+#include <openssl/rand.h>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/mutex.hpp>
+#include <atomic>
+#include <deque>
+#include <set>
 
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/member.hpp>
@@ -16,18 +35,9 @@
 #include <boost/multi_index/ordered_index.hpp>
 #include <boost/multi_index/hashed_index.hpp>
 
-namespace fc { namespace ip {
-inline std::size_t hash_value( const fc::ip::endpoint& ep ) {
-  std::size_t seed = 0;
-  boost::hash_combine( seed, uint32_t(ep.get_address()) );
-  boost::hash_combine( seed, ep.port() );
-  return seed;
-}
-} }  
-
 namespace tn {
   using namespace boost::multi_index;
-  typedef boost::unordered_map<fc::ip::endpoint,connection::ptr>  ep_to_con_map;    
+  typedef endpoint_table<connection::ptr>  ep_to_con_map;    
 
   struct service {
     struct by_name{};
@@ -58,16 +68,57 @@ namespace tn {
         _rank = 0;
         _nonce[0] = _nonce[1] = 0;
         _lookup_sock.connect( fc::ip::endpoint( fc::ip::address("74.125.228.40"), 8000 ) );
-        _processing = false;
+        _shards.push_back( con_shard::ptr( new con_shard( 0, _thread ) ) );
+        _inbound_drops = 0;
+        _recycled_cons = 0;
+        _reused_cons = 0;
+        _cookies_verified = 0;
+        _cookies_rejected = 0;
+        _unverified_tokens = 0;
+        _hibernated_cons = 0;
+        _rehydrated_cons = 0;
+        _migrated_cons = 0;
+        _replayed_packets = 0;
+        _bundles_sent = 0;
+        _bundled_msgs = 0;
+        _mtu_probes   = 0;
+        for( uint32_t i = 0; i < node::stats::handshake_buckets; ++i )
+          _handshake_hist[i] = 0;
+        _key_cache_hits = 0;
+        _x25519_exchanges = 0;
         _next_chan_num = 1000;
+        _port = 0;
+        _next_rx_gen = 0;
       }
       ~impl() {
         slog( "start quit" );
+        _done = true;
         _sock.close();
         if(_read_loop_complete.valid() ) 
           _read_loop_complete.wait();
+        if( _reader ) {
+          _reader->quit();
+          _reader.reset();
+        }
+        if( _reaper.valid() ) 
+          _reaper.cancel();
+        for( uint32_t i = 0; i < _shards.size(); ++i ) {
+          if( !_shards[i]->own_thread ) continue;
+          // connections cancel their timers, which belong to the shard's thread
+          con_shard* s = _shards[i].get();
+          s->thread->async( [=]() { s->clear(); } ).wait();
+          s->own_thread->quit();
+        }
+        _dh_pool.reset();
+        _crypto.reset();
+        if( _miner ) {
+          _miner->stop();
+          _miner->progress( _nonce_search );
+          _miner.reset();
+          save_identity();
+        }
         _thread.quit();
-        slog( "done quit %d", _ep_to_con.size() );
+        slog( "done quit" );
       }
 
       node&                           _self;
@@ -78,36 +129,543 @@ namespace tn {
       uint64_t                        _nonce_search[2];
       fc::private_key_t               _priv_key;
       fc::public_key_t                _pub_key;
+      /// set when node::config::ed25519_identity replaces the RSA identity
+      boost::scoped_ptr<ed25519_key>  _ed_key;
       service_set                     _services;
       fc::udp_socket                  _sock;
       fc::udp_socket                  _lookup_sock;
       fc::future<void>                _read_loop_complete;
-      ep_to_con_map                   _ep_to_con;
       bool                            _done;
       fc::path                        _datadir;
-      std::map<fc::sha1,connection*>  _dist_to_con;
+      /// keeps its connections alive until the node thread drops them, see unindex()
+      std::map<fc::sha1,connection::ptr>  _dist_to_con;
       kbucket                         _kbuckets;
       uint16_t                        _next_chan_num;
+      uint16_t                        _port;
+      node::config                    _cfg;
+
+      /**
+       *  When io_batch_size > 1 the fc::udp_socket is replaced by the io_shards
+       *  of a read_thread.  Outbound datagrams queue up on the socket of the 
+       *  sending shard until its current task yields or a full batch is ready.
+       */
+      boost::scoped_ptr<read_thread>  _reader;
+      std::atomic<uint32_t>           _next_rx_gen;
+
+      /**
+       *  The connections whose endpoints hash to one shard, see shard_of().
+       *  Everything here belongs to the shard's thread: the connections and
+       *  their state machines, channels and timers, the process queue and the
+       *  send queue of the io_shard with the same index.
+       *
+       *  With batched I/O and more than one io shard every shard runs a thread
+       *  of its own and the read_thread delivers each datagram to the shard of
+       *  its endpoint.  Otherwise the only shard runs on the node thread.
+       *
+       *  The node thread keeps what is shared by all connections: the id
+       *  index, kbuckets, services and the rank miner.  Connections reach it
+       *  by message, update_dist_index() is posted and find_nodes_near() and
+       *  create_channel() wait for their result.  The node thread in turn 
+       *  posts work for a connection to the connection's thread, see 
+       *  on_shard().
+       */
+      struct con_shard {
+        typedef boost::shared_ptr<con_shard> ptr;
+        con_shard( uint32_t i, fc::thread& t )
+        :id(i),thread(&t),processing(false),send_flush_scheduled(false){}
+
+        void clear() {
+          process_queue.clear();
+          free_cons.clear();
+          ep_to_con.clear();
+        }
+
+        uint32_t                        id;
+        fc::thread*                     thread;
+        boost::scoped_ptr<fc::thread>   own_thread;
+        ep_to_con_map                   ep_to_con;
+        std::deque<connection::ptr>     process_queue;
+        bool                            processing;
+        std::vector<connection::ptr>    free_cons;
+        bool                            send_flush_scheduled;
+
+        /// stripe cid % shards of the connection id table, any thread may use it
+        boost::mutex                                cid_mutex;
+        boost::unordered_map<uint64_t,connection*>  cid_to_con;
+      };
+      std::vector<con_shard::ptr>     _shards;
+
+      /**
+       *  Endpoints filed in another shard than the one they hash to, because
+       *  their connection migrated there, by the id of that shard.
+       */
+      boost::mutex                                        _moved_mutex;
+      boost::unordered_map<fc::ip::endpoint,uint32_t>     _moved_eps;
+
+      /// with batched I/O every io shard gets a con_shard with its own thread
+      void start_shards() {
+        uint32_t n = (std::max)( _cfg.io_shards, uint32_t(1) );
+        if( !batched_io() || n == 1 ) return;
+        _shards.clear();
+        for( uint32_t i = 0; i < n; ++i ) {
+          fc::thread* t = new fc::thread( ("node::con" + boost::lexical_cast<std::string>(i)).c_str() );
+          con_shard::ptr s( new con_shard( i, *t ) );
+          s->own_thread.reset( t );
+          _shards.push_back(s);
+        }
+      }
+
+      /// the shard whose thread is running, 0 for any other thread
+      con_shard* current_shard() {
+        for( uint32_t i = 0; i < _shards.size(); ++i ) 
+          if( _shards[i]->thread->is_current() ) 
+            return _shards[i].get();
+        return 0;
+      }
+
+      /// the shard ep hashes to, read_thread delivers ep's datagrams there
+      con_shard& shard_of( const fc::ip::endpoint& ep ) {
+        return *_shards[ fc::ip::hash_value(ep) % _shards.size() ];
+      }
+
+      /// the shard ep's connection is filed in, see move_connection()
+      con_shard& owner_of( const fc::ip::endpoint& ep ) {
+        if( _shards.size() > 1 ) {
+          boost::unique_lock<boost::mutex> lock(_moved_mutex);
+          auto itr = _moved_eps.find(ep);
+          if( itr != _moved_eps.end() ) 
+            return *_shards[itr->second];
+        }
+        return shard_of(ep);
+      }
+
+      con_shard& shard( const connection& c ) { return *_shards[ c.get_shard() ]; }
+
+      /// a connection belongs to the shard whose thread creates it, see new_connection()
+      uint32_t creating_shard( const fc::ip::endpoint& ep ) {
+        con_shard* s = current_shard();
+        return s ? s->id : shard_of(ep).id;
+      }
+
+      /// runs f on the thread of s and waits for its result
+      template<typename Functor>
+      auto on_shard( con_shard& s, Functor&& f ) -> decltype(f()) {
+        if( s.thread->is_current() ) 
+          return f();
+        return s.thread->async( std::forward<Functor>(f), "on_shard" ).wait();
+      }
+
+      /// drops a move of ep to s once s no longer files a connection under it
+      void forget_endpoint( con_shard& s, const fc::ip::endpoint& ep ) {
+        if( &shard_of(ep) == &s ) return;
+        boost::unique_lock<boost::mutex> lock(_moved_mutex);
+        auto itr = _moved_eps.find(ep);
+        if( itr != _moved_eps.end() && itr->second == s.id ) 
+          _moved_eps.erase(itr);
+      }
+
+      bool      batched_io()const { return _cfg.io_batch_size > 1; }
 
       uint16_t get_new_channel_num() { return ++_next_chan_num; }
 
+      boost::scoped_ptr<rank_miner>   _miner;
+      boost::scoped_ptr<dh_pool>      _dh_pool;
+      std::atomic<uint64_t>           _handshake_hist[node::stats::handshake_buckets];
+
+      boost::scoped_ptr<crypto_pool>  _crypto;
+
+      /**
+       *  What is known about a peer whose auth message carried a valid
+       *  signature, by node id, which is the hash of its key.
+       */
+      struct verified_key {
+        uint64_t                                nonce[2];
+        uint8_t                                 rank;
+        /// decoded once, fc decodes RSA keys on every verify
+        boost::shared_ptr<ed25519_public_key>   ed_key;
+        /// hash of the digest and signature of the last auth message that
+        /// verified, a retransmission of it is not checked again
+        fc::sha1                                last_auth;
+      };
+      boost::mutex                                _key_cache_mutex;
+      std::map<fc::sha1,verified_key>             _key_cache;
+      std::atomic<uint64_t>                       _key_cache_hits;
+      std::atomic<uint64_t>                       _x25519_exchanges;
+
+      /// shared by the connections of every shard
+      bool cached_key( const fc::sha1& id, verified_key& vk ) {
+        boost::unique_lock<boost::mutex> lock(_key_cache_mutex);
+        auto itr = _key_cache.find(id);
+        if( itr == _key_cache.end() ) 
+          return false;
+        ++_key_cache_hits;
+        vk = itr->second;
+        return true;
+      }
+      void cache_key( const fc::sha1& id, const verified_key& vk ) {
+        if( !_cfg.key_cache_size ) return;
+        boost::unique_lock<boost::mutex> lock(_key_cache_mutex);
+        if( _key_cache.size() >= _cfg.key_cache_size && !_key_cache.count(id) ) 
+          _key_cache.erase( _key_cache.begin() );
+        _key_cache[id] = vk;
+      }
+
+      void record_handshake( const fc::microseconds& t ) {
+        uint64_t ms = t.count() / 1000;
+        uint32_t b  = 0;
+        while( ms > 1 && b + 1 < node::stats::handshake_buckets ) { ms >>= 1; ++b; }
+        ++_handshake_hist[b];
+      }
+
+      /// the serialized public key our id and rank are hashed from
+      std::vector<char> identity_key()const {
+        if( _ed_key ) 
+          return std::vector<char>( (const char*)_ed_key->pub(), (const char*)_ed_key->pub() + ed25519_key::key_size );
+        std::vector<char> pk(256);
+        fc::datastream<char*> ds( &pk.front(), pk.size() );
+        ds << _pub_key;
+        return pk;
+      }
+
+      void save_identity() {
+        if( _ed_key ) {
+          unsigned char seed[ed25519_key::seed_size];
+          _ed_key->get_seed( seed );
+          fc::ofstream os( (_datadir/"identity.ed25519").string().c_str(), std::ios::out | std::ios::binary );
+          os.write( (char*)seed, sizeof(seed) );
+          memset( seed, 0, sizeof(seed) );
+          os.write( (char*)_nonce, sizeof(_nonce) );
+          os.write( (char*)_nonce_search, sizeof(_nonce_search) );
+          return;
+        }
+        fc::ofstream os( (_datadir/"identity").string().c_str(), std::ios::out | std::ios::binary );
+        os << _pub_key << _priv_key;
+        os.write( (char*)_nonce, sizeof(_nonce) );
+        os.write( (char*)_nonce_search, sizeof(_nonce_search) );
+      }
+
+      uint32_t calc_rank( const uint64_t* nonce )const {
+        std::vector<char>  pk = identity_key();
+        fc::sha1::encoder  rank_sha;
+        rank_sha.write( (char*)nonce, 2*sizeof(uint64_t) );
+        rank_sha.write( &pk.front(), pk.size() );
+        fc::sha1 r = rank_sha.result();
+        return 161 - fc::bigint( r.data(), sizeof(r) ).log2();
+      }
+
       /**
-       *  Store connections that have messages queue that need
-       *  processed.  This vector is a sorted 'priority heap' sorted
-       *  by the nodes service priority.  
+       *  Called on the node thread for every nonce the miner reports.  Better
+       *  nonces are saved to the identity file right away and announced to
+       *  every connected peer.
        */
-      std::vector<connection*>        _process_queue;
-      bool                            _processing;
-      static bool pq_comparer( connection* l, connection* r ) { return l->priority() > r->priority(); }
+      void on_rank_nonce( uint64_t n0, uint64_t n1 ) {
+        uint64_t nonce[2] = { n0, n1 };
+        uint32_t r = calc_rank( nonce );
+        if( r <= _rank ) return;
+
+        slog( "Rank improved from %d to %d", _rank, r );
+        _rank     = r;
+        _nonce[0] = n0;
+        _nonce[1] = n1;
+        _miner->progress( _nonce_search );
+        save_identity();
+
+        for( auto itr = _dist_to_con.begin(); itr != _dist_to_con.end(); ++itr ) {
+          connection::ptr c = itr->second;
+          c->get_thread().async( [=]() {
+            if( c->get_state() == connection::connected )
+              c->send_update_rank();
+          }, "send_update_rank" );
+        }
+      }
+
+      std::atomic<uint64_t>           _inbound_drops;
 
       db::peer::ptr    _peers;
       db::publish::ptr _publish_db;
 
+      /**
+       *  Connections that never finished a handshake, or were reset, stay in
+       *  their shard's ep_to_con until they have been idle for idle_timeout_sec.
+       *  They are then removed and the shards keep up to connection_pool_size
+       *  of them between them on their free_cons, to be reinitialized for new
+       *  endpoints instead of allocating.
+       */
+      fc::future<void>                _reaper;
+      std::atomic<uint64_t>           _recycled_cons;
+      std::atomic<uint64_t>           _reused_cons;
+
+      /**
+       *  Connected peers are hibernated once they have been idle for 
+       *  hibernate_after_sec, have no open channels and do not hold one of the
+       *  kbucket_slots best slots of their kbucket.  Their record, including the
+       *  blowfish key, is already kept up to date in the peer db, so the object
+       *  can simply be recycled.  The next packet from the endpoint, or the next
+       *  get_connection() for the peer, creates a connection that finds the 
+       *  record and resumes in the connected state without a new key exchange.
+       */
+      std::atomic<uint64_t>           _hibernated_cons;
+      std::atomic<uint64_t>           _rehydrated_cons;
+      boost::mutex                    _hibernated_mutex;
+      std::set<fc::sha1>              _hibernated_ids;
+
+      /**
+       *  Connections by the id their peer puts in front of sealed packets, so
+       *  that a peer whose NAT picked a new port finds its connection again.
+       *  The table is striped over the shards by cid, see con_shard::cid_to_con.
+       *  See connection::migrate().
+       */
+      std::atomic<uint64_t>           _migrated_cons;
+
+      con_shard& cid_stripe( uint64_t cid ) { return *_shards[ cid % _shards.size() ]; }
+
+      /// @return cid if it is free, otherwise a new random id
+      uint64_t register_cid( connection* c, uint64_t cid ) {
+        while( true ) {
+          if( cid ) {
+            con_shard& s = cid_stripe(cid);
+            boost::unique_lock<boost::mutex> lock(s.cid_mutex);
+            if( !s.cid_to_con.count(cid) ) {
+              s.cid_to_con[cid] = c;
+              return cid;
+            }
+          }
+          if( RAND_bytes( (unsigned char*)&cid, sizeof(cid) ) != 1 ) 
+            FC_THROW_MSG( "Unable to create connection id" );
+        }
+      }
+      void unregister_cid( connection* c, uint64_t cid ) {
+        con_shard& s = cid_stripe(cid);
+        boost::unique_lock<boost::mutex> lock(s.cid_mutex);
+        auto itr = s.cid_to_con.find(cid);
+        if( itr != s.cid_to_con.end() && itr->second == c ) 
+          s.cid_to_con.erase(itr);
+      }
+
+      /**
+       *  Removes the connection id from the front of p if it names one of our
+       *  connections, the decrypt stage may have done so already.  The 
+       *  connection may belong to any shard.
+       */
+      connection::ptr strip_cid( inbound_packet& p ) {
+        uint64_t cid = p.cid;
+        if( !cid ) {
+          if( p.raw.size() < 16 || p.raw.size() % 8 ) 
+            return connection::ptr();
+          memcpy( &cid, p.raw.data(), sizeof(cid) );
+        }
+        con_shard& s = cid_stripe(cid);
+        boost::unique_lock<boost::mutex> lock(s.cid_mutex);
+        auto itr = s.cid_to_con.find(cid);
+        if( itr == s.cid_to_con.end() ) 
+          return connection::ptr();
+        if( !p.cid ) {
+          p.cid = cid;
+          p.raw = p.raw.subbuf( sizeof(cid) );
+        }
+        return connection::ptr( itr->second, true );
+      }
+
+      /// removes the connection filed under ep in s unless it is keep
+      void drop_endpoint( con_shard& s, const fc::ip::endpoint& ep, const connection* keep ) {
+        auto itr = s.ep_to_con.find(ep);
+        if( itr == s.ep_to_con.end() || itr->second.get() == keep ) 
+          return;
+        connection::ptr stale = itr->second;
+        s.ep_to_con.erase(itr);
+        forget_endpoint( s, ep );
+        stale->recycle();
+      }
+
+      /**
+       *  Files c under its peer's new endpoint, on c's thread.  Whatever 
+       *  connection held that endpoint belonged to a mapping the NAT has since
+       *  reused, its own shard drops it.  c stays on its shard, if to hashes to
+       *  another one the datagrams from to are passed on, see handle_packet().
+       */
+      void move_connection( const connection::ptr& c, const fc::ip::endpoint& from, const fc::ip::endpoint& to ) {
+        con_shard& s   = shard(*c);
+        con_shard& old = owner_of(to);
+        if( &old == &s ) {
+          drop_endpoint( s, to, c.get() );
+        } else {
+          con_shard*        o    = &old;
+          const connection* keep = c.get();
+          o->thread->async( [=]() { drop_endpoint( *o, to, keep ); }, "move_connection" );
+        }
+        auto itr = s.ep_to_con.find(from);
+        if( itr != s.ep_to_con.end() && itr->second == c ) {
+          s.ep_to_con.erase(itr);
+          forget_endpoint( s, from );
+        }
+        s.ep_to_con[to] = c;
+        if( &shard_of(to) != &s ) {
+          boost::unique_lock<boost::mutex> lock(_moved_mutex);
+          _moved_eps[to] = s.id;
+        }
+        ++_migrated_cons;
+      }
+
+      /// counted by connections, see connection::dispatch_sealed()
+      std::atomic<uint64_t>           _replayed_packets;
+      /// counted by connections, see connection::flush_bundle()
+      std::atomic<uint64_t>           _bundles_sent;
+      std::atomic<uint64_t>           _bundled_msgs;
+      std::atomic<uint64_t>           _mtu_probes;
+
+      /**
+       *  Endpoints without a connection are admitted on their first packet
+       *  while a token bucket of unverified_cons_per_sec allows it, after that
+       *  only by echoing the cookie we answer their packet with.
+       */
+      cookie_jar                      _cookies;
+      boost::mutex                    _unverified_mutex;
+      double                          _unverified_tokens;
+      fc::time_point                  _unverified_refill;
+      std::atomic<uint64_t>           _cookies_verified;
+      std::atomic<uint64_t>           _cookies_rejected;
+
+      bool take_unverified_token() {
+        boost::unique_lock<boost::mutex> lock(_unverified_mutex);
+        fc::time_point now  = fc::time_point::now();
+        double         rate = _cfg.unverified_cons_per_sec;
+        _unverified_tokens  = (std::min)( rate, _unverified_tokens + 
+                                  rate * (now - _unverified_refill).count() / 1000000.0 );
+        _unverified_refill  = now;
+        if( _unverified_tokens < 1 ) return false;
+        _unverified_tokens -= 1;
+        return true;
+      }
+
+      enum admission { refuse, admit_packet, admit_endpoint };
+
+      /**
+       *  Decides what a datagram from an endpoint without a connection may do.
+       *  Cookie challenges from unknown endpoints are never answered so two 
+       *  nodes can not be made to bounce them between each other, and a
+       *  challenge is only sent in reply to a datagram at least as large.
+       */
+      admission admit( const inbound_packet& p ) {
+        if( cookie_jar::is_echo( p.raw ) ) {
+          if( _cookies.verify( p.ep, p.raw ) ) {
+            ++_cookies_verified;
+            return admit_endpoint;
+          }
+          ++_cookies_rejected;
+          return refuse;
+        }
+        if( cookie_jar::is_challenge( p.raw ) ) 
+          return refuse;
+        if( take_unverified_token() ) 
+          return admit_packet;
+        if( p.raw.size() >= cookie_jar::cookie_size ) 
+          _self.send( _cookies.make( p.ep ), p.ep );
+        return refuse;
+      }
+
+      /// a connection belongs to the shard that creates it, see connection::get_shard()
+      connection::ptr new_connection( con_shard& s, const fc::ip::endpoint& ep ) {
+        if( s.free_cons.size() ) {
+          connection::ptr c = s.free_cons.back();
+          s.free_cons.pop_back();
+          c->reinit( ep );
+          ++_reused_cons;
+          return c;
+        }
+        return connection::ptr( new connection( _self, ep, _peers ) );
+      }
+
+      /// the free connections each shard may keep, connection_pool_size between them
+      uint32_t pool_limit()const {
+        return (_cfg.connection_pool_size + _shards.size() - 1) / _shards.size();
+      }
+
+      void schedule_reaper() {
+        uint32_t period = (std::min)( _cfg.idle_timeout_sec     ? _cfg.idle_timeout_sec     : uint32_t(-1),
+                                      _cfg.hibernate_after_sec  ? _cfg.hibernate_after_sec  : uint32_t(-1) );
+        if( _done || period == uint32_t(-1) ) return;
+        _reaper = _thread.schedule( [=](){ reap_idle_connections(); }, 
+                                    fc::time_point::now() + fc::milliseconds( 1000ll * period / 2 ), 
+                                    "reap_idle_connections" );
+      }
+
+      bool should_hibernate( connection& c, const fc::time_point& cutoff, const std::set<const connection*>& slotted ) {
+        return _cfg.hibernate_after_sec && c.get_state() == connection::connected &&
+               c.last_activity() < cutoff && !c.channel_count() && !slotted.count( &c );
+      }
+
+      /**
+       *  The kbuckets belong to the node thread, so it collects the connections
+       *  that hold one of the kbucket_slots best slots of their kbucket and has
+       *  every shard reap its own connections.
+       */
+      void reap_idle_connections() {
+        boost::shared_ptr<std::set<const connection*> > slotted( new std::set<const connection*>() );
+        if( _cfg.hibernate_after_sec ) {
+          for( auto itr = _dist_to_con.begin(); itr != _dist_to_con.end(); ++itr ) 
+            if( _kbuckets.holds_slot( itr->second.get(), _cfg.kbucket_slots ) ) 
+              slotted->insert( itr->second.get() );
+        }
+        for( uint32_t i = 0; i < _shards.size(); ++i ) {
+          con_shard* s = _shards[i].get();
+          if( s->thread->is_current() ) 
+            reap_idle_connections( *s, *slotted );
+          else
+            s->thread->async( [=](){ reap_idle_connections( *s, *slotted ); }, "reap_idle_connections" );
+        }
+        schedule_reaper();
+      }
+
+      void reap_idle_connections( con_shard& s, const std::set<const connection*>& slotted ) {
+        fc::time_point now           = fc::time_point::now();
+        fc::time_point idle_cutoff   = now - fc::milliseconds( 1000ll * _cfg.idle_timeout_sec );
+        fc::time_point hibern_cutoff = now - fc::milliseconds( 1000ll * _cfg.hibernate_after_sec );
+
+        std::vector<fc::ip::endpoint> idle;
+        for( auto itr = s.ep_to_con.begin(); itr != s.ep_to_con.end(); ++itr ) {
+          connection& c = *itr->second;
+          if( c.pending_packets() || c.get_sched_state().active ) 
+            continue;
+          if( should_hibernate( c, hibern_cutoff, slotted ) ) {
+            ++_hibernated_cons;
+            boost::unique_lock<boost::mutex> lock(_hibernated_mutex);
+            _hibernated_ids.insert( c.get_remote_id() );
+            idle.push_back( itr->first );
+          } else if( _cfg.idle_timeout_sec && c.get_state() != connection::connected && 
+                     c.last_activity() < idle_cutoff ) {
+            idle.push_back( itr->first );
+          }
+        }
+        for( uint32_t i = 0; i < idle.size(); ++i ) {
+          auto itr = s.ep_to_con.find( idle[i] );
+          if( itr == s.ep_to_con.end() ) continue;
+          connection::ptr c = itr->second;
+          s.ep_to_con.erase( itr );
+          forget_endpoint( s, idle[i] );
+          c->recycle();
+          if( s.free_cons.size() < pool_limit() ) 
+            s.free_cons.push_back(c);
+          ++_recycled_cons;
+        }
+        if( idle.size() ) 
+          slog( "recycled %d idle connections, %d remain", idle.size(), s.ep_to_con.size() );
+      }
+
       void listen( uint16_t p ) {
-         slog( "Listening on port %d", p );
+        if( batched_io() ) {
+          start_shards();
+          std::vector<fc::thread*> owners;
+          for( uint32_t i = 0; i < _shards.size(); ++i ) 
+            owners.push_back( _shards[i]->thread );
+          _reader.reset( new read_thread( owners, _cfg, [=]( uint32_t s, inbound_batch& b ) { handle_batch( s, b ); } ) );
+          _port = _reader->listen( p );
+          return;
+        }
+        slog( "Listening on port %d", p );
         _sock.open();
         _sock.set_receive_buffer_size( 3*1024*1024 );
         _sock.bind( fc::ip::endpoint( fc::ip::address(), p ) );
+        _port = _sock.local_endpoint().port();
         _read_loop_complete = _thread.async( [=](){ read_loop(); } );
 
       }
@@ -119,14 +677,16 @@ namespace tn {
              //   fc::yield();
 
              // allocate a new buffer for each packet... we have no idea how long it may be around
-             tn::buffer b;
+             tn::buffer b( _cfg.rx_buffer_size() );
              fc::ip::endpoint from;
              size_t s = _sock.receive_from( b.data(), b.size(), from );
 
              if( s ) {
                 b.resize( s );
                 ++count;
-                handle_packet( fc::move(b), from ); 
+                inbound_packet ip(b);
+                ip.ep = from;
+                handle_packet( *_shards[0], fc::move(ip) ); 
                 fc::yield();
              }
           }
@@ -134,63 +694,206 @@ namespace tn {
         } catch ( ... ) { elog( "%s", fc::current_exception().diagnostic_information().c_str() ); }
       }
 
-      void handle_packet( tn::buffer&& b, const fc::ip::endpoint& ep ) {
-        auto itr = _ep_to_con.find(ep);
-        if( itr == _ep_to_con.end() ) {
+      /// called on the thread of shard s with the datagrams from its endpoints
+      void handle_batch( uint32_t s, inbound_batch& b ) {
+        con_shard& sh = *_shards[s];
+        for( uint32_t i = 0; i < b.size(); ++i )
+          handle_packet( sh, fc::move(b[i]) );
+      }
+
+      /**
+       *  Queues a datagram for the next sendmmsg call on the socket of the 
+       *  calling shard, see con_shard.  The queue is flushed on the shard's
+       *  thread as soon as it holds a full batch, otherwise once the calling
+       *  task yields.  Any other thread hands the datagram to the shard that
+       *  owns ep.
+       */
+      void queue_send( const tn::buffer& b, const fc::ip::endpoint& ep ) {
+        con_shard* s = current_shard();
+        if( !s ) {
+          s = &owner_of(ep);
+          s->thread->async( [=](){ queue_send( b, ep ); }, "queue_send" );
+          return;
+        }
+        io_shard& sh = *_reader->shards()[s->id];
+        sh.send_bufs.push_back(b);
+        sh.send_eps.push_back(ep);
+        if( sh.send_bufs.size() >= _cfg.io_batch_size ) {
+          sh.flush_sends();
+        } else if( !s->send_flush_scheduled ) {
+          s->send_flush_scheduled = true;
+          fc::async( [=](){ flush_sends( *s ); }, "flush_sends" );
+        }
+      }
+
+      /// flushes the send queue of the calling shard
+      void flush_sends() {
+        if( con_shard* s = current_shard() ) 
+          flush_sends( *s );
+      }
+      void flush_sends( con_shard& s ) {
+        s.send_flush_scheduled = false;
+        _reader->shards()[s.id]->flush_sends();
+      }
+
+      /**
+       *  Runs on the thread of s, the shard ep hashes to unless p was passed on
+       *  from there.  Datagrams for a connection of another shard, found by its
+       *  connection id or by the endpoint it migrated to, are passed on to it.
+       */
+      void handle_packet( con_shard& s, inbound_packet&& b ) {
+        const fc::ip::endpoint ep = b.ep;
+        connection::ptr byid = strip_cid( b );
+        if( byid && &shard(*byid) != &s ) {
+          pass_on( shard(*byid), b );
+          return;
+        }
+        if( byid && byid->get_endpoint() != ep ) {
+          // the peer moved, the connection decides whether to follow it
+          if( byid->post_packet(std::move(b)) ) process_connection(byid);
+          else                                  ++_inbound_drops;
+          return;
+        }
+        auto itr = s.ep_to_con.find(ep);
+        if( itr == s.ep_to_con.end() ) {
+          // passed on to a connection that has gone since
+          if( &shard_of(ep) != &s ) {
+            ++_inbound_drops;
+            return;
+          }
+          con_shard& o = owner_of(ep);
+          if( &o != &s ) {
+            pass_on( o, b );
+            return;
+          }
+          admission a = admit( b );
+          if( a == refuse ) return;
           slog( "creating new connection" );
           // failing that, create
-          connection::ptr c( new connection( _self, ep, _peers ) );
-          _ep_to_con[ep] = c;
+          connection::ptr c = new_connection( s, ep );
+          s.ep_to_con[ep] = c;
+          // the peer resends whatever we answered with the cookie
+          if( a == admit_endpoint ) return;
           c->post_packet(std::move(b));
-          process_connection(c.get());
-        } else { 
-          itr->second->post_packet(std::move(b)); 
-          process_connection(itr->second.get());
+          process_connection(c);
+        } else if( itr->second->post_packet(std::move(b)) ) { 
+          process_connection(itr->second);
+        } else {
+          ++_inbound_drops;
         }
       }
-      void process_connection( connection* c ) {
-          if( c->pending_packets() > 1 ) return;
-          _process_queue.push_back(c);
-          std::push_heap( _process_queue.begin(), _process_queue.end(), &impl::pq_comparer );
+      void pass_on( con_shard& to, const inbound_packet& p ) {
+        con_shard* t = &to;
+        t->thread->async( [=](){ handle_packet( *t, inbound_packet(p) ); }, "handle_packet" );
+      }
+
+      /// called on c's thread
+      void process_connection( const connection::ptr& c ) {
+          connection::sched_state& st = c->get_sched_state();
+          if( st.active ) return;
+          st.active  = true;
+          st.deficit = 0;
+          con_shard& s = shard(*c);
+          s.process_queue.push_back(c);
 
-          if( !_processing ) {
-            _processing = true;
-            fc::async( [=](){ process_queue(); }, "process_queue" );
+          if( !s.processing ) {
+            s.processing = true;
+            con_shard* sp = &s;
+            fc::async( [=](){ process_queue( *sp ); }, "process_queue" );
           }
       }
 
       /**
-       *  The read_loop fiber is pulling packets off of the network and 
-       *  posting them into their respecitve connections queues.  Each connection
-       *  is then put on a priority queue to be processed by process_queue fiber.
-       *
-       *  The process_queue fiber wants to ensure that all packets have been
-       *  received before processing subsequent packets so that they can get
-       *  processed in the proper order.
+       *  The read_loop fiber, or the read_thread, is pulling packets off of the
+       *  network and posting them into their respecitve connections queues.
+       *  Each connection is then put on the process queue of its shard to be
+       *  processed by that shard's process_queue fiber.
        *
-       *  Because connections are sorted by priority incoming messages will be
-       *  processed in priority order.  
-       */
-      void process_queue() {
-         while( _process_queue.size() ) {
-            _process_queue.front()->process_next_message();
-            if( !_process_queue.front()->pending_packets() ) {
-              std::pop_heap( _process_queue.begin(), _process_queue.end(), &impl::pq_comparer );
-              _process_queue.pop_back();
+       *  Connections are served deficit round robin: each visit adds 
+       *  sched_quantum * sched_weight() bytes to the connection's deficit and it
+       *  may process packets until the next one no longer fits.  A flooding
+       *  peer therefore gets at most its weighted share of its shard's thread
+       *  no matter how many packets it queues, and weights are read on every 
+       *  visit so priority changes take effect on the next round.
+       */
+      void process_queue( con_shard& sh ) {
+         while( sh.process_queue.size() ) {
+            connection::ptr c = sh.process_queue.front();
+            sh.process_queue.pop_front();
+
+            connection::sched_state& s = c->get_sched_state();
+            s.deficit += int64_t(_cfg.sched_quantum) * c->start_sched_round();
+
+            while( c->pending_packets() && c->next_packet_size() <= s.deficit ) {
+              s.deficit -= c->next_packet_size();
+              c->process_next_message();
+              // give the read_loop (or other running tasks a chance to make some
+              // progress before continuing to the next message.
+              fc::yield();
+            }
+            if( c->pending_packets() ) {
+              sh.process_queue.push_back(c);
+            } else {
+              s.active  = false;
+              s.deficit = 0;
             }
-            // give the read_loop (or other running tasks a chance to make some
-            // progress before continuing to the next message.
-            fc::yield();
          }
-         _processing = false;
+         sh.processing = false;
       }
 
 
-      connection* get_connection( const fc::sha1& remote_id )const {
+      /**
+       *  A peer that was hibernated resumes at the endpoint its record was
+       *  last seen at, as it would on its next packet.  Called on the node 
+       *  thread, the connection is created by the shard that owns the endpoint.
+       */
+      connection::ptr get_connection( const fc::sha1& remote_id ) {
          auto itr = _dist_to_con.find( remote_id ^ _id );
          if( itr != _dist_to_con.end() ) return itr->second;
+
+         db::peer::record r;
+         if( _peers->fetch( remote_id, r ) && r.valid() && r.last_ep != fc::ip::endpoint() ) {
+           con_shard& s = owner_of( r.last_ep );
+           connection::ptr c = on_shard( s, [&]() -> connection::ptr {
+             if( s.ep_to_con.find( r.last_ep ) != s.ep_to_con.end() ) 
+               return connection::ptr();
+             connection::ptr nc = new_connection( s, r.last_ep );
+             if( nc->get_state() == connection::connected && nc->get_remote_id() == remote_id ) {
+               s.ep_to_con[r.last_ep] = nc;
+               return nc;
+             }
+             nc->recycle();
+             if( s.free_cons.size() < pool_limit() ) 
+               s.free_cons.push_back(nc);
+             return connection::ptr();
+           } );
+           if( c ) return c;
+         }
          FC_THROW_MSG( "No known connection to %s", remote_id );
-         return nullptr;
+         return connection::ptr();
+      }
+
+      /**
+       *  Drops the index entry for nid if it still refers to c.  Posted by c's
+       *  thread when c is reset or recycled.
+       */
+      void unindex( const fc::sha1& nid, const connection* c ) {
+        if( !_thread.is_current() ) {
+          _thread.async( [=](){ unindex( nid, c ); }, "unindex" );
+          return;
+        }
+        auto itr = _dist_to_con.find( nid ^ _id );
+        if( itr != _dist_to_con.end() && itr->second.get() == c ) {
+          _kbuckets.remove( itr->second.get() );
+          _dist_to_con.erase( itr );
+        }
+      }
+
+      /// counts c as rehydrated if this process hibernated it
+      void resumed_connection( const fc::sha1& remote_id ) {
+        boost::unique_lock<boost::mutex> lock(_hibernated_mutex);
+        if( _hibernated_ids.erase( remote_id ) ) 
+          ++_rehydrated_cons;
       }
   };
 
@@ -0,0 +1,167 @@
+#include "packet_cipher.hpp"
+#include <fc/log.hpp>
+#include <fc/error.hpp>
+#include <fc/exception.hpp>
+#include <fc/time.hpp>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <string.h>
+
+namespace tn {
+
+  static const EVP_CIPHER* evp_cipher( packet_cipher::suite s ) {
+    switch( s ) {
+      case packet_cipher::aes256_gcm:        return EVP_aes_256_gcm();
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(OPENSSL_NO_CHACHA) && !defined(OPENSSL_NO_POLY1305)
+      case packet_cipher::chacha20_poly1305: return EVP_chacha20_poly1305();
+#endif
+      default: return 0;
+    }
+  }
+
+  uint8_t packet_cipher::available() {
+    uint8_t m = 0;
+    if( evp_cipher( aes256_gcm ) )        m |= aes256_gcm;
+    if( evp_cipher( chacha20_poly1305 ) ) m |= chacha20_poly1305;
+    return m;
+  }
+
+  /**
+   *  AES-GCM is preferred because most CPUs implement it in hardware, nodes
+   *  without AES instructions can leave it out of node::config::cipher_suites.
+   */
+  packet_cipher::suite packet_cipher::select( uint8_t local, uint8_t remote ) {
+    uint8_t both = local & remote & available();
+    if( both & aes256_gcm )        return aes256_gcm;
+    if( both & chacha20_poly1305 ) return chacha20_poly1305;
+    return blowfish;
+  }
+
+  packet_cipher::packet_cipher( suite s, const char* shared_key, uint32_t len,
+                                const fc::sha1& from, const fc::sha1& to )
+  :_suite(s),_next_seq( fc::time_point::now().time_since_epoch().count() ),_ctx(0) {
+    static const char label[] = "tornet packet key";
+    unsigned char h[SHA512_DIGEST_LENGTH];
+    uint8_t       sb = s;
+    SHA512_CTX sha;
+    SHA512_Init( &sha );
+    SHA512_Update( &sha, label, sizeof(label) );
+    SHA512_Update( &sha, &sb, 1 );
+    SHA512_Update( &sha, from.data(), sizeof(from) );
+    SHA512_Update( &sha, to.data(), sizeof(to) );
+    SHA512_Update( &sha, shared_key, len );
+    SHA512_Final( h, &sha );
+    memcpy( _key,  h, sizeof(_key) );
+    memcpy( _salt, h + sizeof(_key), sizeof(_salt) );
+    memset( h, 0, sizeof(h) );
+    init_ctx();
+  }
+
+  packet_cipher::packet_cipher( const packet_cipher& c )
+  :_suite(c._suite),_next_seq(c._next_seq),_ctx(0) {
+    memcpy( _key,  c._key,  sizeof(_key) );
+    memcpy( _salt, c._salt, sizeof(_salt) );
+    init_ctx();
+  }
+
+  packet_cipher::~packet_cipher() {
+    memset( _key, 0, sizeof(_key) );
+    if( _ctx ) EVP_CIPHER_CTX_free( _ctx );
+  }
+
+  /**
+   *  The key schedule is computed once, every packet only sets a new nonce.
+   */
+  void packet_cipher::init_ctx() {
+    const EVP_CIPHER* c = evp_cipher( _suite );
+    if( !c ) FC_THROW_MSG( "Unsupported cipher suite %d", int(_suite) );
+    _ctx = EVP_CIPHER_CTX_new();
+    if( !_ctx ||
+        !EVP_CipherInit_ex( _ctx, c, 0, 0, 0, 1 ) ||
+        !EVP_CIPHER_CTX_ctrl( _ctx, EVP_CTRL_AEAD_SET_IVLEN, 12, 0 ) ||
+        !EVP_CipherInit_ex( _ctx, 0, 0, _key, 0, -1 ) ) {
+      FC_THROW_MSG( "Unable to initialize cipher suite %d", int(_suite) );
+    }
+  }
+
+  bool packet_cipher::is_sealed( const tn::buffer& b )const {
+    return b.size() >= header_size + 1 + tag_size && b.size() % 8 == 0 &&
+           uint8_t(b[0]) == sealed_magic && (uint8_t(b[1]) >> 4) == _suite;
+  }
+
+  uint32_t packet_cipher::seal( uint8_t type, const char* msg, uint32_t size, unsigned char* out ) {
+    uint8_t pad = (8 - (header_size + 1 + size + tag_size) % 8) % 8;
+    uint64_t seq = _next_seq++;
+    out[0] = sealed_magic;
+    out[1] = (uint8_t(_suite) << 4) | pad;
+    for( int i = 0; i < 8; ++i )
+      out[2+i] = uint8_t( seq >> (56 - 8*i) );
+
+    unsigned char iv[12];
+    memcpy( iv, _salt, 4 );
+    memcpy( iv+4, out+2, 8 );
+
+    unsigned char* ct  = out + header_size;
+    unsigned char* tag = ct + 1 + size;
+    int l = 0;
+    if( !EVP_EncryptInit_ex( _ctx, 0, 0, 0, iv ) ||
+        !EVP_EncryptUpdate( _ctx, 0, &l, out, header_size ) ||
+        !EVP_EncryptUpdate( _ctx, ct, &l, &type, 1 ) ||
+        (size && !EVP_EncryptUpdate( _ctx, ct+1, &l, (const unsigned char*)msg, size )) ||
+        !EVP_EncryptFinal_ex( _ctx, tag, &l ) ||
+        !EVP_CIPHER_CTX_ctrl( _ctx, EVP_CTRL_AEAD_GET_TAG, tag_size, tag ) ) {
+      FC_THROW_MSG( "Unable to seal packet" );
+    }
+    memset( tag + tag_size, 0, pad );
+    return header_size + 1 + size + tag_size + pad;
+  }
+
+  bool packet_cipher::open( const tn::buffer& b, tn::buffer& plain, uint64_t& seq ) {
+    if( !is_sealed(b) ) return false;
+    uint8_t pad = uint8_t(b[1]) & 0x0f;
+    if( pad > 7 || b.size() < header_size + 1u + tag_size + pad ) return false;
+    uint32_t ct_len = b.size() - header_size - tag_size - pad;
+
+    const unsigned char* in = (const unsigned char*)b.data();
+    unsigned char iv[12];
+    memcpy( iv, _salt, 4 );
+    memcpy( iv+4, in+2, 8 );
+
+    // 3 unused checksum bytes, then the type byte and the message
+    plain = tn::buffer( 3 + ct_len );
+    unsigned char* out = (unsigned char*)plain.data();
+    memset( out, 0, 3 );
+
+    int l = 0;
+    if( !EVP_DecryptInit_ex( _ctx, 0, 0, 0, iv ) ||
+        !EVP_DecryptUpdate( _ctx, 0, &l, in, header_size ) ||
+        !EVP_DecryptUpdate( _ctx, out+3, &l, in + header_size, ct_len ) ||
+        !EVP_CIPHER_CTX_ctrl( _ctx, EVP_CTRL_AEAD_SET_TAG, tag_size, (void*)(in + header_size + ct_len) ) ||
+        EVP_DecryptFinal_ex( _ctx, out+3+ct_len, &l ) <= 0 ) {
+      return false;
+    }
+    if( out[3] >= 32 ) return false;
+    out[3] <<= 3; // msg type in the upper 5 bits, no pad
+
+    seq = 0;
+    for( int i = 0; i < 8; ++i )
+      seq = (seq << 8) | in[2+i];
+    return true;
+  }
+
+  bool replay_window::accept( uint64_t seq ) {
+    if( !seq ) return false;
+    if( seq > _top ) {
+      uint64_t shift = seq - _top;
+      _seen = shift >= 64 ? 0 : _seen << shift;
+      _seen |= 1;
+      _top   = seq;
+      return true;
+    }
+    uint64_t age = _top - seq;
+    if( age >= 64 || (_seen & (1ull << age)) ) return false;
+    _seen |= 1ull << age;
+    return true;
+  }
+
+} // namespace tn
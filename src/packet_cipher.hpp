@@ -0,0 +1,124 @@
+#ifndef _TORNET_PACKET_CIPHER_HPP_
+#define _TORNET_PACKET_CIPHER_HPP_
+#include <tornet/buffer.hpp>
+#include <fc/sha1.hpp>
+#include <boost/shared_ptr.hpp>
+#include <stdint.h>
+
+typedef struct evp_cipher_ctx_st EVP_CIPHER_CTX;
+
+namespace tn {
+
+  /**
+   *  Seals connection packets for one direction with an AEAD cipher suite that
+   *  both peers announced in their auth messages.  Peers that announce nothing
+   *  keep using blowfish.
+   *
+   *  A sealed packet is laid out as:
+   *
+   *    uint8_t   magic;          // sealed_magic
+   *    uint4     suite;
+   *    uint4     pad_bytes;
+   *    uint64_t  seq;            // big endian, never reused for a key
+   *    uint8_t   type;           // encrypted
+   *    data;                     // encrypted
+   *    char      tag[16];
+   *    pad;
+   *
+   *  The first 10 bytes are authenticated but not encrypted.  The nonce is a 4
+   *  byte salt derived with the key followed by seq.  Pad keeps the size a
+   *  multiple of 8 so that sealed packets are never mistaken for a key exchange.
+   *
+   *  A connection resumed from the peer db derives the same keys again, so seq
+   *  starts at the current time in microseconds rather than at 0 to keep
+   *  nonces unique across sessions.
+   *
+   *  An instance is not thread safe, the decrypt stage keeps its own copy.
+   */
+  class packet_cipher {
+    public:
+      typedef boost::shared_ptr<packet_cipher> ptr;
+
+      /// bit flags, as announced in the auth message
+      enum suite {
+        blowfish          = 0,
+        aes256_gcm        = 0x01,
+        chacha20_poly1305 = 0x02
+      };
+      enum {
+        sealed_magic = 0xa5,
+        header_size  = 10,
+        tag_size     = 16,
+        /// max bytes seal() adds to a message
+        overhead     = header_size + 1 + tag_size + 7
+      };
+
+      /// suites the linked OpenSSL provides
+      static uint8_t available();
+
+      /// the preferred suite found in both masks, blowfish if there is none
+      static suite   select( uint8_t local, uint8_t remote );
+
+      /**
+       *  Derives the key and salt for packets sent by node 'from' to node 'to'
+       *  from the shared secret of the key exchange.
+       */
+      packet_cipher( suite s, const char* shared_key, uint32_t len,
+                     const fc::sha1& from, const fc::sha1& to );
+      /// same key with its own cipher context
+      packet_cipher( const packet_cipher& c );
+      ~packet_cipher();
+
+      suite get_suite()const { return _suite; }
+
+      /// @return true if b could be a packet sealed with this suite
+      bool  is_sealed( const tn::buffer& b )const;
+
+      /**
+       *  Encrypts type and msg into out, which must hold size + overhead bytes.
+       *
+       *  @return bytes of out to send
+       */
+      uint32_t seal( uint8_t type, const char* msg, uint32_t size, unsigned char* out );
+
+      /**
+       *  Verifies and decrypts b into a new buffer laid out the way
+       *  connection::dispatch_packet expects.  b is left untouched.
+       *
+       *  @param seq - set to the sequence number b was sealed with
+       */
+      bool open( const tn::buffer& b, tn::buffer& plain, uint64_t& seq );
+
+    private:
+      packet_cipher& operator=( const packet_cipher& );
+      void init_ctx();
+
+      suite           _suite;
+      unsigned char   _key[32];
+      unsigned char   _salt[4];
+      uint64_t        _next_seq;
+      EVP_CIPHER_CTX* _ctx;
+  };
+
+  /**
+   *  Remembers which of the last 64 sequence numbers have been received so
+   *  that replayed packets are refused.
+   */
+  class replay_window {
+    public:
+      replay_window():_top(0),_seen(0){}
+
+      /// @return false if seq was received before or is too old to tell
+      bool accept( uint64_t seq );
+      /// @return true if seq is newer than every sequence number accepted so far
+      bool is_newest( uint64_t seq )const { return seq > _top; }
+      void reset() { _top = 0; _seen = 0; }
+
+    private:
+      uint64_t _top;
+      uint64_t _seen;
+  };
+
+} // namespace tn
+
+#endif // _TORNET_PACKET_CIPHER_HPP_
@@ -0,0 +1,150 @@
+#include "rank_miner.hpp"
+#include <fc/log.hpp>
+#include <fc/time.hpp>
+#include <fc/error.hpp>
+#include <fc/exception.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/lexical_cast.hpp>
+#include <openssl/sha.h>
+#include <string.h>
+#include <math.h>
+
+namespace tn {
+
+  // hashes per work slice between checks of the stop flag and duty cycle
+  enum { slice_hashes = 4096 };
+
+  static uint32_t count_leading_zeros( const unsigned char* h, uint32_t len ) {
+    uint32_t z = 0;
+    for( uint32_t i = 0; i < len; ++i ) {
+      if( !h[i] ) { z += 8; continue; }
+      unsigned char c = h[i];
+      while( !(c & 0x80) ) { ++z; c <<= 1; }
+      break;
+    }
+    return z;
+  }
+
+  rank_miner::rank_miner( const std::vector<char>& pub_key, const uint64_t start[2], uint32_t best_zeros, const found_handler& f )
+  :_pub_key(pub_key),_found(f),_best_zeros(best_zeros),_hashes(0),_stop(false),_duty(0),_rate_start_hashes(0),_rate_start_us(0) {
+    _start[0] = start[0];
+    _start[1] = start[1];
+  }
+
+  rank_miner::~rank_miner() {
+    stop();
+  }
+
+  uint32_t rank_miner::leading_zeros( const uint64_t nonce[2], const char* pub_key, uint32_t len ) {
+    SHA_CTX ctx;
+    unsigned char h[SHA_DIGEST_LENGTH];
+    SHA1_Init( &ctx );
+    SHA1_Update( &ctx, nonce, 2*sizeof(uint64_t) );
+    SHA1_Update( &ctx, pub_key, len );
+    SHA1_Final( h, &ctx );
+    return count_leading_zeros( h, sizeof(h) );
+  }
+
+  void rank_miner::start( double effort ) {
+    uint32_t cores = (std::max)( boost::thread::hardware_concurrency(), 1u );
+    effort = (std::max)( 0.0, (std::min)( 1.0, effort ) );
+    uint32_t nthreads = uint32_t( ceil( effort * cores ) );
+    // every thread runs the same fraction of the time
+    _duty.store( nthreads ? effort * cores / nthreads : 0, std::memory_order_relaxed );
+
+    _rate_start_hashes = _hashes;
+    _rate_start_us     = fc::time_point::now().time_since_epoch().count();
+
+    if( nthreads == _lanes.size() ) return;
+    stop();
+    if( !nthreads ) return;
+
+    _stop = false;
+    for( uint32_t i = 0; i < nthreads; ++i ) {
+      lane::ptr l( new lane() );
+      l->id      = i;
+      l->counter = _start[0];
+      _lanes.push_back(l);
+    }
+    for( uint32_t i = 0; i < _lanes.size(); ++i ) {
+      lane* l = _lanes[i].get();
+      l->thread.reset( new fc::thread( ("node::rank" + boost::lexical_cast<std::string>(i)).c_str() ) );
+      l->done = l->thread->async( [=](){ search(*l); } );
+    }
+    slog( "Rank search using %d threads at %f duty", nthreads, _duty.load() );
+  }
+
+  void rank_miner::stop() {
+    _stop = true;
+    uint64_t p[2];
+    progress(p);
+    for( uint32_t i = 0; i < _lanes.size(); ++i ) {
+      if( _lanes[i]->done.valid() )
+        _lanes[i]->done.wait();
+      _lanes[i]->thread->quit();
+    }
+    _lanes.clear();
+    _start[0] = p[0];
+  }
+
+  uint64_t rank_miner::hashes()const { return _hashes; }
+
+  double rank_miner::hash_rate()const {
+    int64_t us = fc::time_point::now().time_since_epoch().count() - _rate_start_us;
+    if( us <= 0 ) return 0;
+    return (_hashes - _rate_start_hashes) * 1000000.0 / us;
+  }
+
+  void rank_miner::progress( uint64_t out[2] )const {
+    out[0] = _start[0];
+    out[1] = _start[1];
+    for( uint32_t i = 0; i < _lanes.size(); ++i ) {
+      uint64_t c = _lanes[i]->counter;
+      if( i == 0 || c < out[0] ) out[0] = c;
+    }
+  }
+
+  /**
+   *  The public key follows the nonce so there is no midstate to reuse, every
+   *  candidate costs 5 SHA-1 blocks for an RSA key and 1 for Ed25519.  OpenSSL picks the fastest SHA-1 the CPU
+   *  supports (SHA-NI, AVX2, SSSE3), the buffer is laid out once per lane.
+   */
+  void rank_miner::search( lane& l ) {
+    try {
+      std::vector<uint64_t> words( 2 + (_pub_key.size() + 7) / 8 );
+      char*     msg   = reinterpret_cast<char*>(&words.front());
+      uint32_t  len   = 2*sizeof(uint64_t) + _pub_key.size();
+      uint64_t* nonce = &words.front();
+      memcpy( msg + 2*sizeof(uint64_t), &_pub_key.front(), _pub_key.size() );
+      nonce[1] = _start[1] + l.id;
+
+      unsigned char h[SHA_DIGEST_LENGTH];
+      while( !_stop ) {
+        int64_t  t0 = fc::time_point::now().time_since_epoch().count();
+        uint64_t c  = l.counter;
+        for( uint32_t i = 0; i < slice_hashes; ++i ) {
+          nonce[0] = c + i;
+          SHA1( (const unsigned char*)msg, len, h );
+          uint32_t z    = count_leading_zeros( h, sizeof(h) );
+          uint32_t best = _best_zeros;
+          while( z > best && !_best_zeros.compare_exchange_weak( best, z ) ) {}
+          if( z > best ) {
+            uint64_t found[2] = { nonce[0], nonce[1] };
+            _found( found );
+          }
+        }
+        l.counter = c + slice_hashes;
+        _hashes  += slice_hashes;
+
+        // sleep long enough to hold the duty cycle
+        double duty = _duty.load( std::memory_order_relaxed );
+        if( duty < 1 ) {
+          int64_t busy = fc::time_point::now().time_since_epoch().count() - t0;
+          fc::usleep( fc::microseconds( int64_t( busy * (1 - duty) / duty ) ) );
+        }
+      }
+    } catch ( const fc::task_canceled& ) {
+    } catch ( ... ) { elog( "%s", fc::current_exception().diagnostic_information().c_str() ); }
+  }
+
+} // namespace tn
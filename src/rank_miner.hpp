@@ -0,0 +1,85 @@
+#ifndef _TORNET_RANK_MINER_HPP_
+#define _TORNET_RANK_MINER_HPP_
+#include <fc/thread.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <functional>
+#include <vector>
+#include <atomic>
+#include <stdint.h>
+
+namespace tn {
+
+  /**
+   *  Searches for nonces that improve the node's rank,
+   *
+   *     rank = 161 - log2( sha1( nonce[2] || pub_key ) )
+   *
+   *  Each search thread walks its own lane of nonces: nonce[1] is fixed per
+   *  lane and nonce[0] counts up.  Threads work in short slices and sleep in
+   *  between so that together they use the requested fraction of the CPU.
+   *
+   *  Candidates are compared by the number of leading zero bits of the hash,
+   *  which orders them the same way rank does.  Whenever a thread beats the
+   *  best count seen so far it calls the found handler from its own thread,
+   *  the owner is expected to confirm the rank and persist the nonce.
+   */
+  class rank_miner {
+    public:
+      typedef std::function<void(const uint64_t*)> found_handler;
+
+      /**
+       *  @param pub_key     - serialized public key, 256 bytes for RSA or 32 for Ed25519
+       *  @param start       - where the previous search stopped
+       *  @param best_zeros  - leading zero bits of the current nonce's hash
+       */
+      rank_miner( const std::vector<char>& pub_key, const uint64_t start[2], uint32_t best_zeros, const found_handler& f );
+      ~rank_miner();
+
+      /**
+       *  Starts or retunes the search.
+       *
+       *  @param effort - fraction of the machine's CPU to use, 1 uses every core
+       */
+      void     start( double effort );
+      void     stop();
+
+      uint64_t hashes()const;
+      /// hashes per second over the last call to start()
+      double   hash_rate()const;
+
+      /**
+       *  @return a nonce below which every lane has been searched, a restarted
+       *          miner may resume from it.
+       */
+      void     progress( uint64_t out[2] )const;
+
+      /// leading zero bits of sha1( nonce || pub_key )
+      static uint32_t leading_zeros( const uint64_t nonce[2], const char* pub_key, uint32_t len );
+
+    private:
+      struct lane {
+        typedef boost::shared_ptr<lane> ptr;
+        uint32_t                      id;
+        std::atomic<uint64_t>         counter;
+        boost::scoped_ptr<fc::thread> thread;
+        fc::future<void>              done;
+      };
+      void search( lane& l );
+
+      std::vector<char>       _pub_key;
+      uint64_t                _start[2];
+      found_handler           _found;
+      std::atomic<uint32_t>   _best_zeros;
+      std::atomic<uint64_t>   _hashes;
+      std::atomic<bool>       _stop;
+      /// written by start() while the lanes run, read by each lane per slice
+      std::atomic<double>     _duty;
+      uint64_t                _rate_start_hashes;
+      int64_t                 _rate_start_us;
+      std::vector<lane::ptr>  _lanes;
+  };
+
+} // namespace tn
+
+#endif // _TORNET_RANK_MINER_HPP_
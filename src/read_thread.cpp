@@ -1,72 +1,260 @@
+#include "read_thread.hpp"
+#include <fc/log.hpp>
+#include <fc/error.hpp>
+#include <fc/exception.hpp>
+#include <boost/lexical_cast.hpp>
+#include <algorithm>
+#include <string.h>
 
 namespace tn {
 
-void read_thread::listen( uint16_t p ) {
+  static bool by_priority( const inbound_packet& l, const inbound_packet& r ) {
+    return l.priority > r.priority;
+  }
+
+  read_thread::read_thread( const std::vector<fc::thread*>& owners, const node::config& cfg, const batch_handler& h )
+  :_owners(owners),_cfg(cfg),_handler(h),_done(false),
+   _owner_backlog(0),_dropped(0),_decrypted(0),_decrypt_fail(0){}
+
+  read_thread::~read_thread() {
+    quit();
+  }
+
+  uint16_t read_thread::listen( uint16_t p ) {
     slog( "Listening on port %d", p );
-   _sock.open();
-   _sock.set_receive_buffer_size( 3*1024*1024 );
-   _sock.bind( fc::ip::endpoint( fc::ip::address(), p ) );
-   _read_loop_complete = _thread.async( [=](){ read_loop(); } );
-}
-
-      /**
-        One thread reads messages, find the connection, and enques the encrypted message and then
-        places the connection in the 'decode' queue if it is not already there.
-
-        One thread processes connections in the 'active' queue and focuses on 'decoding' messages
-        in each connection.  Messages are decoded according to the connections 'priority'. Then
-        they are inserted into the 'execute' queue.
-
-        The execute queue happens in the 'node' thread and is responsible for the business logic. These
-        requests are executed 'asynchronously' and given a priority level according to the connection.
-
-
-
-        Messages come in and the connection object for the endpoint is found.  The message
-        is pushed into the connection's queue (without decrypting it).  The connection is
-        put into the active priority queue.  
-          - read access to ep_to_con queue for most packets
-          - write access for 'new connections' 
-          - 
-  
-      */
-void read_thread::read_loop() {
-  try {
-    uint32_t count = 0;
-    while( !_done ) {
-       // allocate a new buffer for each packet... we have no idea how long it may be around
-       tn::buffer b;
-       fc::ip::endpoint from;
-       size_t s = _sock.receive_from( b.data(), b.size(), from );
-
-       if( s ) {
-          b.resize( s );
-
-        auto itr = _ep_to_con.find(ep);
-        if( itr == _ep_to_con.end() ) {
-          slog( "creating new connection" );
-          // failing that, create
-          connection::ptr c( new connection( _node, from, _peers ) );
-          { 
-              fc::unique_lock<fc::mutex> lock(_ep_to_con_mutex);
-              _ep_to_con[ep] = c;
+    uint16_t port   = p;
+    uint32_t nshards = (std::max)( _cfg.io_shards, uint32_t(1) );
+    for( uint32_t i = 0; i < nshards; ++i ) {
+      io_shard::ptr sh( new io_shard(i) );
+      sh->sock.open( nshards > 1 );
+      sh->sock.set_receive_buffer_size( 3*1024*1024 );
+      sh->sock.set_receive_timeout( fc::milliseconds(250) );
+      if( _cfg.max_mtu > _cfg.base_mtu ) sh->sock.set_dont_fragment( true );
+      // every shard after the first binds the port the first was given
+      sh->sock.bind( fc::ip::endpoint( fc::ip::address(), port ) );
+      port = sh->sock.local_port();
+      sh->send_bufs.reserve( _cfg.io_batch_size );
+      sh->send_eps.reserve( _cfg.io_batch_size );
+      _shards.push_back(sh);
+    }
+    for( uint32_t i = 0; i < _cfg.decrypt_threads; ++i ) {
+      decrypt_lane* l = new decrypt_lane();
+      _lanes.push_back( decrypt_lane::ptr(l) );
+      l->thread.reset( new fc::thread( ("node::decrypt" + boost::lexical_cast<std::string>(i)).c_str() ) );
+      l->loop_complete = l->thread->async( [=](){ decrypt_loop(*l); } );
+    }
+    for( uint32_t i = 0; i < _shards.size(); ++i ) {
+      io_shard* sh = _shards[i].get();
+      sh->thread.reset( new fc::thread( ("node::shard" + boost::lexical_cast<std::string>(i)).c_str() ) );
+      sh->read_loop_complete = sh->thread->async( [=](){ read_loop(*sh); } );
+    }
+    return port;
+  }
+
+  void read_thread::quit() {
+    if( _done ) return;
+    _done = true;
+    for( uint32_t i = 0; i < _shards.size(); ++i ) {
+      if( _shards[i]->read_loop_complete.valid() )
+        _shards[i]->read_loop_complete.wait();
+      _shards[i]->thread->quit();
+      _shards[i]->sock.close();
+    }
+    { boost::unique_lock<boost::mutex> lock(_backlog_mutex); }
+    _backlog_drained.notify_all();
+    for( uint32_t i = 0; i < _lanes.size(); ++i ) {
+      { boost::unique_lock<boost::mutex> lock(_lanes[i]->mutex); }
+      _lanes[i]->ready.notify_all();
+      if( _lanes[i]->loop_complete.valid() )
+        _lanes[i]->loop_complete.wait();
+      _lanes[i]->thread->quit();
+    }
+  }
+
+  void read_thread::set_rx_key( const fc::ip::endpoint& ep, const char* key, uint32_t gen, float priority,
+                                const packet_cipher* sealed, uint64_t cid ) {
+    if( !_lanes.size() ) return;
+    rx_key::ptr k( new rx_key() );
+    k->bf.start( (unsigned char*)key, 56 );
+    if( sealed ) k->sealed.reset( new packet_cipher( *sealed ) );
+    k->cid      = cid;
+    k->gen      = gen;
+    k->priority = priority;
+    boost::unique_lock<boost::mutex> lock(_keys_mutex);
+    _keys[ep] = k;
+  }
+
+  void read_thread::clear_rx_key( const fc::ip::endpoint& ep ) {
+    if( !_lanes.size() ) return;
+    boost::unique_lock<boost::mutex> lock(_keys_mutex);
+    _keys.erase(ep);
+  }
+
+  /**
+   *  Runs in the shard's thread, draining up to io_batch_size datagrams per
+   *  syscall and passing them on to the next stage.  A peer's datagrams 
+   *  always arrive on the same shard and go to the decrypt lane its endpoint
+   *  hashes to, so datagrams from one peer are never reordered while every
+   *  lane gets work even from a single shard.
+   */
+  void read_thread::read_loop( io_shard& sh ) {
+    try {
+      uint32_t                      rx_size = _cfg.rx_buffer_size();
+      std::vector<tn::buffer>       bufs;
+      std::vector<fc::ip::endpoint> from(_cfg.io_batch_size);
+      // copies of one buffer would share storage, every slot needs its own
+      for( uint32_t i = 0; i < _cfg.io_batch_size; ++i )
+        bufs.push_back( tn::buffer(rx_size) );
+      std::vector<inbound_batch>    per_lane( _lanes.size() );
+      while( !_done ) {
+        uint32_t n = sh.sock.receive_batch( bufs, from );
+        if( !n ) continue;
+
+        inbound_batch b(n);
+        for( uint32_t i = 0; i < n; ++i ) {
+          b[i].ep  = from[i];
+          b[i].raw = bufs[i];
+          bufs[i]  = tn::buffer(rx_size); // the old one now belongs to the next stage
+        }
+        if( !_lanes.size() ) {
+          deliver( b );
+          continue;
+        }
+
+        for( uint32_t i = 0; i < n; ++i )
+          per_lane[ fc::ip::hash_value(b[i].ep) % _lanes.size() ].push_back( b[i] );
+
+        for( uint32_t l = 0; l < per_lane.size(); ++l ) {
+          if( per_lane[l].empty() ) continue;
+          decrypt_lane& lane   = *_lanes[l];
+          uint32_t      count  = per_lane[l].size();
+          bool          queued = false;
+          {
+            boost::unique_lock<boost::mutex> lock(lane.mutex);
+            if( lane.queue.size() < _cfg.pipeline_depth ) {
+              lane.queue.push_back( inbound_batch() );
+              lane.queue.back().swap( per_lane[l] );
+              queued = true;
+            }
           }
-          c->handle_packet(b);
-        } else { 
-          itr->second->handle_packet(b); 
+          if( queued ) lane.ready.notify_one();
+          else       { _dropped += count; per_lane[l].clear(); }
+        }
+      }
+    } catch ( const fc::task_canceled& ) {
+    } catch ( ... ) { elog( "%s", fc::current_exception().diagnostic_information().c_str() ); }
+  }
+
+  void read_thread::decrypt_loop( decrypt_lane& l ) {
+    try {
+      while( true ) {
+        inbound_batch b;
+        {
+          boost::unique_lock<boost::mutex> lock(l.mutex);
+          while( !_done && l.queue.empty() )
+            l.ready.timed_wait( lock, boost::posix_time::milliseconds(250) );
+          if( _done ) return;
+          b.swap( l.queue.front() );
+          l.queue.pop_front();
+        }
+        decrypt_batch( b );
+        deliver( b );
+      }
+    } catch ( const fc::task_canceled& ) {
+    } catch ( ... ) { elog( "%s", fc::current_exception().diagnostic_information().c_str() ); }
+  }
+
+  /**
+   *  Decrypts a copy of every datagram that could be a message for a connection
+   *  with a published key, the original stays untouched so that the connection
+   *  can still decode it if the key changed in the mean time.  Key exchange
+   *  datagrams (size % 8 != 0) pass through as they are.
+   *
+   *  Sealed datagrams are opened into a new buffer, the connection checks
+   *  their sequence number against its replay window.
+   */
+  void read_thread::decrypt_batch( inbound_batch& b ) {
+    std::vector<rx_key::ptr> keys(b.size());
+    {
+      boost::unique_lock<boost::mutex> lock(_keys_mutex);
+      for( uint32_t i = 0; i < b.size(); ++i ) {
+        if( b[i].raw.size() < 8 || b[i].raw.size() % 8 ) continue;
+        auto itr = _keys.find( b[i].ep );
+        if( itr != _keys.end() ) keys[i] = itr->second;
+      }
+    }
+    for( uint32_t i = 0; i < b.size(); ++i ) {
+      if( !keys[i] ) continue;
+      rx_key& k = *keys[i];
+      b[i].priority = k.priority;
+      if( k.cid && b[i].raw.size() >= 16 && !memcmp( b[i].raw.data(), &k.cid, sizeof(k.cid) ) ) {
+        b[i].raw = b[i].raw.subbuf( sizeof(k.cid) );
+        b[i].cid = k.cid;
+      }
+      if( k.sealed && k.sealed->is_sealed( b[i].raw ) ) {
+        tn::buffer plain;
+        uint64_t   seq;
+        if( k.sealed->open( b[i].raw, plain, seq ) ) {
+          b[i].plain  = plain;
+          b[i].seq    = seq;
+          b[i].rx_gen = k.gen;
+          ++_decrypted;
+          continue;
         }
-       }
+      }
+      tn::buffer plain( b[i].raw.data(), b[i].raw.size() );
+      if( connection::decrypt_packet( k.bf, plain ) ) {
+        b[i].plain  = plain;
+        b[i].rx_gen = k.gen;
+        ++_decrypted;
+      } else {
+        ++_decrypt_fail;
+      }
     }
-  } catch ( ... ) { elog( "%s", fc::current_exception().diagnostic_information().c_str() ); }
-}
+    std::stable_sort( b.begin(), b.end(), &by_priority );
+  }
 
-connection* read_thread::get_connection( const fc::ip::endpoint& ep ) {
-  fc::unique_lock<fc::mutex> lock(_ep_to_con_mutex);
-  auto itr = _ep_to_con.find(ep);
-  if( itr != _ep_to_con.end() ) return itr->second.get();
-  return 0;
-}
+  /**
+   *  Splits b by the owner of each endpoint, a batch read from one socket 
+   *  holds datagrams for all of them.
+   */
+  void read_thread::deliver( inbound_batch& b ) {
+    if( _owners.size() == 1 ) {
+      deliver( 0, b );
+      return;
+    }
+    std::vector<inbound_batch> per_owner( _owners.size() );
+    for( uint32_t i = 0; i < b.size(); ++i )
+      per_owner[ fc::ip::hash_value(b[i].ep) % _owners.size() ].push_back( b[i] );
+    b.clear();
+    for( uint32_t o = 0; o < per_owner.size(); ++o ) 
+      if( per_owner[o].size() ) 
+        deliver( o, per_owner[o] );
+  }
 
+  /**
+   *  Hands b to its owner thread, waiting while pipeline_depth batches per 
+   *  owner are already waiting there.
+   */
+  void read_thread::deliver( uint32_t owner, inbound_batch& b ) {
+    {
+      boost::unique_lock<boost::mutex> lock(_backlog_mutex);
+      while( !_done && _owner_backlog >= _cfg.pipeline_depth * _owners.size() )
+        _backlog_drained.timed_wait( lock, boost::posix_time::milliseconds(250) );
+    }
+    if( _done ) return;
 
+    boost::shared_ptr<inbound_batch> nb( new inbound_batch() );
+    nb->swap(b);
+    ++_owner_backlog;
+    _owners[owner]->async( [=]() {
+      {
+        boost::unique_lock<boost::mutex> lock(_backlog_mutex);
+        --_owner_backlog;
+      }
+      _backlog_drained.notify_all();
+      _handler( owner, *nb );
+    }, "handle_batch" );
+  }
 
-}
+} // namespace tn
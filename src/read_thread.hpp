@@ -0,0 +1,172 @@
+#ifndef _TORNET_READ_THREAD_HPP_
+#define _TORNET_READ_THREAD_HPP_
+#include <tornet/node.hpp>
+#include <tornet/connection.hpp>
+#include "mmsg_socket.hpp"
+#include "packet_cipher.hpp"
+#include <fc/thread.hpp>
+#include <fc/blowfish.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <functional>
+#include <atomic>
+#include <deque>
+
+namespace fc { namespace ip {
+inline std::size_t hash_value( const fc::ip::endpoint& ep ) {
+  std::size_t seed = 0;
+  boost::hash_combine( seed, uint32_t(ep.get_address()) );
+  boost::hash_combine( seed, ep.port() );
+  return seed;
+}
+} }
+
+namespace tn {
+  typedef std::vector<inbound_packet> inbound_batch;
+
+  /**
+   *  One socket and the thread that reads it.  With more than one shard every
+   *  socket binds the same port with SO_REUSEPORT and the kernel hashes each
+   *  remote endpoint to one of them, so a peer's datagrams always arrive on
+   *  the same shard.
+   *
+   *  The send queue belongs to the node shard with the same index, which
+   *  flushes it, see node::impl::con_shard.
+   */
+  struct io_shard {
+    typedef boost::shared_ptr<io_shard> ptr;
+    io_shard( uint32_t i ):id(i){}
+
+    void flush_sends() {
+      if( !send_bufs.size() ) return;
+      sock.send_batch( &send_bufs.front(), &send_eps.front(), send_bufs.size() );
+      send_bufs.clear();
+      send_eps.clear();
+    }
+
+    uint32_t                      id;
+    mmsg_socket                   sock;
+    boost::scoped_ptr<fc::thread> thread;
+    fc::future<void>              read_loop_complete;
+    std::vector<tn::buffer>       send_bufs;
+    std::vector<fc::ip::endpoint> send_eps;
+  };
+
+  /**
+   *  The receive side of the node when batched I/O is enabled.  Work is split
+   *  into three stages so that the owner threads only run business logic:
+   *
+   *    1. each io_shard thread reads batches of datagrams from its socket
+   *    2. decrypt threads decrypt and verify every datagram whose endpoint has
+   *       a published receive key, ordering each batch by connection priority.
+   *       Shards split their batches among all of them by remote endpoint.
+   *    3. the owner thread of each endpoint dispatches the decoded messages
+   *       to its connections.  Every endpoint is owned by the thread its hash
+   *       picks from the owners given to the constructor.
+   *
+   *  The stages are joined by bounded queues.  When a decrypt queue is full the
+   *  reader drops the batch, just as the kernel would have if we had not read
+   *  it.  When the owner threads fall behind the decrypt threads stop taking
+   *  work, which in turn fills their queues.
+   *
+   *  Connections own their keys.  They publish a copy with set_rx_key() under a
+   *  node wide generation number so that plaintext decoded with a key that has
+   *  since been replaced is recognised and decoded again by the connection.
+   *
+   *  With decrypt_threads == 0 the shards hand batches straight to the owner
+   *  threads.
+   */
+  class read_thread {
+    public:
+      /// called with the index of the owner and the datagrams it owns
+      typedef std::function<void(uint32_t,inbound_batch&)> batch_handler;
+
+      /**
+       *  @param owners - threads the datagrams are delivered to, by endpoint hash
+       *  @param h      - called on owners[i] with every batch for owner i
+       */
+      read_thread( const std::vector<fc::thread*>& owners, const node::config& cfg, const batch_handler& h );
+      ~read_thread();
+
+      /**
+       *  Opens io_shards sockets on port p and starts the reading and decrypting
+       *  threads.
+       *
+       *  @return the port that was bound
+       */
+      uint16_t  listen( uint16_t p );
+      void      quit();
+
+      /**
+       *  Every socket is bound to the same port, so the peer sees the same
+       *  source no matter which one sends to it.
+       */
+      const std::vector<io_shard::ptr>& shards()const { return _shards; }
+
+      /**
+       *  Makes key (56 bytes) available to the decrypt stage for datagrams from ep,
+       *  replacing any previous key.  With a sealed cipher, datagrams sealed with
+       *  it are opened with a copy of it instead.  Datagrams that start with the
+       *  connection id cid have it removed first.
+       */
+      void      set_rx_key( const fc::ip::endpoint& ep, const char* key, uint32_t gen, float priority,
+                            const packet_cipher* sealed = 0, uint64_t cid = 0 );
+      void      clear_rx_key( const fc::ip::endpoint& ep );
+
+      uint64_t  dropped_packets()const  { return _dropped;      }
+      uint64_t  decrypted_packets()const{ return _decrypted;    }
+      uint64_t  decrypt_failures()const { return _decrypt_fail; }
+
+    private:
+      struct rx_key {
+        typedef boost::shared_ptr<rx_key> ptr;
+        fc::blowfish       bf;
+        packet_cipher::ptr sealed;
+        uint64_t           cid;
+        uint32_t           gen;
+        float              priority;
+      };
+
+      struct decrypt_lane {
+        typedef boost::shared_ptr<decrypt_lane> ptr;
+        boost::mutex                  mutex;
+        boost::condition_variable     ready;
+        std::deque<inbound_batch>     queue;
+        boost::scoped_ptr<fc::thread> thread;
+        fc::future<void>              loop_complete;
+      };
+
+      void read_loop( io_shard& sh );
+      void decrypt_loop( decrypt_lane& l );
+      void decrypt_batch( inbound_batch& b );
+      void deliver( inbound_batch& b );
+      void deliver( uint32_t owner, inbound_batch& b );
+
+      std::vector<fc::thread*>                              _owners;
+      node::config                                          _cfg;
+      batch_handler                                         _handler;
+      std::atomic<bool>                                     _done;
+
+      std::vector<io_shard::ptr>                            _shards;
+      std::vector<decrypt_lane::ptr>                        _lanes;
+
+      boost::mutex                                          _keys_mutex;
+      boost::unordered_map<fc::ip::endpoint,rx_key::ptr>    _keys;
+
+      // deliver() waits on _backlog_drained while the owner threads have
+      // pipeline_depth batches each to handle
+      boost::mutex                                          _backlog_mutex;
+      boost::condition_variable                             _backlog_drained;
+      std::atomic<uint32_t>                                 _owner_backlog;
+      std::atomic<uint64_t>                                 _dropped;
+      std::atomic<uint64_t>                                 _decrypted;
+      std::atomic<uint64_t>                                 _decrypt_fail;
+  };
+
+} // namespace tn
+
+#endif // _TORNET_READ_THREAD_HPP_
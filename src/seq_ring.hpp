@@ -0,0 +1,95 @@
+#ifndef _TORNET_SEQ_RING_HPP_
+#define _TORNET_SEQ_RING_HPP_
+#include <vector>
+#include <stdint.h>
+
+namespace tn {
+
+  /**
+   *  Holds the packets of a udt_channel window at seq % capacity, so finding,
+   *  adding and removing one costs the same however many are held.
+   *
+   *  A seq that lands on a slot held by another seq doubles the capacity,
+   *  which therefore ends up larger than the span of the window.  Being a
+   *  power of 2 it divides the sequence number space, so a window keeps its
+   *  slots when the sequence numbers wrap.
+   */
+  template<typename T>
+  class seq_ring {
+    public:
+      seq_ring( uint32_t capacity = 64 ):_size(0) {
+        uint32_t c = 1;
+        while( c < capacity ) c <<= 1;
+        _slots.resize(c);
+      }
+
+      uint32_t size()const     { return _size; }
+      uint32_t capacity()const { return _slots.size(); }
+
+      /// @return the value held for seq, 0 if there is none
+      T* find( uint32_t seq ) {
+        slot& s = _slots[ seq & (_slots.size()-1) ];
+        return s.used && s.seq == seq ? &s.value : 0;
+      }
+      const T* find( uint32_t seq )const {
+        const slot& s = _slots[ seq & (_slots.size()-1) ];
+        return s.used && s.seq == seq ? &s.value : 0;
+      }
+
+      /// @return false if a value for seq is held already
+      bool insert( uint32_t seq, const T& v ) {
+        slot* s = &_slots[ seq & (_slots.size()-1) ];
+        while( s->used && s->seq != seq ) {
+          grow();
+          s = &_slots[ seq & (_slots.size()-1) ];
+        }
+        if( s->used ) return false;
+        s->used  = true;
+        s->seq   = seq;
+        s->value = v;
+        ++_size;
+        return true;
+      }
+
+      /// @return false if no value for seq was held
+      bool erase( uint32_t seq ) {
+        slot& s = _slots[ seq & (_slots.size()-1) ];
+        if( !s.used || s.seq != seq ) return false;
+        s.used  = false;
+        s.value = T();
+        --_size;
+        return true;
+      }
+
+      void clear() {
+        for( uint32_t i = 0; i < _slots.size(); ++i ) {
+          _slots[i].used  = false;
+          _slots[i].value = T();
+        }
+        _size = 0;
+      }
+
+    private:
+      struct slot {
+        slot():used(false),seq(0){}
+        bool     used;
+        uint32_t seq;
+        T        value;
+      };
+
+      void grow() {
+        std::vector<slot> s( _slots.size() * 2 );
+        for( uint32_t i = 0; i < _slots.size(); ++i ) {
+          if( _slots[i].used )
+            s[ _slots[i].seq & (s.size()-1) ] = _slots[i];
+        }
+        _slots.swap(s);
+      }
+
+      std::vector<slot> _slots;
+      uint32_t          _size;
+  };
+
+} // namespace tn
+
+#endif // _TORNET_SEQ_RING_HPP_
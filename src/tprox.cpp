@@ -66,6 +66,7 @@ class tproxy {
       uint16_t               http_proxy_port;
       uint16_t               tornet_port;
       fc::vector<fc::string> bootstrap_hosts;
+      tn::node::config       node;
     };
 
     config _cfg;
@@ -81,7 +82,7 @@ class tproxy {
 
 
       tnode.reset( new tn::node() );
-      tnode->init( fc::path(c.data_dir) / "nodes", c.tornet_port );
+      tnode->init( fc::path(c.data_dir) / "nodes", c.tornet_port, c.node );
 
       httpd.on_request( 
         [this]( const fc::http::request& r, const fc::http::server::response& s ) {
@@ -381,7 +382,8 @@ class tproxy {
 
 
 
-FC_REFLECT( tproxy::config, (data_dir)(http_proxy_port)(tornet_port)(bootstrap_hosts) )
+FC_REFLECT( tn::node::config, (io_batch_size)(io_shards)(decrypt_threads)(pipeline_depth)(sched_quantum)(inbound_queue_size)(inbound_drop_policy)(idle_timeout_sec)(connection_pool_size)(unverified_cons_per_sec)(hibernate_after_sec)(kbucket_slots)(cipher_suites)(bundle_delay_us)(bundle_size)(base_mtu)(max_mtu)(pmtu_raise_sec)(dh_pool_size)(crypto_threads)(key_cache_size)(handshake_version)(ed25519_identity)(udt_congestion)(udt_rx_budget_mb) )
+FC_REFLECT( tproxy::config, (data_dir)(http_proxy_port)(tornet_port)(bootstrap_hosts)(node) )
 int main( int argc, char** argv ) {
   if( argc < 2 ) {
     fc::cout<<"Usage "<<argv[0]<<" CONFIG\n";
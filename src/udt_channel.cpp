@@ -4,11 +4,12 @@
 #include <tornet/buffer.hpp>
 #include <fc/signals.hpp>
 #include <tornet/node.hpp>
-
-#include <list>
+#include "congestion_control.hpp"
+#include "seq_ring.hpp"
+#include <atomic>
 
 namespace tn {
-  typedef sequence::number<uint16_t> seq_num;
+  typedef sequence::number<uint32_t> seq_num;
   
   struct packet {
     enum types {
@@ -16,10 +17,37 @@ namespace tn {
       ack  = 1,
       nack = 2,
       ack2 = 3,
-      close = 4
+      close = 4,
+      /// flag on the type, the packet carries 32 bit sequence numbers
+      seq32 = 0x80
+    };
+    /// sent in acks, older peers do not read them
+    enum features {
+      feature_seq32 = 0x01  ///< reads packets with the seq32 flag
     };
   };
 
+  /// bytes in front of a data packet's payload: type, rx_win_start and seq
+  inline uint32_t data_header( uint8_t flags ) {
+    return flags & packet::seq32 ? 1 + 2*sizeof(uint32_t) : 1 + 2*sizeof(uint16_t);
+  }
+
+  /**
+   *  Sequence numbers are 32 bits, peers that do not read the seq32 flag are
+   *  only sent the low 16 bits.  The reader widens those against a seq of its
+   *  own that is within 2^15 of the sent one.
+   */
+  template<typename Stream>
+  void write_seq( Stream& s, const seq_num& n, bool seq32 ) {
+    if( seq32 ) { uint32_t v = n.value(); s.write( (char*)&v, sizeof(v) ); }
+    else        { uint16_t v = n.value(); s.write( (char*)&v, sizeof(v) ); }
+  }
+  template<typename Stream>
+  void read_seq( Stream& s, seq_num& n, bool seq32, const seq_num& ref ) {
+    if( seq32 ) { uint32_t v = 0; s.read( (char*)&v, sizeof(v) ); n = v; }
+    else        { uint16_t v = 0; s.read( (char*)&v, sizeof(v) ); n = sequence::widen( v, ref ); }
+  }
+
   struct data_packet {
     data_packet():flags(packet::data){}
     data_packet( const tn::buffer& b )
@@ -29,73 +57,200 @@ namespace tn {
     seq_num          seq;
     tn::buffer   data;
     seq_num          last_sent_ack_seq;
+
+    /// writes the data_header(flags) bytes in front of data to h
+    void pack_header( char* h )const {
+      fc::datastream<char*> ds( h, data_header(flags) );
+      ds.write( (char*)&flags, sizeof(flags) );
+      write_seq( ds, rx_win_start, flags & packet::seq32 );
+      write_seq( ds, seq,          flags & packet::seq32 );
+    }
   };
 
   struct ack_packet {
-    ack_packet():flags(packet::ack){}
+    ack_packet()
+    :flags(packet::ack),rtt_us(0),recv_rate(0),link_capacity(0),rtt_var_us(0),
+     sack_budget(256),legacy_miss_list(true),has_sack(false),features(0),seq32(false){}
     uint8_t    flags;
     seq_num    rx_win_start;    // last data packet read (by user?)
-    uint16_t   rx_win_size;     // the size of the rx window 
+    uint32_t   rx_win_size;     // the size of the rx window 
     seq_num    rx_win_end;      // last packet received (less than win_start+win_end?)
     seq_num    ack_seq;
     uint64_t   utc_time;
 
     miss_list  missed_seq;      // any missing seq between
 
+    // receiver measurements for the sender's congestion control, older 
+    // peers neither send nor read them
+    uint32_t   rtt_us;          // smoothed
+    uint32_t   recv_rate;       // data packets per second
+    uint32_t   link_capacity;   // packets per second, see arrival_history
+    uint32_t   rtt_var_us;
+
+    // missed_seq is also sent as a selective ack of at most sack_budget
+    // bytes, see miss_list::pack_sack.  Older peers only read the original
+    // list, which is left empty once the peer is known to read the sack.
+    uint32_t   sack_budget;
+    bool       legacy_miss_list;
+    bool       has_sack;        // set when a received ack carried a selective ack
+    uint8_t    features;        // packet::features of the sender
+
+    // 32 bit sequence numbers, without the original list which only 
+    // holds 16 bit ones.  16 bit ones are widened against ref, the 
+    // ack_seq against ack_ref.
+    bool       seq32;
+    seq_num    ref;
+    seq_num    ack_ref;
+
     template<typename Stream>
     friend Stream& operator << ( Stream& s, const ack_packet& n ) {
-      s.write( (char*)&n.flags,        sizeof(n.flags) );
-      s.write( (char*)&n.rx_win_start, sizeof(n.rx_win_start) );
-      s.write( (char*)&n.rx_win_size,  sizeof(n.rx_win_size) );
-      s.write( (char*)&n.rx_win_end,  sizeof(n.rx_win_end) );
-      s.write( (char*)&n.ack_seq,      sizeof(n.ack_seq) );
+      uint8_t  flags = n.flags | (n.seq32 ? packet::seq32 : 0);
+      uint16_t win16 = (std::min)( n.rx_win_size, uint32_t(0xffff) );
+      s.write( (char*)&flags,          sizeof(flags) );
+      write_seq( s, n.rx_win_start, n.seq32 );
+      if( n.seq32 ) s.write( (char*)&n.rx_win_size, sizeof(n.rx_win_size) );
+      else          s.write( (char*)&win16,          sizeof(win16) );
+      write_seq( s, n.rx_win_end,   n.seq32 );
+      write_seq( s, n.ack_seq,      n.seq32 );
       s.write( (char*)&n.utc_time,     sizeof(n.utc_time) );
-      s << n.missed_seq;
+      if( !n.seq32 ) {
+        if( n.legacy_miss_list ) n.missed_seq.write_legacy(s);
+        else                     miss_list().write_legacy(s);
+      }
+      s.write( (char*)&n.rtt_us,        sizeof(n.rtt_us) );
+      s.write( (char*)&n.recv_rate,     sizeof(n.recv_rate) );
+      s.write( (char*)&n.link_capacity, sizeof(n.link_capacity) );
+      s.write( (char*)&n.rtt_var_us,    sizeof(n.rtt_var_us) );
+
+      char     sack[1500];
+      uint16_t sack_len = n.missed_seq.pack_sack( sack, (std::min)( n.sack_budget, uint32_t(sizeof(sack)) ), n.seq32 );
+      s.write( (char*)&sack_len, sizeof(sack_len) );
+      s.write( sack, sack_len );
+      s.write( (char*)&n.features, sizeof(n.features) );
       return s;
     }
     template<typename Stream>
     friend Stream& operator >> ( Stream& s, ack_packet& n ) {
       s.read( (char*)&n.flags,        sizeof(n.flags) );
-      s.read( (char*)&n.rx_win_start, sizeof(n.rx_win_start) );
-      s.read( (char*)&n.rx_win_size,  sizeof(n.rx_win_size) );
-      s.read( (char*)&n.rx_win_end,   sizeof(n.rx_win_end) );
-      s.read( (char*)&n.ack_seq,      sizeof(n.ack_seq) );
+      n.seq32  = n.flags & packet::seq32;
+      n.flags &= ~packet::seq32;
+      read_seq( s, n.rx_win_start, n.seq32, n.ref );
+      if( n.seq32 ) s.read( (char*)&n.rx_win_size, sizeof(n.rx_win_size) );
+      else {
+        uint16_t win16 = 0;
+        s.read( (char*)&win16, sizeof(win16) );
+        n.rx_win_size = win16;
+      }
+      read_seq( s, n.rx_win_end,   n.seq32, n.ref );
+      read_seq( s, n.ack_seq,      n.seq32, n.ack_ref );
       s.read( (char*)&n.utc_time,     sizeof(n.utc_time) );
-      s >> n.missed_seq;
+      if( !n.seq32 ) n.missed_seq.read_legacy( s, n.ref );
+      else           n.missed_seq.clear();
+      n.rtt_us = n.recv_rate = n.link_capacity = n.rtt_var_us = 0;
+      if( s.remaining() >= 3*sizeof(uint32_t) ) {
+        s.read( (char*)&n.rtt_us,        sizeof(n.rtt_us) );
+        s.read( (char*)&n.recv_rate,     sizeof(n.recv_rate) );
+        s.read( (char*)&n.link_capacity, sizeof(n.link_capacity) );
+      }
+      if( s.remaining() >= sizeof(uint32_t) )
+        s.read( (char*)&n.rtt_var_us,    sizeof(n.rtt_var_us) );
+
+      n.has_sack = false;
+      n.features = 0;
+      uint16_t sack_len = 0;
+      char     sack[1500];
+      if( s.remaining() >= sizeof(sack_len) ) {
+        s.read( (char*)&sack_len, sizeof(sack_len) );
+        if( sack_len <= sizeof(sack) && sack_len <= s.remaining() ) {
+          s.read( sack, sack_len );
+          miss_list            ml;
+          miss_list::seq_num   last;
+          bool                 more;
+          if( ml.unpack_sack( sack, sack_len, n.seq32, n.ref, last, more ) ) {
+            n.missed_seq = ml;
+            n.has_sack   = true;
+            // the received packets after last are not known, the sender
+            // must not take them for delivered
+            if( more && last < n.rx_win_end ) n.rx_win_end = last;
+          }
+          if( s.remaining() >= sizeof(n.features) )
+            s.read( (char*)&n.features, sizeof(n.features) );
+        }
+      }
       return s;
     }
   };
 
   struct nack_packet {
+    nack_packet():flags(packet::nack),seq32(false){}
     uint8_t   flags;
     seq_num   rx_win_start;
     seq_num   start_seq;
     seq_num   end_seq;
 
+    bool      seq32;
+    seq_num   ref;              // the 16 bit seqs are widened against
+
     template<typename Stream>
     friend Stream& operator << ( Stream& s, const nack_packet& n ) {
-      s.write( (char*)&n.flags,        sizeof(n.flags) );
-      s.write( (char*)&n.rx_win_start, sizeof(n.rx_win_start) );
-      s.write( (char*)&n.start_seq,    sizeof(n.start_seq) );
-      s.write( (char*)&n.end_seq,      sizeof(n.end_seq) );
+      uint8_t flags = n.flags | (n.seq32 ? packet::seq32 : 0);
+      s.write( (char*)&flags,          sizeof(flags) );
+      write_seq( s, n.rx_win_start, n.seq32 );
+      write_seq( s, n.start_seq,    n.seq32 );
+      write_seq( s, n.end_seq,      n.seq32 );
       return s;
     }
     template<typename Stream>
     friend Stream& operator >> ( Stream& s, nack_packet& n ) {
       s.read( (char*)&n.flags,        sizeof(n.flags) );
-      s.read( (char*)&n.rx_win_start, sizeof(n.rx_win_start) );
-      s.read( (char*)&n.start_seq,    sizeof(n.start_seq) );
-      s.read( (char*)&n.end_seq,      sizeof(n.end_seq) );
+      n.seq32  = n.flags & packet::seq32;
+      n.flags &= ~packet::seq32;
+      read_seq( s, n.rx_win_start, n.seq32, n.ref );
+      read_seq( s, n.start_seq,    n.seq32, n.ref );
+      read_seq( s, n.end_seq,      n.seq32, n.ref );
       return s;
     }
 
   };
 
+  /**
+   *  Serializes a control packet into a buffer from the smallest pool size
+   *  class that fits rather than a full sized data packet buffer, leaving
+   *  room for the channel to send it without another copy.
+   */
+  template<typename Packet>
+  tn::buffer pack_control( const Packet& p ) {
+    char tmp[2048];
+    fc::datastream<char*> ds(tmp,sizeof(tmp));
+    ds << p;
+    tn::buffer b( ds.tellp(), channel::send_headroom, channel::send_tailroom );
+    memcpy( b.data(), tmp, ds.tellp() );
+    return b;
+  }
+
+  /// bytes reserved by the receive windows of every udt_channel, see node::config::udt_rx_budget_mb
+  static std::atomic<int64_t> rx_budget_used(0);
+
   class udt_channel_private  : virtual public fc::retainable {
     public:
+      enum { 
+        min_sleep_us        = 100,
+        /// assumed until the first ack/ack2 round trip
+        initial_rtt_us      = 100000,
+        min_ack_interval_us = 10000,
+        max_ack_interval_us = 100000,
+        min_rto_us          = 50000,
+        /// stays below the 5 s after which a silent channel is closed
+        max_rto_us          = 4000000,
+        /// windows while 16 bit seqs are sent, leaves room to widen them
+        /// against a reference that lags the window
+        max_win16           = miss_list::max_span16,
+        max_win32           = miss_list::max_span32
+      };
+
    //   seq_num               last_rx_seq;    // last rx seq  (received from sender)
-      uint16_t               remote_rx_win;  // the maximum amount the remote host can receive
-      uint16_t               tx_win_size;    // our max tx window...varies with network
+      uint32_t               remote_rx_win;  // the maximum amount the remote host can receive
+      uint32_t               tx_win_size;    // our max tx window...varies with network
       boost::signal<void()>  tx_win_avail;   // trx buffer can take new inputs
       boost::signal<void()>  rx_win_avail;   // data ready to be read
 
@@ -107,9 +262,9 @@ namespace tn {
       ack_packet             tx_ack2_pack;
       ack_packet             rx_ack2_pack;
 
-      bool                      start_up;
-      bool                      dec_on_nack;
       bool                      started_retran;
+      bool                      peer_sack;      // the remote host reads selective acks
+      bool                      peer_seq32;     // the remote host reads 32 bit seqs
       bool                      retransmitting;
 
 
@@ -120,17 +275,38 @@ namespace tn {
       fc::time_point            next_syn_time;
       fc::time_point            last_rx_time; // last packet received
 
-      typedef std::list<data_packet> dp_list;
-      dp_list rx_win;
-      dp_list tx_win;
+      congestion_control::ptr   cc;
+      arrival_history           rx_history;
+      // RFC 6298 estimate from our ack/ack2 round trips, or from the ones
+      // the remote host reports while we only send
+      uint32_t                  srtt_us;
+      uint32_t                  rttvar_us;
+      bool                      rtt_measured;
+
+      fc::future<void>          rto_timer;
+      bool                      rto_running;
+      uint32_t                  rto_backoff;
+      fc::time_point            last_tx_progress; // last ack that advanced, or the first send after idle
+      uint64_t                  tx_count;     // data packets written, the index of the next
+      double                    next_send_us; // earliest time the next data packet may leave
+      int64_t                   rx_reserved;  // bytes of rx_budget_used held by our rx window
+
+      typedef seq_ring<data_packet> dp_ring;
+      dp_ring rx_win;
+      dp_ring tx_win;                         // holds tx_head through next_tx_seq
+      seq_num tx_head;
 
       channel                chan;
 
-      udt_channel_private( const channel& c, uint16_t mwp )
-      :syn_timer_running(false),next_tx_seq(0),chan(c) {
-        start_up                  = true;
-        dec_on_nack               = true;
+      udt_channel_private( const channel& c, uint32_t mwp )
+      :syn_timer_running(false),next_tx_seq(0),
+       cc( congestion_control::create( c.get_node().get_config().udt_congestion ) ),
+       srtt_us(initial_rtt_us),rttvar_us(initial_rtt_us/2),rtt_measured(false),
+       rto_running(false),rto_backoff(1),
+       tx_count(0),next_send_us(0),rx_reserved(0),tx_head(1),chan(c) {
         started_retran            = false;
+        peer_sack                 = false;
+        peer_seq32                = false;
         retransmitting            = false;
                                   
         last_rx_ack.rx_win_start  = 1;
@@ -142,7 +318,13 @@ namespace tn {
         rx_ack_pack.flags         = packet::ack;
         rx_ack_pack.rx_win_start  = 1;
         rx_ack_pack.rx_win_end    = 0;
-        rx_ack_pack.rx_win_size   = mwp;
+        rx_ack_pack.rx_win_size   = (std::min)( (std::max)( mwp, 1u ), uint32_t(max_win16) );
+        rx_ack_pack.features      = packet::feature_seq32;
+        tx_ack2_pack.features     = packet::feature_seq32;
+        // the window the channel is opened with is granted whatever the
+        // budget, only growing it beyond is limited
+        rx_reserved               = int64_t(rx_ack_pack.rx_win_size) * chan.max_payload();
+        rx_budget_used           += rx_reserved;
         tx_ack2_pack.rx_win_start = 1;
         tx_win_size               = 1;
         remote_rx_win             = 1;
@@ -157,19 +339,22 @@ namespace tn {
              syn_timer_complete.wait();
              wlog( "done!" );
           }
+          if( rto_running ) {
+             rto_timer.cancel();
+             rto_timer.wait();
+             rto_running = false;
+          }
           wlog( "~udt_channel_impl %d", syn_timer_running );
 
         assert( !syn_timer_running );
         chan.close();
+        release_rx_budget();
       }
 
       void close(bool send_close = false) {
         if( send_close ) {
             if( static_cast<bool>(chan) ) {
-                tn::buffer b;
-                fc::datastream<char*> ds(b.data(),b.size());
-                ds << rx_ack_pack;
-                b.resize(1);
+                tn::buffer b( 1, channel::send_headroom, channel::send_tailroom );
                 b.data()[0] = packet::close;
 
                 //slog( "send close" );
@@ -181,12 +366,19 @@ namespace tn {
         tx_win_avail(); // if someone is reading...
         rx_win.clear();
         tx_win.clear();
+        tx_head = next_tx_seq+1;
         rx_ack_pack.missed_seq.clear();
+        release_rx_budget();
+      }
+
+      void release_rx_budget() {
+        rx_budget_used -= rx_reserved;
+        rx_reserved     = 0;
       }
       bool can_send() {
         // tx_ack2_pack.rx_win_start the last known start of remote recv window.
         //return next_tx_seq < (tx_ack2_pack.rx_win_start + tx_win_size);
-        return next_tx_seq < (last_rx_ack.rx_win_start + tx_win_size);
+        return next_tx_seq < (last_rx_ack.rx_win_start + int(tx_win_size));
       }
       void stop_syn_timer() {
      //   slog( "stoping syn timer" );
@@ -197,8 +389,8 @@ namespace tn {
         m_stop_syn_timer = false;
         if( !syn_timer_running ) {
           //slog( "starting syn timer" );
-          next_syn_time = fc::time_point::now() + fc::milliseconds(100);
-          syn_timer_complete = chan.get_node().get_thread().schedule( [this](){ on_syn(); },next_syn_time, "on_syn", fc::priority::max());
+          next_syn_time = fc::time_point::now() + fc::microseconds( ack_interval_us() );
+          syn_timer_complete = chan.get_thread().schedule( [this](){ on_syn(); },next_syn_time, "on_syn", fc::priority::max());
           syn_timer_running = true;
         }
       }
@@ -222,18 +414,15 @@ namespace tn {
         while( tx_miss_list.pop_front(sq) ) {
          //   elog( "retransmitting       %1%", sq.value() );
           
-           dp_list::iterator i = tx_win.begin();
-           dp_list::iterator e = tx_win.end();
-           while( i != e && i->seq != sq ) {++i;}
-           if( i != e && i->seq == sq ) {
+           data_packet* i = tx_win.find( sq.value() );
+           if( i ) {
           //    elog( "       retransmit %1%", sq.value() );
               if( i->last_sent_ack_seq + 2 < tx_ack2_pack.ack_seq ) {
                   i->last_sent_ack_seq = tx_ack2_pack.ack_seq+1;
-                  send( i->data.subbuf( -5 ) );
+                  send_data( i->data.subbuf( -int32_t(data_header(i->flags)) ) );
               }
            } else {
-              elog( "unable to retransmit packet %1%, not in tx queue", sq.value() );
-              exit(1);
+              wlog( "unable to retransmit packet %1%, not in tx queue", sq.value() );
            }
         }
        // elog( "done retransmitting!" );
@@ -241,6 +430,92 @@ namespace tn {
       }
 
 
+      /// how often the receiver acks, a quarter of the rtt
+      uint32_t ack_interval_us()const {
+        return (std::min)( (std::max)( srtt_us / 4, uint32_t(min_ack_interval_us) ), uint32_t(max_ack_interval_us) );
+      }
+
+      /**
+       *  RFC 6298 with the time the receiver may hold its ack added, doubled
+       *  for every timeout without progress.
+       */
+      int64_t rto_us()const {
+        int64_t r = int64_t(srtt_us) + (std::max)( 4*int64_t(rttvar_us), int64_t(min_ack_interval_us) ) + ack_interval_us();
+        r = (std::max)( r, int64_t(min_rto_us) ) * rto_backoff;
+        return (std::min)( r, int64_t(max_rto_us) );
+      }
+
+      void update_rtt( uint32_t r ) {
+        if( !rtt_measured ) {
+          srtt_us      = r;
+          rttvar_us    = r / 2;
+          rtt_measured = true;
+        } else {
+          uint32_t d = srtt_us > r ? srtt_us - r : r - srtt_us;
+          rttvar_us  = uint32_t( (3*uint64_t(rttvar_us) + d) / 4 );
+          srtt_us    = uint32_t( (7*uint64_t(srtt_us)   + r) / 8 );
+        }
+      }
+
+      /// true while the last ack did not confirm everything we sent
+      bool tx_outstanding()const {
+        return tx_win.size() && ( last_rx_ack.rx_win_end < next_tx_seq || last_rx_ack.missed_seq.size() );
+      }
+
+      void start_rto_timer() {
+        if( rto_running ) return;
+        rto_running      = true;
+        last_tx_progress = fc::time_point::now();
+        rto_timer = chan.get_thread().schedule( [this](){ on_rto(); }, 
+                        last_tx_progress + fc::microseconds( rto_us() ), "udt_rto", fc::priority::max() );
+      }
+
+      /**
+       *  Nothing was acked for an rto, so the congestion control backs off
+       *  and the oldest packet the last ack did not confirm is sent again.
+       *  This repairs a lost tail that no later packet would reveal, and
+       *  lost retransmissions once the receiver has stopped acking.  The
+       *  acks it provokes drive the retransmission of the rest.
+       */
+      void on_rto() {
+        try {
+          if( !static_cast<bool>(chan) || !tx_outstanding() ) {
+            rto_running = false;
+            return;
+          }
+          fc::time_point now      = fc::time_point::now();
+          fc::time_point deadline = last_tx_progress + fc::microseconds( rto_us() );
+          if( now >= deadline ) {
+            wlog( "retransmission timeout after %lld us", rto_us() );
+            cc->on_timeout();
+            update_tx_win();
+            queue_oldest_unacked();
+            retransmit();
+            if( rto_backoff < 64 ) rto_backoff *= 2;
+            last_tx_progress = now;
+            deadline = now + fc::microseconds( rto_us() );
+          }
+          rto_timer = chan.get_thread().schedule( [this](){ on_rto(); }, deadline, "udt_rto", fc::priority::max() );
+        } catch ( ... ) {
+          rto_running = false;
+          wlog( "caught %s", fc::current_exception().diagnostic_information().c_str() );
+        }
+      }
+
+      void queue_oldest_unacked() {
+        // the first hole the last ack reported, or the first seq after it
+        seq_num sq = last_rx_ack.rx_win_end + 1, s, e;
+        if( last_rx_ack.missed_seq.find_range( tx_head, s, e ) && s < sq ) sq = s;
+        if( sq < tx_head ) sq = tx_head;
+
+        data_packet* i = tx_win.find( sq.value() );
+        if( i ) {
+          // let retransmit() send it however recently it did
+          i->last_sent_ack_seq = tx_ack2_pack.ack_seq - 5;
+          tx_miss_list.add( i->seq, i->seq );
+        }
+      }
+
       void on_syn() {
       try {
      //     slog("tx_win_size: %d  next_tx_seq: %d  remote_rx_win_start: %d  remote_rx_win_size: %d  time %lld", 
@@ -258,15 +533,15 @@ namespace tn {
           }
           send_ack();
           if( !m_stop_syn_timer ) {
-             next_syn_time += fc::milliseconds(100);
-             syn_timer_complete = chan.get_node().get_thread().schedule( [this](){ on_syn(); },next_syn_time, "on_syn", fc::priority::max());
+             next_syn_time += fc::microseconds( ack_interval_us() );
+             syn_timer_complete = chan.get_thread().schedule( [this](){ on_syn(); },next_syn_time, "on_syn", fc::priority::max());
           } else { syn_timer_running = false; m_stop_syn_timer = false; }
         } catch ( ... ) {
           wlog( "caught %s", fc::current_exception().diagnostic_information().c_str() );
         }
       }
       
-      // called from node thread
+      // called from the connection's thread
       void on_recv( const tn::buffer& b, channel::error_code ec  ) {
          if( ec ) {
              slog( "channel closed!" );
@@ -274,7 +549,8 @@ namespace tn {
              return;
          }
          last_rx_time = fc::time_point::now();
-         switch( b[0] ) {
+         if( b[0] & packet::seq32 ) peer_seq32 = true;
+         switch( b[0] & ~packet::seq32 ) {
            case packet::data: handle_data(b); return;
            case packet::ack:  handle_ack(b);  return;
            case packet::nack: handle_nack(b); return;
@@ -292,8 +568,12 @@ namespace tn {
         start_syn_timer();
         fc::datastream<const char*> ds(b.data(),b.size());
 
-        data_packet dp(b.subbuf(5));
-        ds >> dp.flags >> dp.rx_win_start >> dp.seq;
+        data_packet dp;
+        ds.read( (char*)&dp.flags, sizeof(dp.flags) );
+        read_seq( ds, dp.rx_win_start, dp.flags & packet::seq32, next_tx_seq );
+        read_seq( ds, dp.seq,          dp.flags & packet::seq32, rx_ack_pack.rx_win_end );
+        dp.data = b.subbuf( data_header(dp.flags) );
+        rx_history.on_arrival( dp.seq.value(), utc_now_us() );
 
         //slog( "seq %1%  rx win %2%   len %3% rx window: %4%->%5% ", std::string(dp.seq), dp.rx_win_start.value(), dp.data.size(), rx_ack_pack.rx_win_start.value(), rx_ack_pack.rx_win_end.value() );
 
@@ -301,21 +581,21 @@ namespace tn {
 
         rx_ack_pack.missed_seq.remove( dp.seq );
         if( dp.seq == seq_num(rx_ack_pack.rx_win_end+1) ) { // most common case
-            if( dp.seq > (rx_ack_pack.rx_win_start+rx_ack_pack.rx_win_size) ) {
+            if( dp.seq > (rx_ack_pack.rx_win_start+int(rx_ack_pack.rx_win_size)) ) {
                 // THIS SHOULD NOT HAPPEN, it means transmitter sent too much
                 elog( "Window not big enough for this packet: %1%,  start %2%  size %3%", dp.seq.value(), rx_ack_pack.rx_win_start.value(), rx_ack_pack.rx_win_size );
                 return;
              }
-            rx_win.push_back(dp);
+            rx_win.insert( dp.seq.value(), dp );
             rx_ack_pack.rx_win_end = dp.seq;
         } else if( dp.seq > seq_num(rx_ack_pack.rx_win_end+1) ) { // dropped some 
-            if( dp.seq > (rx_ack_pack.rx_win_start+rx_ack_pack.rx_win_size) ) {
+            if( dp.seq > (rx_ack_pack.rx_win_start+int(rx_ack_pack.rx_win_size)) ) {
                 // THIS SHOULD NOT HAPPEN, it means transmitter sent too much
                 elog( "Window not big enough for this packet: %1%,  start %2%  size %3%", 
                        dp.seq.value(), rx_ack_pack.rx_win_start.value(), rx_ack_pack.rx_win_size );
                 return;
             } else {
-               rx_win.push_back(dp); 
+               rx_win.insert( dp.seq.value(), dp );
                seq_num sr = rx_ack_pack.rx_win_end+1;
                rx_ack_pack.rx_win_end = dp.seq;
                rx_ack_pack.missed_seq.add(sr, dp.seq -1);
@@ -327,18 +607,11 @@ namespace tn {
             wlog( "already received %1%, before rx_win-start %2% ignoring", dp.seq.value(), rx_ack_pack.rx_win_start.value() );
             return;
         } else {
-            // insert the packet into the rx win
-            dp_list::iterator i = rx_win.begin();
-            dp_list::iterator e = rx_win.end();
-            while( i != e && i->seq < dp.seq ) {  ++i; }
-            if( i != e && i->seq == dp.seq ) {
+            // fill a hole in the rx win
+            if( !rx_win.insert( dp.seq.value(), dp ) ) {
                wlog( "duplicate packet %1%, ignoring", dp.seq.value() );
                return;
             }
-            rx_win.insert(i,dp);
-            i = rx_win.begin();
-            e = rx_win.end();
-
             rx_ack_pack.missed_seq.remove( dp.seq );
         }
         if( rx_win.size() && dp.seq == (rx_ack_pack.rx_win_start) ) {
@@ -348,12 +621,18 @@ namespace tn {
       }
 
       void handle_ack( const tn::buffer& b ) {
-         dec_on_nack              = true;
          ack_packet ap;
+         ap.ref     = next_tx_seq;
+         ap.ack_ref = last_rx_ack.ack_seq;
          fc::datastream<const char*> ds(b.data(),b.size());
          ds >> ap;
+         peer_features( ap );
 
-         tx_miss_list    = ap.missed_seq;
+         // an ack older than the last one describes holes that have been
+         // filled or retransmitted since
+         bool stale = ap.ack_seq < last_rx_ack.ack_seq;
+         if( !stale )
+           take_missed( ap.missed_seq );
 
          bool could_send = can_send();
 
@@ -366,20 +645,36 @@ namespace tn {
         //        (tx_ack2_pack.rx_win_start + tx_win_size).value(), 
         //        ap.missed_seq.size(), this );
 
-         if( ap.missed_seq.size() )
+         if( !stale && tx_miss_list.size() )
              retransmit();
        //  ap.missed_seq.print();
          remote_rx_win = ap.rx_win_size;
 
-         // increase tx window incrementally
-         if( start_up ) { 
-            tx_win_size = (std::min)(uint16_t(tx_win_size*1.5 + 1), remote_rx_win );
-         }
-         else if( remote_rx_win > tx_win_size ) 
-            ++tx_win_size;
+         if( ap.ack_seq >= last_rx_ack.ack_seq ) {
+            ack_info ai;
+            ai.acked        = (std::max)( 0, int(last_rx_ack.rx_win_start.distance( ap.rx_win_start )) );
+            ai.in_flight    = (std::max)( 0, int(ap.rx_win_start.distance( next_tx_seq )) + 1 );
+            ai.window_limit = remote_rx_win;
+            ai.packet_size  = chan.max_payload() - data_header( peer_seq32 ? packet::seq32 : 0 );
+            ai.rtt_us       = rtt_measured ? srtt_us : ap.rtt_us;
+            ai.recv_rate    = ap.recv_rate;
+            ai.capacity     = ap.link_capacity;
+            cc->on_ack( ai );
+            update_tx_win();
+            if( cc->bandwidth() )
+              chan.report_bandwidth( cc->bandwidth() );
+
+            if( !rtt_measured && ap.rtt_us ) {
+              srtt_us   = ap.rtt_us;
+              rttvar_us = ap.rtt_var_us ? ap.rtt_var_us : ap.rtt_us / 2;
+            }
+            if( ai.acked || ap.rx_win_end > last_rx_ack.rx_win_end ) {
+              last_tx_progress = fc::time_point::now();
+              rto_backoff      = 1;
+            }
 
-         if( ap.ack_seq >= last_rx_ack.ack_seq )
             last_rx_ack = ap;
+         }
 
          // clear the tx buffer up to rx_win_start, notify that
          // there is room to transmit more data.
@@ -387,48 +682,51 @@ namespace tn {
 
          //slog( "this: %1%, can send: %2%  next_tx_seq %3%", this, can_send(), (uint32_t)next_tx_seq );
 
-          /*
-         dp_list::iterator i = tx_win.begin();
-         dp_list::iterator e = tx_win.end();
-         while( i != e && i->seq <= ap.rx_win_end ) {
-           if( !ap.missed_seq.contains(i->seq) )  {
-             tx_ack2_pack.missed_seq.remove(i->seq);
-             i = tx_win.erase(i);
-             continue;
-           }
-           ++i;
-         }
-         */
-
          tx_ack2_pack.flags        = packet::ack2;
          tx_ack2_pack.rx_win_start = next_tx_seq; 
           // let the remote host know the last data we sent
           // so that it can detect a dropped packet... and nack
          tx_ack2_pack.utc_time     = ap.utc_time;
          tx_ack2_pack.ack_seq      = ap.ack_seq;
+         tx_ack2_pack.legacy_miss_list = !peer_sack;
+         tx_ack2_pack.seq32        = peer_seq32;
         
          // send ack2 if our tx buffer is not full
          if( could_send ) {
           //  slog( "sending ack2 rx_win_start %d ack_seq %d  RT %lld", 
            //        (uint32_t)next_tx_seq, (uint32_t)ap.ack_seq, utc_now_us() - ap.utc_time );
-            tn::buffer b;
-            fc::datastream<char*> ds(b.data(),b.size());
-            ds << tx_ack2_pack;
-            b.resize(ds.tellp());
-            send(b);
+            send( pack_control(tx_ack2_pack) );
          } else {
             //slog( "Not sending ack2, tx buffer is full" );
          }
       }
 
+      /**
+       *  Replaces tx_miss_list with the holes of a received ack, only what
+       *  we sent and is not acked yet can be missing.
+       */
+      void take_missed( const miss_list& m ) {
+         tx_miss_list.clear();
+         if( !tx_win.size() ) return;
+         seq_num from = tx_head, st, en;
+         while( from <= next_tx_seq && m.find_range( from, st, en ) ) {
+           if( st > next_tx_seq ) break;
+           if( en > next_tx_seq ) en = next_tx_seq;
+           tx_miss_list.add( st, en );
+           if( en == next_tx_seq ) break;
+           from = en + 1;
+         }
+      }
+
       /**
        * Remove everything from this misslist before rx_win_start
        */
-      void advance_tx( uint16_t rx_win_start ) {
+      void advance_tx( seq_num rx_win_start ) {
          tx_ack2_pack.rx_win_start = rx_win_start;
-         while( tx_win.begin()!=tx_win.end() && tx_win.front().seq < rx_win_start ) {
-           tx_ack2_pack.missed_seq.remove(tx_win.front().seq);
-           tx_win.pop_front();
+         while( tx_win.size() && tx_head < rx_win_start ) {
+           tx_ack2_pack.missed_seq.remove(tx_head);
+           tx_win.erase( tx_head.value() );
+           ++tx_head;
          }
 
          // Notify write loop if we advanced the start pos!
@@ -443,6 +741,7 @@ namespace tn {
 
       void handle_nack( const tn::buffer& b ) {
          nack_packet np;
+         np.ref = next_tx_seq;
          fc::datastream<const char*> ds(b.data(),b.size());
          ds >> np;
          advance_tx( np.rx_win_start );         
@@ -450,20 +749,17 @@ namespace tn {
          elog( "nack win start %1%  dropped %2% -> %3%", 
             np.rx_win_start.value(), np.start_seq.value(), np.end_seq.value() );
          
-         // TODO: Make Random Decrease
-         // TODO: Only decrease once every SYN period (.1 sec)
-         // TODO: Update Inter Packet Period to control sending rate
-         if( dec_on_nack ) {
-             elog( "Scale back by 10%" );
-             dec_on_nack = false;
-             if( start_up ) 
-                tx_win_size *= .75;
-             else
-                 tx_win_size *= .90;   
-             start_up    = false;
-             if( tx_win_size == 0 ) tx_win_size = 1;
+         // index of the first lost packet's first transmission
+         int64_t age = np.start_seq.distance( next_tx_seq );
+         if( age >= 0 && uint64_t(age) < tx_count ) {
+           cc->on_loss( tx_count - 1 - age, tx_count );
+           update_tx_win();
          }
-         tx_miss_list.add( np.start_seq, np.end_seq );
+         // only what we sent and is not acked yet can be lost
+         seq_num st = np.start_seq < tx_head ? tx_head : np.start_seq;
+         seq_num en = np.end_seq > next_tx_seq ? next_tx_seq : np.end_seq;
+         if( tx_win.size() && st <= en )
+           tx_miss_list.add( st, en );
          retransmit();
       }
 
@@ -472,12 +768,16 @@ namespace tn {
       }
 
       void handle_ack2( const tn::buffer& b ) {
+        rx_ack2_pack.ref     = rx_ack_pack.rx_win_end;
+        rx_ack2_pack.ack_ref = rx_ack_pack.ack_seq;
         fc::datastream<const char*> ds(b.data(), b.size() );
         ds >> rx_ack2_pack;
-        //uint64_t utc_now = utc_now_us();
+        peer_features( rx_ack2_pack );
         //slog( "RTT: %d  rx_ack2_pack.rx_win_start %d  next_tx_seq %d", utc_now_us() - rx_ack2_pack.utc_time,
         //      (uint16_t)rx_ack2_pack.rx_win_start, (uint16_t)next_tx_seq );
-        // TODO: update rtt with weighted avg
+        uint64_t rtt = utc_now_us() - rx_ack2_pack.utc_time;
+        if( rtt < 60*1000000ull )
+          update_rtt( uint32_t(rtt) );
 
         // stop sending 10hz acks
         stop_syn_timer();
@@ -493,11 +793,9 @@ namespace tn {
         np.rx_win_start = rx_ack_pack.rx_win_start;
         np.start_seq = st_seq;
         np.end_seq   = end_seq;
+        np.seq32     = peer_seq32;
 
-        tn::buffer b;
-        fc::datastream<char*> ds(b.data(),b.size());
-        ds << np;
-        b.resize(ds.tellp());
+        tn::buffer b = pack_control(np);
         //wlog( "send nack %1% -> %2%  rx_win_start %3%", st_seq.value(), end_seq.value(), np.rx_win_start.value() );
         send(b);
       }
@@ -505,24 +803,91 @@ namespace tn {
       void send_ack() {
         rx_ack_pack.ack_seq++;
         rx_ack_pack.utc_time = utc_now_us();
-
-        tn::buffer b;
-        fc::datastream<char*> ds(b.data(),b.size());
-        ds << rx_ack_pack;
-        b.resize(ds.tellp());
+        rx_ack_pack.rtt_us        = rtt_measured ? srtt_us   : 0;
+        rx_ack_pack.rtt_var_us    = rtt_measured ? rttvar_us : 0;
+        rx_ack_pack.recv_rate     = rx_history.recv_rate();
+        rx_ack_pack.link_capacity = rx_history.capacity();
+        tune_rx_win();
+
+        // the whole ack must fit one datagram, with room for the original
+        // list of up to 128 ranges while the peer may not read the sack
+        uint32_t fixed = peer_seq32 ? 44 : 36 + (peer_sack ? 1 : 513);
+        uint32_t room  = chan.max_payload();
+        rx_ack_pack.seq32            = peer_seq32;
+        rx_ack_pack.legacy_miss_list = !peer_sack;
+        rx_ack_pack.sack_budget      = room > fixed ? room - fixed : 0;
+
+        tn::buffer b = pack_control(rx_ack_pack);
 
     //    slog( "send ack  ack_seq: %d    rx_win_start %d  rx_win_end %d", rx_ack_pack.ack_seq.value(),
     //                rx_ack_pack.rx_win_start.value(), rx_ack_pack.rx_win_end.value() );
         send(b);
       }
     
+      void peer_features( const ack_packet& p ) {
+        if( p.has_sack )                              peer_sack  = true;
+        if( p.features & packet::feature_seq32 )      peer_seq32 = true;
+      }
+
+      /**
+       *  Grows the receive window to twice the bandwidth-delay product the
+       *  sender achieves so that it does not limit the transfer, as far as
+       *  the process wide budget allows.  It never shrinks, the sender may
+       *  have filled it already.
+       */
+      void tune_rx_win() {
+        uint32_t rate = rx_history.recv_rate();
+        if( !rate || !rtt_measured || !static_cast<bool>(chan) ) return;
+
+        uint64_t want = 2 * uint64_t(rate) * srtt_us / 1000000 + 16;
+        want = (std::min)( want, uint64_t(peer_seq32 ? max_win32 : max_win16) );
+        if( want <= rx_ack_pack.rx_win_size ) return;
+
+        int64_t pkt    = chan.max_payload();
+        int64_t budget = int64_t(chan.get_node().get_config().udt_rx_budget_mb) << 20;
+        int64_t used   = rx_budget_used.load();
+        int64_t n;
+        do {
+          n = (std::min)( int64_t(want - rx_ack_pack.rx_win_size), (budget - used) / pkt );
+          if( n <= 0 ) return;
+        } while( !rx_budget_used.compare_exchange_weak( used, used + n * pkt ) );
+        rx_reserved             += n * pkt;
+        rx_ack_pack.rx_win_size += uint32_t(n);
+      }
+
+      /**
+       *  The congestion control's window, never more than the remote host
+       *  can receive or 16 bit seqs can tell apart.
+       */
+      void update_tx_win() {
+        uint32_t w = (std::min)( cc->window(), remote_rx_win );
+        if( !peer_seq32 ) w = (std::min)( w, uint32_t(max_win16) );
+        tx_win_size = (std::max)( 1u, w );
+      }
+
      /**
-     *  You can only send at the average inter-packet-rate. 
+     *  You can only send data at the average inter-packet-rate. 
      *  Retransmissions will count against the inter-packet-rate.  
+     *
+     *  Each data packet reserves the next send slot before sleeping until
+     *  it, waits too short to sleep for are made up by later packets.  The
+     *  second packet of a pair reserves a slot but leaves right away so the
+     *  receiver can measure the link capacity.
      */
+      void send_data( const tn::buffer& b, bool back_to_back = false ) {
+        double iv = cc->send_interval_us();
+        if( iv > 0 ) {
+          double now = utc_now_us();
+          if( next_send_us < now ) next_send_us = now; // idle time does not buy a burst
+          double slot = back_to_back ? now : next_send_us;
+          next_send_us += iv;
+          if( slot - now >= min_sleep_us ) 
+            fc::usleep( fc::microseconds( int64_t(slot - now) ) );
+        }
+        send(b);
+      }
+
       void send( const tn::buffer& b ) {
-       // TODO check Inter Packet Time... usleep if we are sending
-       // too quickly!
        //  slog( "send %1%", b.size() );
         chan.send(b);
       }
@@ -531,7 +896,7 @@ namespace tn {
 
 
   udt_channel::udt_channel(){}
-  udt_channel::udt_channel( const channel& c, uint16_t rx_win_size )
+  udt_channel::udt_channel( const channel& c, uint32_t rx_win_size )
   :my(new udt_channel_private( c, rx_win_size ) ) {
   }
 
@@ -544,16 +909,15 @@ namespace tn {
 
 
   size_t udt_channel::read( const fc::mutable_buffer& b ) {
-    if( &fc::thread::current() != &my->chan.get_node().get_thread() ) {
-      return my->chan.get_node().get_thread().async( [=](){ return this->read( b );} ).wait();
+    if( &fc::thread::current() != &my->chan.get_thread() ) {
+      return my->chan.get_thread().async( [=](){ return this->read( b );} ).wait();
     }
    
     char*       data = b.data;
     uint32_t    len  = b.size;
 
     while( len ) {
-      while( !my->rx_win.size() || my->rx_win.front().seq != my->rx_ack_pack.rx_win_start ) {
-        //slog( "waiting for data!  %d != %d", my->rx_win.front().seq.value(),  my->rx_ack_pack.rx_win_start.value() );
+      while( !my->rx_win.find( my->rx_ack_pack.rx_win_start.value() ) ) {
         fc::wait( my->rx_win_avail );
         if( !static_cast<bool>(my->chan) ) {
           //elog( "channel closed!" );
@@ -561,7 +925,7 @@ namespace tn {
         }
         //slog( "data avail!" );
       }
-      data_packet& dp = my->rx_win.front();
+      data_packet& dp = *my->rx_win.find( my->rx_ack_pack.rx_win_start.value() );
       uint32_t clen = (std::min)(size_t(len),size_t(dp.data.size()));
       memcpy( data, dp.data.data(), clen );
 
@@ -570,8 +934,8 @@ namespace tn {
 
       dp.data.move_start(clen);
       if( dp.data.size() == 0 ) {
+          my->rx_win.erase( my->rx_ack_pack.rx_win_start.value() );
           my->rx_ack_pack.rx_win_start++;
-          my->rx_win.pop_front();
       }
     }
 
@@ -582,8 +946,8 @@ namespace tn {
    *  This method will block until all of the contents of @param b have been sent. 
    */
   size_t udt_channel::write( const fc::const_buffer& b ) {
-    if( &fc::thread::current() != &my->chan.get_node().get_thread() ) {
-      return my->chan.get_node().get_thread().async( [=](){ return write(b); } ).wait();
+    if( &fc::thread::current() != &my->chan.get_thread() ) {
+      return my->chan.get_thread().async( [=](){ return write(b); } ).wait();
     }
     /*
      *  You can only send if the tx window is not full, otherwise you must wait.
@@ -595,23 +959,26 @@ namespace tn {
 
     int count = 0;
     while( len ) {
-       tn::buffer  pbuf;
-       data_packet     dp( pbuf.subbuf( 5 ) );
-       dp.flags        = packet::data;
+       // the channel adds its headers in front of pbuf and encrypts it from
+       // there, tx_win keeps pbuf for retransmission.  Each packet fills one
+       // datagram of the path mtu the connection has found so far.
+       uint8_t     flags    = packet::data | (my->peer_seq32 ? packet::seq32 : 0);
+       uint32_t    hdr      = data_header(flags);
+       uint32_t    max_plen = my->chan.max_payload() - hdr;
+       tn::buffer  pbuf( hdr + max_plen, channel::send_headroom, channel::send_tailroom );
+       data_packet     dp( pbuf.subbuf( hdr ) );
+       dp.flags        = flags;
        dp.rx_win_start = my->rx_ack_pack.rx_win_start;
        dp.seq          = ++my->next_tx_seq;
        dp.last_sent_ack_seq = my->tx_ack2_pack.ack_seq - 5;
-       int  plen = (fc::min)(uint32_t(len),uint32_t(1200));
+       int  plen = (fc::min)(uint32_t(len),max_plen);
        dp.data.resize(plen);
        memcpy( dp.data.data(), data, plen );
        data += plen;
        len  -= plen;
 
-       pbuf[0] = packet::data;
-       memcpy(pbuf.data()+1, &dp.rx_win_start, sizeof(dp.rx_win_start) );
-       memcpy(pbuf.data()+3, &dp.seq,          sizeof(dp.seq) );
-      
-       pbuf.resize( 5 + plen );
+       dp.pack_header( pbuf.data() );
+       pbuf.resize( hdr + plen );
 
        // it is possible for other senders (retrans) to wake up 
        // first and steal our slot, so we must check again
@@ -630,10 +997,12 @@ namespace tn {
 
        }
        my->tx_ack2_pack.missed_seq.add(dp.seq,dp.seq);
-       my->tx_win.push_back(dp);
+       my->tx_win.insert( dp.seq.value(), dp );
+       ++my->tx_count;
+       my->start_rto_timer();
 
 //       slog( "send seq %1%  size: %2% ", dp.seq.value(), dp.data.size() );
-       my->send(pbuf);
+       my->send_data( pbuf, arrival_history::is_pair_second( dp.seq.value() ) );
        ++count;
        fc::yield();
        //if( count % 60 == 59 ) {